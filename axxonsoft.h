@@ -0,0 +1,113 @@
+//
+// C interface of the axxonsoft line counting library.
+//
+
+#ifndef AXXONSOFT_H
+#define AXXONSOFT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The library is built from main.cpp as libaxxonsoft and can be called from any runtime with a C
+ * FFI. A context owns a pool of worker threads that stays up between calls, so repeated requests
+ * do not pay for thread start up. All results are written to buffers provided by the caller.
+ * Line counts are those of std::getline: a last line without a newline counts.
+ *
+ * A context can be used from several threads at once. Synchronous functions must not be called
+ * from a completion callback, the callback runs on a pool thread.
+ */
+
+#define AXXONSOFT_OK 0
+#define AXXONSOFT_ERROR_ARGUMENT (-1) /* null pointer or bad argument */
+#define AXXONSOFT_ERROR_IO (-2) /* a path could not be opened or read */
+#define AXXONSOFT_ERROR_INTERNAL (-3) /* out of memory or another unexpected failure */
+#define AXXONSOFT_ERROR_BUSY (-4) /* admission control refused a job, retry later */
+
+#define AXXONSOFT_LINES_ERROR UINT64_MAX /* line count of a file that could not be read */
+
+typedef struct axxonsoft_context axxonsoft_context;
+
+/* Called once an asynchronous request is done, status is one of the AXXONSOFT_ codes. */
+typedef void (*axxonsoft_callback)(void *user_data, int status);
+
+/* Create a context with the given number of worker threads, 0 for one per hardware thread. NULL on error. */
+axxonsoft_context *axxonsoft_create(unsigned threads);
+
+/* Wait for pending requests and release the context. */
+void axxonsoft_destroy(axxonsoft_context *context);
+
+/*
+ * Count lines of count files. lines[i] receives the lines of paths[i], or AXXONSOFT_LINES_ERROR if
+ * the file could not be read, in which case AXXONSOFT_ERROR_IO is returned after all other files
+ * are counted.
+ */
+int axxonsoft_count_files(axxonsoft_context *context, const char *const *paths, size_t count, uint64_t *lines);
+
+/*
+ * Same as axxonsoft_count_files but returns at once, callback is called when lines is complete.
+ * paths and lines must stay valid until then. Returns AXXONSOFT_OK if the request was queued.
+ */
+int axxonsoft_count_files_async(axxonsoft_context *context, const char *const *paths, size_t count, uint64_t *lines,
+                                axxonsoft_callback callback, void *user_data);
+
+/* Count lines of the regular files of a directory, files may be NULL. */
+int axxonsoft_count_directory(axxonsoft_context *context, const char *directory, uint64_t *total_lines,
+                              uint64_t *files);
+
+/*
+ * Directory count jobs of several clients share the worker threads of a context. Jobs with a higher
+ * priority are served first; clients at the same priority get worker time in proportion to their
+ * weights, whatever the size of their jobs, so a small job does not wait behind a large scan of
+ * another client. A context admits a bounded number of unfinished jobs, in total and per client.
+ */
+
+typedef struct axxonsoft_job axxonsoft_job;
+
+#define AXXONSOFT_JOB_QUEUED 0
+#define AXXONSOFT_JOB_RUNNING 1
+#define AXXONSOFT_JOB_DONE 2
+
+typedef struct axxonsoft_job_stats {
+    uint64_t id;
+    int state; /* AXXONSOFT_JOB_ */
+    uint64_t files;
+    uint64_t failed_files;
+    uint64_t bytes;
+    uint64_t bytes_done;
+    uint64_t lines;
+    uint64_t tasks;
+    uint64_t tasks_done;
+    double queued_seconds; /* from submission to the start of the first task */
+    double running_seconds; /* from then to the end of the job, or to now */
+} axxonsoft_job_stats;
+
+/*
+ * Queue a job counting the lines of the regular files of a directory for client, which may be NULL.
+ * weight is the share of the client relative to other clients (0 is taken as 1); the latest weight
+ * given by a client applies. Returns AXXONSOFT_ERROR_BUSY if the job is not admitted.
+ */
+int axxonsoft_submit_job(axxonsoft_context *context, const char *directory, const char *client, unsigned weight,
+                         int priority, axxonsoft_job **job);
+
+/* Wait for the job, AXXONSOFT_ERROR_IO if some files could not be read. Not from a callback. */
+int axxonsoft_job_wait(axxonsoft_job *job, uint64_t *total_lines);
+
+/* Progress and timings of a job, at any time. */
+int axxonsoft_job_get_stats(axxonsoft_job *job, axxonsoft_job_stats *stats);
+
+/* Release a job handle, the job itself still runs to completion. */
+void axxonsoft_job_release(axxonsoft_job *job);
+
+/* Static description of a status code. */
+const char *axxonsoft_status_string(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AXXONSOFT_H
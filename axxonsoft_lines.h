@@ -0,0 +1,208 @@
+//
+// C++ line visiting interface of the axxonsoft line counting library.
+//
+
+#ifndef AXXONSOFT_LINES_H
+#define AXXONSOFT_LINES_H
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Zero-copy line iteration for C++ callers of libaxxonsoft, the same types the command line tool
+ * counts with. LineRange walks a memory range (e.g. a MappedFile), LineReader reads a file through
+ * a pooled buffer. Both hand out std::string_view lines without terminators, one at a time through
+ * iterators or in batches of LINE_BATCH_SIZE views.
+ */
+
+#define LINE_BATCH_SIZE 1024 // line views handed out per batch callback
+
+/**
+ * Read-only memory mapping of a whole file. Empty files are represented by a null data pointer.
+ */
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const std::filesystem::path &file_path);
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+};
+
+/**
+ * Zero-copy lines of a memory range, e.g. a MappedFile. Lines are std::string_view into the range,
+ * terminators ("\n" or "\r\n") excluded, and a last line without a terminator is a line too, as
+ * with std::getline.
+ *
+ *     for (std::string_view line: LineRange{map.data, map.size}) { ... }
+ */
+struct LineRange {
+    struct iterator {
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = const std::string_view &;
+
+        const char *cursor = nullptr; // start of the current line, the range end once exhausted
+        const char *line_end = nullptr; // its newline or the range end
+        const char *end = nullptr;
+        std::string_view line;
+
+        iterator() = default;
+        iterator(const char *cursor, const char *end);
+        reference operator*() const { return line; }
+        pointer operator->() const { return &line; }
+        iterator &operator++();
+        iterator operator++(int);
+        bool operator==(const iterator &other) const { return cursor == other.cursor; }
+        bool operator!=(const iterator &other) const { return cursor != other.cursor; }
+    };
+
+    const char *data = nullptr;
+    size_t size = 0;
+
+    LineRange(const char *data, size_t size) : data{data}, size{size} {}
+    iterator begin() const { return {data, data + size}; }
+    iterator end() const { return {data + size, data + size}; }
+
+    /**
+     * Call batch_function(lines, count) with arrays of up to LINE_BATCH_SIZE line views.
+     */
+    template<typename BatchFunction>
+    void for_each_batch(BatchFunction &&batch_function) const {
+        std::array<std::string_view, LINE_BATCH_SIZE> batch;
+        size_t count = 0;
+        for (std::string_view line: *this) {
+            batch[count++] = line;
+            if (count == batch.size()) {
+                batch_function(static_cast<const std::string_view *>(batch.data()), count);
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            batch_function(static_cast<const std::string_view *>(batch.data()), count);
+        }
+    }
+};
+
+/**
+ * Fixed-size read buffers shared by LineReader instances, a reader takes one on construction and
+ * gives it back when destroyed, so opening many files does not allocate once the pool is warm.
+ * New buffers are reserved from the memory governor, when it is exhausted readers wait for a
+ * returned buffer.
+ */
+struct BufferPool {
+    explicit BufferPool(size_t buffer_size) : buffer_size{buffer_size} {}
+    std::unique_ptr<char[]> acquire();
+    void release(std::unique_ptr<char[]> buffer);
+
+    const size_t buffer_size;
+    std::mutex mutex;
+    std::condition_variable buffer_returned;
+    std::vector<std::unique_ptr<char[]>> free_buffers;
+    size_t outstanding = 0; // buffers handed out and not yet released
+};
+
+BufferPool &line_buffer_pool(); // pool of 1 MB buffers
+
+/**
+ * Zero-copy lines of a file read through a pooled buffer, for inputs that should not be mapped.
+ * Views point into the buffer and stay valid until the next call to next(). A line straddling two
+ * reads is assembled in a carry buffer that keeps its capacity, so the only copies are of those
+ * lines and, once the carry buffer has grown to the longest straddling line, nothing allocates.
+ *
+ *     LineReader reader{path};
+ *     for (std::string_view line: reader) { ... }
+ */
+struct LineReader {
+    struct iterator {
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = const std::string_view &;
+
+        LineReader *reader = nullptr; // null once exhausted
+        std::string_view line;
+
+        reference operator*() const { return line; }
+        pointer operator->() const { return &line; }
+        iterator &operator++();
+        bool operator==(const iterator &other) const { return reader == other.reader; }
+        bool operator!=(const iterator &other) const { return reader != other.reader; }
+    };
+
+    explicit LineReader(const std::filesystem::path &file_path, BufferPool &pool = line_buffer_pool());
+    LineReader(const LineReader &) = delete;
+    LineReader &operator=(const LineReader &) = delete;
+    ~LineReader();
+
+    bool next(std::string_view &line);
+    iterator begin();
+    iterator end() { return {}; }
+
+    /**
+     * Call batch_function(lines, count) with arrays of up to LINE_BATCH_SIZE line views. The views
+     * of a batch stay valid until batch_function returns.
+     */
+    template<typename BatchFunction>
+    void for_each_batch(BatchFunction &&batch_function) {
+        std::array<std::string_view, LINE_BATCH_SIZE> batch;
+        size_t count = 0;
+        auto flush = [&] {
+            if (count > 0) {
+                batch_function(static_cast<const std::string_view *>(batch.data()), count);
+                count = 0;
+            }
+        };
+        do {
+            for (const char *newline; (newline = static_cast<const char *>(
+                    std::memchr(cursor, '\n', filled_end - cursor))) != nullptr; cursor = newline + 1) {
+                if (carrying) {
+                    carry.append(cursor, newline);
+                    batch[count++] = strip_carriage_return(carry);
+                    carrying = false;
+                } else {
+                    batch[count++] = strip_carriage_return({cursor, static_cast<size_t>(newline - cursor)});
+                }
+                if (count == batch.size()) {
+                    flush();
+                }
+            }
+            flush(); // the buffer and the carry are reused below
+            carry_tail();
+        } while (fill());
+        if (carrying) {
+            carrying = false;
+            batch[count++] = strip_carriage_return(carry);
+            flush();
+        }
+    }
+
+    BufferPool &pool;
+    std::unique_ptr<char[]> buffer;
+    int fd = -1;
+    const char *cursor = nullptr;
+    const char *filled_end = nullptr;
+    std::string carry;
+    bool carrying = false; // the carry holds the start of the next line
+
+    bool fill();
+    void carry_tail();
+    static std::string_view strip_carriage_return(std::string_view line);
+};
+
+#endif // AXXONSOFT_LINES_H
@@ -0,0 +1,68 @@
+//
+// Plugin interface of axxonsoft_test.
+//
+
+#ifndef AXXONSOFT_PLUGIN_H
+#define AXXONSOFT_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A plugin is a shared object loaded with -plugin=PATH that exports the functions below with C
+ * linkage. Every worker thread calls axxonsoft_plugin_init once and passes the returned state to
+ * axxonsoft_plugin_process for the buffers of the files it reads, a state is never used by two
+ * threads at once. Worker states are then merged into one with axxonsoft_plugin_merge and
+ * axxonsoft_plugin_finalize reports the result and releases it.
+ *
+ * The buffers of a file arrive in order on one thread. A buffer ends at a line end, unless it is the
+ * last one of the file, which may be empty, or a single line is longer than a whole buffer. Buffers
+ * are owned by the host and reused after axxonsoft_plugin_process returns.
+ *
+ * Functions returning int return 0 on success, anything else stops the run.
+ */
+
+#define AXXONSOFT_PLUGIN_ABI_VERSION 1
+
+typedef struct axxonsoft_buffer {
+    const char *data;
+    size_t size;
+    const char *file_path; /* null-terminated */
+    uint64_t file_index;
+    uint64_t offset; /* of data in the file */
+    int last; /* non-zero for the last buffer of the file */
+} axxonsoft_buffer;
+
+/* Receives the report of axxonsoft_plugin_finalize, text does not need to be null-terminated. Calls
+ * append, a report may be emitted in several pieces. */
+typedef void (*axxonsoft_emit_function)(void *context, const char *text, size_t size);
+
+/* Must return AXXONSOFT_PLUGIN_ABI_VERSION of the header the plugin was built with. */
+int axxonsoft_plugin_abi_version(void);
+
+/* Create a worker state, arguments come from -plugin-args (an empty string by default). NULL on error. */
+void *axxonsoft_plugin_init(const char *arguments);
+
+int axxonsoft_plugin_process(void *state, const axxonsoft_buffer *buffer);
+
+/* Merge other into state and release other. */
+int axxonsoft_plugin_merge(void *state, void *other);
+
+/* Report the result through emit and release the state. */
+int axxonsoft_plugin_finalize(void *state, axxonsoft_emit_function emit, void *context);
+
+typedef int (*axxonsoft_plugin_abi_version_function)(void);
+typedef void *(*axxonsoft_plugin_init_function)(const char *arguments);
+typedef int (*axxonsoft_plugin_process_function)(void *state, const axxonsoft_buffer *buffer);
+typedef int (*axxonsoft_plugin_merge_function)(void *state, void *other);
+typedef int (*axxonsoft_plugin_finalize_function)(void *state, axxonsoft_emit_function emit, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AXXONSOFT_PLUGIN_H
@@ -6,10 +6,97 @@
 #include <filesystem>
 #include <vector>
 #include <algorithm>
+#include <array>
 #include <future>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include <charconv>
+#include <stdexcept>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <iterator>
+#include <string_view>
+#include <cerrno>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "axxonsoft.h"
+#include "axxonsoft_lines.h"
+#include "axxonsoft_plugin.h"
+
+#if defined(AXXONSOFT_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#endif
 
 #define NCOUNT_BUFFER_SIZE (1 * 1024 * 1024) // 1 MB for buffer
+#define MATRIX_BINARY_MAGIC "AXTRIMAT" // 8 bytes magic of the binary triangular matrix format
+#define KEY_VALUE_BINARY_MAGIC "AXKVTAB1" // 8 bytes magic of the binary key-value table format
+#define PARALLEL_CHUNK_MIN_SIZE (1 * 1024 * 1024) // 1 MB, smaller inputs are not split between threads
+#define FORMAT_SNIFF_SIZE (4 * 1024) // 4 KB sample used to detect the format of a file
+#define DISTINCT_PARTITION_BITS 8 // distinct lines are partitioned by the top 8 bits of their hash
+#define DISTINCT_PARTITIONS (1 << DISTINCT_PARTITION_BITS)
+#define DISTINCT_SPLIT_BITS 4 // partitions over their share of the memory limit split by 4 more hash bits
+#define DISTINCT_SPLITS (1 << DISTINCT_SPLIT_BITS)
+#define DISTINCT_MEMORY_LIMIT_MB 512 // default memory limit of distinct line counting, records and deduplication
+#define HLL_PRECISION 14 // 2^14 HyperLogLog registers, about 0.8% standard error
+#define HLL_BINARY_MAGIC "AXHLL001" // 8 bytes magic of the HyperLogLog sketch file format
+#define HLL_NAME_LIMIT (64 * 1024) // longer sketch names (file paths) in a sketch file are rejected
+#define HEAVY_HITTERS_DEPTH 4 // count-min sketch rows
+#define HEAVY_HITTERS_WIDTH (1 << 18) // count-min sketch counters per row, must be a power of two
+#define HEAVY_HITTERS_CAPACITY 1024 // minimum number of candidate lines kept by a heavy hitters summary
+#define MINHASH_SHINGLE_LINES 2 // lines per shingle
+#define MINHASH_BIN_BITS 7
+#define MINHASH_BINS (1 << MINHASH_BIN_BITS) // 128 values per MinHash signature
+#define MINHASH_BANDS 16 // LSH bands of 8 signature values
+#define CDC_MIN_CHUNK (2 * 1024) // content-defined chunks are at least 2 KB
+#define CDC_AVERAGE_CHUNK (8 * 1024) // 8 KB normal chunk size
+#define CDC_MAX_CHUNK (64 * 1024) // 64 KB at most
+#define CDC_STRICT_MASK_BITS 15 // gear hash bits that must be zero for a cut before the normal size
+#define CDC_LOOSE_MASK_BITS 11 // and after it
+#define CDC_CACHE_MAGIC "AXCDC001" // 8 bytes magic of the chunk cache file format
+#define CDC_CACHE_ENTRY_BYTES 64 // estimated memory of a cached chunk or file entry: hash node and bucket
+#define TOKEN_TABLE_INITIAL_SLOTS 1024 // slots of a new token frequency table, a power of two
+#define MAP_CHUNK_SIZE (1 * 1024 * 1024) // 1 MB line-aligned chunks of the parallel line map
+#define MAP_WINDOW_PER_WORKER 4 // chunk outputs in flight per worker before workers wait for the writer
+#define GOVERNOR_MIN_BUFFER_SIZE (64 * 1024) // 64 KB, read buffers are not degraded below this size
+#define GOVERNOR_MIN_DISTINCT_MB 16 // the distinct line buffer is not degraded below this size
+#define CHECKSUM_BLOCK_SIZE (64 * 1024) // 64 KB blocks are counted and hashed while they are in the cache
+#define TAR_EXTENDED_HEADER_LIMIT (16 * 1024 * 1024) // larger pax or GNU long name headers are rejected
+#define SCHEDULER_TASK_SIZE (16 * 1024 * 1024) // 16 MB file ranges, the longest a scheduled task holds a worker
+#define SCHEDULER_MIN_TASK_COST (64 * 1024) // smaller tasks are charged as 64 KB, opening a file has a cost too
+#define SCHEDULER_MAX_JOBS 1024 // admitted jobs not done yet, more are refused
+#define SCHEDULER_MAX_CLIENT_JOBS 64 // the same per client
 
 // Function declarations
 std::vector<std::string> parse_cli_options(int argc, char *argv[], std::string &directory);
@@ -19,10 +106,684 @@ uint64_t count_lines_getline(const std::filesystem::path &file_path);
 uint64_t count_lines_ncount(const std::filesystem::path &file_path);
 uint64_t count_buffered_ncount(const std::filesystem::path &file_path);
 
-uint64_t count_getline_async(const std::vector<std::filesystem::directory_entry> &files);
-uint64_t count_ncount_async(const std::vector<std::filesystem::directory_entry> &files);
-uint64_t count_buffered_ncount_async(const std::vector<std::filesystem::directory_entry> &files);
+struct Verifier;
+struct ThreadPool;
+
+uint64_t count_getline_async(const std::vector<std::filesystem::directory_entry> &files,
+                             Verifier *verifier = nullptr);
+uint64_t count_ncount_async(const std::vector<std::filesystem::directory_entry> &files,
+                            Verifier *verifier = nullptr);
+uint64_t count_buffered_ncount_async(const std::vector<std::filesystem::directory_entry> &files,
+                                     Verifier *verifier = nullptr);
+
+std::string option_value(const std::vector<std::string> &options, const std::string &name);
+
+/**
+ * Process-wide memory budget. Buffers, queues, tables and caches reserve their size before
+ * allocating and release it when freed; a reservation that does not fit waits until enough is
+ * released, one that can never fit fails.
+ */
+struct MemoryGovernor {
+    size_t budget = SIZE_MAX; // bytes, unlimited unless -max-memory is given
+    size_t in_use = 0;
+    size_t peak = 0;
+    uint64_t stalls = 0; // reservations that had to wait
+    uint64_t degraded = 0; // reservations granted less than they asked for
+    std::mutex mutex;
+    std::condition_variable released;
+
+    void reserve(size_t bytes);
+    bool try_reserve(size_t bytes);
+    size_t reserve_up_to(size_t preferred, size_t minimum);
+    void release(size_t bytes);
+    void record_stall();
+};
+
+MemoryGovernor &memory_governor();
+size_t governed_workers(size_t per_worker);
+
+/**
+ * Reservation from the memory governor, released on destruction.
+ */
+struct MemoryReservation {
+    size_t bytes = 0;
+
+    MemoryReservation() = default;
+    explicit MemoryReservation(size_t bytes);
+    MemoryReservation(size_t preferred, size_t minimum);
+    MemoryReservation(MemoryReservation &&other) noexcept;
+    MemoryReservation &operator=(MemoryReservation &&other) noexcept;
+    ~MemoryReservation();
+    void resize(size_t new_bytes);
+    void merge(MemoryReservation &&other);
+};
+
+void print_memory_report(std::ostream &out);
+
+struct CopyResult {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t lines = 0;
+};
+
+uint64_t copy_and_count_file(const std::filesystem::path &source, const std::filesystem::path &destination,
+                             char *buffers[2], size_t buffer_size, ThreadPool &writer);
+CopyResult copy_and_count_tree(const std::filesystem::path &source, const std::filesystem::path &destination);
+int run_copy_mode(const std::filesystem::path &source, const std::vector<std::string> &options);
+
+/**
+ * Streaming checksums, fed block by block from the counting loop.
+ */
+struct Crc32c {
+    uint32_t value = 0xFFFFFFFF;
+
+    void update(const char *data, size_t size);
+    uint32_t digest() const { return ~value; }
+};
+
+struct Xxh3 {
+    uint64_t accumulators[8];
+    unsigned char buffer[256];
+    size_t buffered = 0;
+    size_t stripes_so_far = 0; // stripes of the current block
+    uint64_t total = 0;
+
+    Xxh3();
+    void update(const char *data, size_t size);
+    uint64_t digest() const;
+};
+
+struct Sha256 {
+    uint32_t state[8];
+    unsigned char buffer[64];
+    size_t buffered = 0;
+    uint64_t total = 0;
+
+    Sha256();
+    void update(const char *data, size_t size);
+    std::array<unsigned char, 32> digest();
+};
+
+enum ChecksumAlgorithm : unsigned {
+    checksum_crc32c = 1,
+    checksum_xxh3 = 2,
+    checksum_sha256 = 4,
+};
+
+struct FileChecksums {
+    uint64_t lines = 0;
+    std::string crc32c;
+    std::string xxh3;
+    std::string sha256;
+};
+
+FileChecksums checksum_file(const std::filesystem::path &file_path, unsigned algorithms);
+int run_manifest_mode(const std::vector<std::filesystem::directory_entry> &files,
+                      const std::vector<std::string> &options);
+int run_verify_manifest_mode(const std::filesystem::path &directory, const std::vector<std::string> &options);
+
+struct TarMember {
+    std::string name;
+    uint64_t size = 0;
+    uint64_t lines = 0;
+};
+
+/**
+ * Streaming tar (ustar, pax and GNU) parser. The archive is fed in pieces of any size; payloads of
+ * regular members are counted as they pass and never buffered.
+ */
+struct TarCounter {
+    void feed(const char *data, size_t size);
+    void finish() const;
+    bool finished() const { return zero_blocks == 2; }
+
+    std::vector<TarMember> members;
+
+private:
+    enum class Payload {
+        member, skip, pax, long_name
+    };
+
+    void parse_header();
+    void end_payload();
+
+    char header[512];
+    size_t header_fill = 0;
+    Payload payload = Payload::skip;
+    uint64_t payload_left = 0;
+    uint64_t padding_left = 0;
+    std::string extended; // payload of a pax extended or GNU long name header
+    std::string next_name; // name and size set by those headers for the next member
+    uint64_t next_size = 0;
+    bool has_next_size = false;
+    char last_byte = '\n';
+    int zero_blocks = 0;
+};
+
+std::vector<TarMember> count_tar_members(const std::filesystem::path &archive_path);
+int run_tar_mode(const std::vector<std::string> &options);
+
+struct ZipMember {
+    std::string name;
+    uint16_t method = 0; // 0 stored, 8 deflated
+    uint16_t flags = 0;
+    uint64_t compressed_size = 0;
+    uint64_t size = 0;
+    uint64_t header_offset = 0; // local file header
+    uint64_t lines = 0;
+    std::string error; // empty if the member was counted
+};
+
+std::vector<ZipMember> read_zip_directory(const char *data, size_t size);
+void count_zip_member(const char *data, size_t size, ZipMember &member, char *buffer, size_t buffer_size);
+int run_zip_mode(const std::vector<std::string> &options);
+
+uint64_t count_lines_view(const std::filesystem::path &file_path);
+uint64_t count_view_async(const std::vector<std::filesystem::directory_entry> &files, Verifier *verifier = nullptr);
+
+uint64_t count_byte(const char *data, size_t size, char byte);
+uint64_t count_newlines(const char *data, size_t size);
+void find_newlines(const char *data, size_t size, size_t base, std::vector<size_t> &positions);
+
+/**
+ * Ragged lower-triangular similarity matrix. Row i holds i + 1 values, rows are packed one after
+ * another, so the value (i, j) with j <= i lives at index i * (i + 1) / 2 + j.
+ */
+struct TriangularMatrix {
+    std::vector<std::string> labels;
+    std::vector<float> values;
+
+    float at(size_t i, size_t j) const;
+};
+
+/**
+ * Zero-copy view over a matrix stored in the binary format, backed by a memory mapping.
+ */
+struct TriangularMatrixView {
+    MappedFile map;
+    uint64_t size = 0;
+    const float *values = nullptr;
+    const uint64_t *label_offsets = nullptr;
+    const char *label_data = nullptr;
+
+    float at(size_t i, size_t j) const;
+    std::string_view label(size_t i) const;
+};
+
+TriangularMatrix read_triangular_matrix(const std::filesystem::path &file_path);
+void write_triangular_matrix_binary(const TriangularMatrix &matrix, const std::filesystem::path &file_path);
+TriangularMatrixView load_triangular_matrix_binary(const std::filesystem::path &file_path);
+int run_matrix_mode(const std::vector<std::string> &options);
+
+std::vector<std::string> split_list(const std::string &list, char separator);
+size_t next_line_start(const char *data, size_t size, size_t offset);
+size_t next_record_start(const char *data, size_t size, size_t offset);
+std::vector<size_t> split_into_chunks(const char *data, size_t size,
+                                      size_t (*next_boundary)(const char *, size_t, size_t));
+
+/**
+ * Records extracted from key-value blocks. Cells are stored record by record, fields.size() cells
+ * per record, and point into the source mapping.
+ */
+struct KeyValueTable {
+    std::vector<std::string> fields;
+    std::vector<std::string_view> cells;
+
+    size_t records() const;
+};
+
+KeyValueTable extract_key_value_records(const MappedFile &map, const std::vector<std::string> &fields);
+void write_key_value_tsv(const KeyValueTable &table, std::ostream &out);
+void write_key_value_binary(const KeyValueTable &table, std::ostream &out);
+int run_key_value_mode(const std::vector<std::string> &options);
+
+/**
+ * Layout of a fixed-width report: line types recognized by a pattern at a column, each with the
+ * fields to extract from it.
+ */
+struct FixedWidthField {
+    std::string name;
+    size_t column = 0;
+    size_t width = 0;
+};
+
+struct FixedWidthLineType {
+    std::string name;
+    size_t column = 0;
+    std::string pattern;
+    std::vector<FixedWidthField> fields;
+};
+
+struct FixedWidthLayout {
+    std::vector<FixedWidthLineType> line_types;
+};
+
+/**
+ * Rows extracted from a fixed-width report. Cells of a row start at first_cell and there are as
+ * many of them as fields of its line type, they point into the source mapping.
+ */
+struct FixedWidthRow {
+    uint64_t block;
+    size_t line_type;
+    size_t first_cell;
+};
+
+struct FixedWidthReport {
+    std::vector<FixedWidthRow> rows;
+    std::vector<std::string_view> cells;
+    uint64_t lines = 0;
+    uint64_t blocks = 0;
+};
+
+FixedWidthLayout read_fixed_width_layout(const std::filesystem::path &file_path);
+FixedWidthReport extract_fixed_width_records(const MappedFile &map, const FixedWidthLayout &layout);
+void write_fixed_width_tsv(const FixedWidthReport &report, const FixedWidthLayout &layout, std::ostream &out);
+int run_fixed_width_mode(const std::vector<std::string> &options);
+
+/**
+ * Multiple sequence alignment with per column statistics, consensus holds the most frequent
+ * residue of every column.
+ */
+struct Alignment {
+    std::vector<std::string> sequences;
+    std::vector<float> gap_fraction;
+    std::vector<float> conservation;
+    std::string consensus;
+};
+
+Alignment read_alignment(const std::filesystem::path &file_path);
+int run_alignment_mode(const std::vector<std::string> &options);
+
+/**
+ * Formats recognized by the sniffer, text must stay the last one.
+ */
+enum class FileFormat {
+    embl, tsv, matrix, key_value, report, profile, numeric, text
+};
+
+struct FormatSniff {
+    FileFormat format;
+    bool header; // the first row of a table is a header
+};
+
+struct FormatCounts {
+    FileFormat format;
+    uint64_t lines;
+    uint64_t records;
+};
+
+const char *format_name(FileFormat format);
+FormatSniff sniff_format(const char *data, size_t size);
+FormatCounts count_format_records(const std::filesystem::path &file_path);
+void print_format_report(const std::vector<std::filesystem::directory_entry> &files);
+
+uint64_t hash_bytes(const char *data, size_t size, uint64_t seed);
+
+struct DistinctLineResult {
+    uint64_t lines;
+    uint64_t distinct_lines;
+    uint64_t spilled_bytes;
+};
+
+DistinctLineResult count_distinct_lines(const std::vector<std::filesystem::directory_entry> &files,
+                                        size_t memory_limit, const std::filesystem::path &spill_directory,
+                                        std::ostream *unique_out);
+int run_distinct_mode(const std::vector<std::filesystem::directory_entry> &files,
+                      const std::vector<std::string> &options);
+
+/**
+ * HyperLogLog sketch of a set of 64-bit hashes.
+ */
+struct HyperLogLog {
+    std::vector<uint8_t> registers = std::vector<uint8_t>(size_t{1} << HLL_PRECISION);
+
+    void add(uint64_t hash);
+    void merge(const HyperLogLog &other);
+    double estimate() const;
+};
+
+int run_hyperloglog_mode(const std::vector<std::filesystem::directory_entry> &files,
+                         const std::vector<std::string> &options);
+
+/**
+ * Count-min sketch of 64-bit hash frequencies.
+ */
+struct CountMinSketch {
+    std::vector<uint32_t> counters;
+
+    CountMinSketch();
+    uint32_t add(uint64_t hash);
+    uint32_t estimate(uint64_t hash) const;
+    void merge(const CountMinSketch &other);
+};
+
+/**
+ * Most frequent lines: a count-min sketch and the `capacity` lines with the highest estimates. The
+ * sketch, the candidates and their texts are reserved from the memory governor.
+ */
+struct HeavyHitters {
+    struct Entry {
+        uint64_t hash;
+        std::string line;
+        uint64_t count; // estimate, an upper bound of the line frequency
+        size_t heap_position;
+    };
+
+    MemoryReservation reservation; // first, so it is taken before the sketch is allocated
+    size_t capacity;
+    uint64_t total = 0;
+    CountMinSketch sketch;
+    std::vector<Entry> entries;
+    std::vector<size_t> heap; // min-heap of entry indices by count
+    std::unordered_map<uint64_t, size_t> slots; // line hash to entry index
+
+    explicit HeavyHitters(size_t capacity);
+    void add(uint64_t hash, std::string_view line);
+    void merge(const HeavyHitters &other);
+    uint64_t error_bound() const;
+    std::vector<Entry> top(size_t n) const;
+    static size_t fixed_bytes(size_t capacity);
+
+private:
+    size_t text_bytes = 0; // capacity of the candidate line texts
+    void offer(uint64_t hash, std::string_view line, uint64_t count);
+    void reserve_text(size_t bytes);
+    void sift_down(size_t position);
+};
+
+int run_heavy_hitters_mode(const std::vector<std::filesystem::directory_entry> &files,
+                           const std::vector<std::string> &options);
+
+using MinHashSignature = std::vector<uint64_t>;
+
+MinHashSignature minhash_file(const char *data, size_t size, uint64_t &lines);
+double minhash_similarity(const MinHashSignature &a, const MinHashSignature &b);
+int run_near_duplicates_mode(const std::vector<std::filesystem::directory_entry> &files,
+                             const std::vector<std::string> &options);
+
+/**
+ * Line counts of previous runs: per file metadata and totals, per chunk newline counts keyed by the
+ * chunk hash. Entries are reserved from the memory governor before they are added.
+ */
+struct ChunkCache {
+    struct FileEntry {
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t inode;
+        uint64_t lines;
+        std::vector<uint64_t> chunk_keys;
+    };
+
+    MemoryReservation reservation;
+    std::unordered_map<std::string, FileEntry> files;
+    std::unordered_map<uint64_t, uint64_t> chunks;
+
+    static size_t file_bytes(size_t path_size, size_t chunk_keys);
+};
+
+size_t fastcdc_cut(const char *data, size_t size);
+ChunkCache load_chunk_cache(const std::filesystem::path &file_path);
+void save_chunk_cache(const ChunkCache &cache, const std::filesystem::path &file_path);
+int run_chunk_cache_mode(const std::vector<std::filesystem::directory_entry> &files,
+                         const std::vector<std::string> &options);
+
+/**
+ * Token frequency table: open addressing over (hash, size) keys, token texts are stored once each
+ * in `text`. A slot with a zero count is empty. Slots and text are reserved from the memory
+ * governor before they grow.
+ */
+struct TokenCounts {
+    struct Slot {
+        uint64_t hash;
+        size_t offset;
+        uint32_t size;
+        uint64_t count;
+    };
+
+    MemoryReservation reservation; // first, so it is taken before the slots are allocated
+    std::vector<Slot> slots;
+    std::string text;
+    size_t used = 0;
+
+    TokenCounts();
+    void add(uint64_t hash, const char *token, size_t size, uint64_t count);
+    void merge(const TokenCounts &other);
+    std::vector<std::pair<uint64_t, std::string_view>> sorted(size_t n) const;
+
+private:
+    void grow();
+};
+
+int run_token_frequency_mode(const std::vector<std::filesystem::directory_entry> &files,
+                             const std::vector<std::string> &options);
+
+/**
+ * Result of parsing one chunk of a CSV file. The head is the part up to the first record end, it
+ * continues a record of the previous chunk; the tail after the last record end is continued by the
+ * next chunk. Records, bad records and first_bad_record (0-based) cover records in between.
+ */
+struct CsvChunk {
+    uint64_t quotes = 0;
+    bool closed_head = false;
+    uint64_t head_separators = 0;
+    uint64_t head_bytes = 0;
+    uint64_t records = 0;
+    uint64_t bad_records = 0;
+    uint64_t first_bad_record = 0;
+    uint64_t tail_separators = 0;
+    uint64_t tail_bytes = 0;
+};
+
+struct CsvCounts {
+    uint64_t records = 0;
+    uint64_t fields = 0; // fields of the first record, expected in every record
+    uint64_t bad_records = 0;
+    uint64_t first_bad_record = 0; // 1-based
+    uint64_t respeculated_chunks = 0;
+    bool unterminated_quote = false;
+};
+
+CsvCounts count_csv_records(const char *data, size_t size, char delimiter);
+int run_csv_mode(const std::vector<std::filesystem::directory_entry> &files, const std::vector<std::string> &options);
+
+struct NormalizeResult {
+    bool changed = false;
+    uint64_t size_before = 0;
+    uint64_t size_after = 0;
+};
+
+NormalizeResult normalize_line_endings(const std::filesystem::path &file_path, bool to_crlf, bool in_place);
+int run_normalize_mode(const std::vector<std::filesystem::directory_entry> &files,
+                       const std::vector<std::string> &options);
+
+struct Utf8Report {
+    uint64_t lines = 0;
+    uint64_t newlines = 0;
+    uint64_t invalid_sequences = 0;
+    uint64_t first_invalid_offset = 0;
+    uint64_t first_invalid_line = 0; // 1-based
+};
+
+Utf8Report validate_utf8(const char *data, size_t size);
+int run_utf8_mode(const std::vector<std::filesystem::directory_entry> &files);
+
+/**
+ * User functions of map_lines_ordered. A chunk mapper gets a line-aligned chunk of a file and
+ * appends its output to the chunk buffer, a line mapper does the same for one line.
+ */
+using ChunkMapper = std::function<void(const char *data, size_t size, std::string &output)>;
+using LineMapper = std::function<void(std::string_view line, std::string &output)>;
+
+ChunkMapper map_each_line(LineMapper line_mapper);
+uint64_t map_lines_ordered(const std::vector<std::filesystem::directory_entry> &files, const ChunkMapper &mapper,
+                           std::ostream &out);
+int run_map_mode(const std::vector<std::filesystem::directory_entry> &files, const std::vector<std::string> &options);
+
+/**
+ * Plugin loaded from a shared object implementing axxonsoft_plugin.h, unloaded on destruction.
+ */
+struct Plugin {
+    void *handle = nullptr;
+    axxonsoft_plugin_init_function init = nullptr;
+    axxonsoft_plugin_process_function process = nullptr;
+    axxonsoft_plugin_merge_function merge = nullptr;
+    axxonsoft_plugin_finalize_function finalize = nullptr;
+
+    explicit Plugin(const std::filesystem::path &file_path);
+    Plugin(const Plugin &) = delete;
+    Plugin &operator=(const Plugin &) = delete;
+    ~Plugin();
+};
+
+void run_plugin(const Plugin &plugin, const std::vector<std::filesystem::directory_entry> &files,
+                const std::string &arguments, std::ostream &out);
+int run_plugin_mode(const std::vector<std::filesystem::directory_entry> &files,
+                    const std::vector<std::string> &options);
+
+/**
+ * Fixed set of worker threads running queued tasks, kept warm between requests of the C API.
+ * Pending tasks are run before the destructor joins the threads.
+ */
+struct ThreadPool {
+    explicit ThreadPool(size_t threads);
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+    void stop();
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_available;
+    bool stopping = false;
+};
+
+uint64_t count_lines_mapped(const std::filesystem::path &file_path);
+
+/**
+ * Directory count job of the JobScheduler. Files are split into ranges of at most
+ * SCHEDULER_TASK_SIZE bytes, one task each, so no job holds a worker for long.
+ */
+struct CountJob {
+    enum class State {
+        queued, running, done
+    };
+    struct Range {
+        size_t file;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    uint64_t id = 0;
+    std::string client;
+    int priority = 0;
+    std::vector<std::filesystem::path> files;
+    std::vector<uint64_t> file_sizes;
+    std::vector<Range> ranges;
+
+    // guarded by the scheduler mutex
+    State state = State::queued;
+    size_t next_range = 0;
+    size_t finished_ranges = 0;
+    uint64_t lines = 0;
+    uint64_t bytes_done = 0;
+    std::vector<bool> failed; // per file
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point finished;
+};
+
+struct JobStats {
+    uint64_t id;
+    CountJob::State state;
+    uint64_t files;
+    uint64_t failed_files;
+    uint64_t bytes;
+    uint64_t bytes_done;
+    uint64_t lines;
+    uint64_t tasks;
+    uint64_t tasks_done;
+    double queued_seconds; // from submission to the first task
+    double running_seconds; // from the first task to the end or now
+};
+
+/**
+ * Weighted fair sharing of a ThreadPool between the count jobs of several clients.
+ */
+struct JobScheduler {
+    explicit JobScheduler(ThreadPool &pool, size_t max_jobs = SCHEDULER_MAX_JOBS,
+                          size_t max_client_jobs = SCHEDULER_MAX_CLIENT_JOBS);
+    JobScheduler(const JobScheduler &) = delete;
+    JobScheduler &operator=(const JobScheduler &) = delete;
+
+    std::shared_ptr<CountJob> submit(const std::string &client, unsigned weight, int priority,
+                                     std::vector<std::filesystem::path> files);
+    uint64_t wait(CountJob &job);
+    JobStats stats(const CountJob &job);
+    void wait_idle();
+
+    uint64_t rejected = 0; // jobs refused by admission control
+
+private:
+    struct Client {
+        unsigned weight = 1;
+        double pass = 0; // virtual time consumed, advanced by task bytes / weight
+        std::deque<std::shared_ptr<CountJob>> jobs; // jobs with undispatched tasks, by priority then age
+        size_t admitted = 0; // jobs not done yet
+    };
+
+    bool take_task(std::shared_ptr<CountJob> &job, size_t &range);
+    void run_tasks();
+    void dispatch();
+
+    ThreadPool &pool;
+    const size_t max_jobs;
+    const size_t max_client_jobs;
+    std::mutex mutex;
+    std::condition_variable job_finished;
+    std::unordered_map<std::string, Client> clients;
+    double virtual_time = 0; // pass of the last client served
+    size_t tokens = 0; // pool tasks running or queued for the scheduler
+    size_t admitted = 0;
+    uint64_t next_id = 1;
+};
+
+/**
+ * Re-counts a random sample of files with the reference engine (count_lines_getline) on a
+ * low-priority background thread and records the files where an engine disagrees.
+ */
+struct Verifier {
+    struct Mismatch {
+        std::filesystem::path path;
+        std::string engine;
+        uint64_t lines;
+        uint64_t reference_lines;
+    };
+
+    explicit Verifier(double rate);
+    Verifier(const Verifier &) = delete;
+    Verifier &operator=(const Verifier &) = delete;
+    ~Verifier();
+
+    void submit(const std::filesystem::path &path, const char *engine, uint64_t lines);
+    void finish(std::ostream &out);
+
+    double rate;
+    std::mt19937_64 random;
+    std::deque<Mismatch> queue; // files waiting for the reference count, reference_lines unset
+    std::vector<Mismatch> mismatches;
+    uint64_t submitted = 0;
+    uint64_t sampled = 0;
+    uint64_t failed = 0; // files the reference engine could not read
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::thread thread;
+};
 
+#ifndef AXXONSOFT_NO_MAIN // the library build has no entry point
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         print_help();
@@ -37,6 +798,54 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (!option_value(options, "verify").empty()) {
+        // only the counting engines (-g, -n, -m, -v and the default) hand their per-file counts to the verifier
+        auto has = [&](const char *name) { return std::find(options.begin(), options.end(), name) != options.end(); };
+        bool engine = has("n") || has("g") || has("m") || has("v");
+        bool other_mode = false;
+        for (const char *mode: {"formats", "distinct", "hll", "heavy", "near-duplicates", "cdc", "tokens", "csv",
+                                "normalize", "utf8", "map"}) {
+            other_mode = other_mode || has(mode);
+        }
+        for (const char *mode: {"manifest", "verify-manifest", "copy-to", "plugin"}) {
+            other_mode = other_mode || !option_value(options, mode).empty();
+        }
+        for (const char *mode: {"matrix", "kv", "fw", "aln", "tar", "zip"}) {
+            if (!option_value(options, mode).empty()) {
+                engine = false;
+                other_mode = true;
+            }
+        }
+        if (has("b") || (!engine && other_mode)) {
+            std::cout << "-verify is only supported with -g, -n, -m, -v or the default method\n";
+            return 1;
+        }
+    }
+
+    if (!option_value(options, "matrix").empty()) {
+        return run_matrix_mode(options);
+    }
+
+    if (!option_value(options, "kv").empty()) {
+        return run_key_value_mode(options);
+    }
+
+    if (!option_value(options, "fw").empty()) {
+        return run_fixed_width_mode(options);
+    }
+
+    if (!option_value(options, "aln").empty()) {
+        return run_alignment_mode(options);
+    }
+
+    if (!option_value(options, "tar").empty()) {
+        return run_tar_mode(options);
+    }
+
+    if (!option_value(options, "zip").empty()) {
+        return run_zip_mode(options);
+    }
+
     if (directory.empty()) {
         std::cout << "No directory provided\n";
         return 1;
@@ -61,6 +870,39 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // optional memory budget, reported when the process exits
+    std::string max_memory = option_value(options, "max-memory");
+    size_t max_memory_mb = 0;
+    if (!max_memory.empty()) {
+        auto [end, error] = std::from_chars(max_memory.data(), max_memory.data() + max_memory.size(), max_memory_mb);
+        if (error != std::errc{} || end != max_memory.data() + max_memory.size() || max_memory_mb == 0) {
+            std::cout << "Invalid memory budget " << max_memory << "\n";
+            return 1;
+        }
+        memory_governor().budget = max_memory_mb * 1024 * 1024;
+    }
+    struct MemoryReportGuard {
+        bool enabled;
+        ~MemoryReportGuard() {
+            if (enabled) {
+                print_memory_report(std::cout);
+            }
+        }
+    } memory_report{max_memory_mb > 0};
+
+    // optional re-count of a sample of files with the reference engine
+    std::unique_ptr<Verifier> verifier;
+    std::string verify_rate = option_value(options, "verify");
+    if (!verify_rate.empty()) {
+        char *end = nullptr;
+        double rate = std::strtod(verify_rate.c_str(), &end);
+        if (*end != '\0' || !(rate > 0.0 && rate <= 1.0)) {
+            std::cout << "Invalid verification rate " << verify_rate << ", expected a number in (0, 1]\n";
+            return 1;
+        }
+        verifier = std::make_unique<Verifier>(rate);
+    }
+
     if (std::find(options.begin(), options.end(), "b") != options.end()) {
         /**
          * Benchmarking different methods
@@ -68,6 +910,7 @@ int main(int argc, char *argv[]) {
          * 1. getline method.
          * 2. ncount method.
          * 3. buffered ncount method.
+         * 4. zero-copy line view method.
          */
 
         std::cout << "Benchmarking...\n";
@@ -95,22 +938,83 @@ int main(int argc, char *argv[]) {
                   << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
                   << " millisecond \n";
         std::cout << "Total lines: " << lines_count << "\n";
+
+        // zero-copy line view method
+        start = std::chrono::steady_clock::now();
+        lines_count = count_view_async(files);
+        std::cout << "line view method total runing time: "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " millisecond \n";
+        std::cout << "Total lines: " << lines_count << "\n";
     } else if (std::find(options.begin(), options.end(), "n") != options.end()) {
         // ncount method
-        std::cout << "Lines count using ncount method: " << count_ncount_async(files) << "\n";
+        std::cout << "Lines count using ncount method: " << count_ncount_async(files, verifier.get()) << "\n";
     } else if (std::find(options.begin(), options.end(), "g") != options.end()) {
         // getline method
-        std::cout << "Lines count using getline method: " << count_getline_async(files) << "\n";
+        std::cout << "Lines count using getline method: " << count_getline_async(files, verifier.get()) << "\n";
     } else if (std::find(options.begin(), options.end(), "m") != options.end()) {
         // buffered ncount method
-        std::cout << "Lines count using buffered ncount method: " << count_buffered_ncount_async(files) << "\n";
+        std::cout << "Lines count using buffered ncount method: " << count_buffered_ncount_async(files, verifier.get()) << "\n";
+    } else if (std::find(options.begin(), options.end(), "v") != options.end()) {
+        // zero-copy line view method
+        std::cout << "Lines count using line view method: " << count_view_async(files, verifier.get()) << "\n";
+    } else if (std::find(options.begin(), options.end(), "formats") != options.end()) {
+        // per format files, lines and records
+        print_format_report(files);
+    } else if (std::find(options.begin(), options.end(), "distinct") != options.end()) {
+        // exact distinct lines
+        return run_distinct_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "hll") != options.end()) {
+        // approximate distinct lines and tokens
+        return run_hyperloglog_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "heavy") != options.end()) {
+        // most frequent lines
+        return run_heavy_hitters_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "near-duplicates") != options.end()) {
+        // near-duplicate files
+        return run_near_duplicates_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "cdc") != options.end()) {
+        // incremental count with the chunk cache
+        return run_chunk_cache_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "tokens") != options.end()) {
+        // token frequencies
+        return run_token_frequency_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "csv") != options.end()) {
+        // RFC 4180 CSV records
+        return run_csv_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "normalize") != options.end()) {
+        // line ending normalization
+        return run_normalize_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "utf8") != options.end()) {
+        // lines and UTF-8 validation
+        return run_utf8_mode(files);
+    } else if (!option_value(options, "manifest").empty()) {
+        // line counts and checksum manifest in one pass
+        return run_manifest_mode(files, options);
+    } else if (!option_value(options, "verify-manifest").empty()) {
+        // check files against a checksum manifest
+        return run_verify_manifest_mode(dir_path_from_cli, options);
+    } else if (!option_value(options, "copy-to").empty()) {
+        // copy the directory tree and count the copied lines
+        return run_copy_mode(dir_path_from_cli, options);
+    } else if (!option_value(options, "plugin").empty()) {
+        // custom counters from a plugin
+        return run_plugin_mode(files, options);
+    } else if (std::find(options.begin(), options.end(), "map") != options.end()) {
+        // parallel line filter with ordered output
+        return run_map_mode(files, options);
     } else {
         // default method, getline method used as a default method
-        std::cout << count_getline_async(files) << "\n";
+        std::cout << count_getline_async(files, verifier.get()) << "\n";
     }
 
+    if (verifier != nullptr) {
+        verifier->finish(std::cout);
+        return verifier->mismatches.empty() ? 0 : 1;
+    }
     return 0;
 }
+#endif // AXXONSOFT_NO_MAIN
 
 
 /**
@@ -137,63 +1041,99 @@ int main(int argc, char *argv[]) {
  * approach may be faster due to the overhead of thread creation and management with std::async.
  */
 
-uint64_t count_getline_async(const std::vector<std::filesystem::directory_entry> &files) {
+static std::vector<std::future<uint64_t>> count_files_async(const std::vector<std::filesystem::directory_entry> &files,
+                                                           uint64_t (*count_file)(const std::filesystem::path &),
+                                                           size_t per_worker) {
     /**
-     * Count lines using getline method.
+     * Count every file in its own std::async. With a memory budget the files are counted by
+     * governed_workers(per_worker) threads instead, so a large directory does not start one reader
+     * per file.
      *
      * @param files vector of files to count lines
-     * @return total lines count
+     * @param count_file line counting method
+     * @param per_worker governed memory a worker may hold
+     * @return futures of the file line counts, in file order
      */
-    std::vector<std::future<uint64_t>> futures; // vector of futures
-    futures.reserve(files.size()); // reserve space for futures
+    std::vector<std::future<uint64_t>> futures;
+    futures.reserve(files.size());
+    if (memory_governor().budget == SIZE_MAX) {
+        for (const auto &file: files) {
+            futures.push_back(std::async(std::launch::async, count_file, file.path()));
+        }
+        return futures;
+    }
+
+    ThreadPool pool{governed_workers(per_worker)}; // runs all tasks before it is destroyed
     for (const auto &file: files) {
-        // for each file, create a future and push it to the vector
-        futures.push_back(std::async(std::launch::async, count_lines_getline, file.path()));
+        auto task = std::make_shared<std::packaged_task<uint64_t()>>(
+                [count_file, path = file.path()] { return count_file(path); });
+        futures.push_back(task->get_future());
+        pool.submit([task] { (*task)(); });
     }
+    return futures;
+}
+
+uint64_t count_getline_async(const std::vector<std::filesystem::directory_entry> &files, Verifier *verifier) {
+    /**
+     * Count lines using getline method.
+     *
+     * @param files vector of files to count lines
+     * @param verifier receives the count of every file if not null
+     * @return total lines count
+     */
+    // for each file, create a future
+    std::vector<std::future<uint64_t>> futures = count_files_async(files, count_lines_getline, 0);
 
     uint64_t lines_count = 0; // total lines count
-    for (auto &future: futures) {
-        lines_count += future.get(); // get the value of the future and add it to the total lines count
+    for (size_t file = 0; file < futures.size(); ++file) {
+        uint64_t file_lines = futures[file].get(); // get the value of the future
+        lines_count += file_lines; // and add it to the total lines count
+        if (verifier != nullptr) {
+            verifier->submit(files[file].path(), "getline", file_lines);
+        }
     }
     return lines_count;
 }
 
-uint64_t count_ncount_async(const std::vector<std::filesystem::directory_entry> &files) {
+uint64_t count_ncount_async(const std::vector<std::filesystem::directory_entry> &files, Verifier *verifier) {
     /**
      * Count lines using ncount method.
      *
      * @param files vector of files to count lines
+     * @param verifier receives the count of every file if not null
      * @return total lines count
      */
-    std::vector<std::future<uint64_t>> futures;
-    futures.reserve(files.size());
-    for (const auto &file: files) {
-        futures.push_back(std::async(std::launch::async, count_lines_ncount, file.path()));
-    }
+    std::vector<std::future<uint64_t>> futures = count_files_async(files, count_lines_ncount, 0);
 
     uint64_t lines_count = 0;
-    for (auto &future: futures) {
-        lines_count += future.get();
+    for (size_t file = 0; file < futures.size(); ++file) {
+        uint64_t file_lines = futures[file].get();
+        lines_count += file_lines;
+        if (verifier != nullptr) {
+            verifier->submit(files[file].path(), "ncount", file_lines);
+        }
     }
     return lines_count;
 }
 
-uint64_t count_buffered_ncount_async(const std::vector<std::filesystem::directory_entry> &files){
+uint64_t count_buffered_ncount_async(const std::vector<std::filesystem::directory_entry> &files, Verifier *verifier){
     /**
      * Count lines using buffered ncount method.
      *
      * @param files vector of files to count lines
+     * @param verifier receives the count of every file if not null
      * @return total lines count
      */
-    std::vector<std::future<uint64_t>> futures;
-    futures.reserve(files.size());
-    for (const auto &file: files) {
-        futures.push_back(std::async(std::launch::async, count_buffered_ncount, file.path()));
-    }
+    std::vector<std::future<uint64_t>> futures = count_files_async(files, count_buffered_ncount,
+                                                                   GOVERNOR_MIN_BUFFER_SIZE);
 
     uint64_t lines_count = 0;
-    for (auto &future: futures) {
-        lines_count += future.get();
+    for (size_t file = 0; file < futures.size(); ++file) {
+        uint64_t file_lines = futures[file].get();
+        lines_count += file_lines;
+        if (verifier != nullptr) {
+            verifier->submit(files[file].path(), "buffered ncount", file_lines);
+        }
     }
     return lines_count;
 }
@@ -238,7 +1178,8 @@ uint64_t count_buffered_ncount(const std::filesystem::path &file_path){
      * @return total lines count
      */
     std::ifstream file(file_path, std::ios::in);
-    std::vector<char> buffer(NCOUNT_BUFFER_SIZE);
+    MemoryReservation reservation{NCOUNT_BUFFER_SIZE, GOVERNOR_MIN_BUFFER_SIZE}; // smaller when memory is short
+    std::vector<char> buffer(reservation.bytes);
     uint64_t lines_count = 0;
 
     while (file.read(buffer.data(), buffer.size())) {
@@ -253,34 +1194,6910 @@ uint64_t count_buffered_ncount(const std::filesystem::path &file_path){
 }
 
 /**
- * Function to parse command line options implemented from scratch due there is no any ready to
- * using implementation of command line options parser in the STL.
- *
- * This solution has a few limitations. It assumes that there is at most one directory argument
- * and that it is the last non-option argument. If more than one directory is provided, only the
- * last one is recorded. Similarly, if a directory is followed by an option, the option will be
- * treated as part of the directory's value. More advanced parsing strategies or dedicated libraries
- * can handle these situations more robustly.
+ * Memory mapped input and vectorized newline kernels.
  *
- * Parse command line options.
- * @param argc
- * @param argv
- * @return
+ * Mapping a file avoids copying it into a user space buffer: the page cache is read directly and
+ * the kernel is told the access is sequential so read-ahead stays aggressive. The newline kernels
+ * compare 16 bytes at a time with SSE2 and fall back to a scalar loop for the tail and for targets
+ * without SSE2.
  */
 
-std::vector<std::string> parse_cli_options(int argc, char *argv[], std::string &directory) {
-    std::vector<std::string> options;
+MappedFile::MappedFile(const std::filesystem::path &file_path) {
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + file_path.string());
+    }
 
-    for (int i = 1; i < argc; ++i) { // Start at 1 to skip the program name
-        std::string arg = argv[i];
+    struct stat file_stat{};
+    if (::fstat(fd, &file_stat) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot stat " + file_path.string());
+    }
 
-        if (arg[0] == '-') { // If it starts with '-', it's an option
-            options.push_back(arg.substr(1));
-        } else {
-            directory = arg; // If it does not start with '-', treat it as a directory
+    size = static_cast<size_t>(file_stat.st_size);
+    if (size > 0) {
+        void *address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map " + file_path.string());
         }
+        ::madvise(address, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(address);
     }
-    return options;
+    ::close(fd); // the mapping keeps its own reference to the file
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept: data{other.data}, size{other.size} {
+    other.data = nullptr;
+    other.size = 0;
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) {
+        ::munmap(const_cast<char *>(data), size);
+    }
+}
+
+uint64_t count_byte(const char *data, size_t size, char byte) {
+    /**
+     * Count occurrences of a byte in the memory range.
+     *
+     * Comparison results (0xFF per match) are subtracted from per-byte counters, which are folded
+     * into the total with _mm_sad_epu8 before they can overflow, i.e. at least every 255 blocks.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     * @param byte byte to count
+     * @return number of occurrences
+     */
+    uint64_t occurrences = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i pattern = _mm_set1_epi8(byte);
+    while (i + 16 <= size) {
+        __m128i counters = _mm_setzero_si128();
+        size_t blocks = std::min<size_t>((size - i) / 16, 255);
+        for (size_t block = 0; block < blocks; ++block, i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(chunk, pattern));
+        }
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        occurrences += static_cast<uint64_t>(_mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4));
+    }
+#endif
+    occurrences += std::count(data + i, data + size, byte);
+    return occurrences;
+}
+
+uint64_t count_newlines(const char *data, size_t size) {
+    /**
+     * Count '\n' characters in the memory range.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     * @return number of newlines
+     */
+    return count_byte(data, size, '\n');
+}
+
+void find_newlines(const char *data, size_t size, size_t base, std::vector<size_t> &positions) {
+    /**
+     * Append positions of '\n' characters in the memory range to the vector.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     * @param base value added to every position, allows scanning a chunk of a bigger range
+     * @param positions output vector
+     */
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+        while (mask != 0) {
+            positions.push_back(base + i + __builtin_ctz(mask));
+            mask &= mask - 1; // clear the lowest set bit
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        if (data[i] == '\n') {
+            positions.push_back(base + i);
+        }
+    }
+}
+
+/**
+ * Ragged lower-triangular matrix reader.
+ *
+ * The text format has one row per line: a label, a tab and then 1..i tab separated values for the
+ * i-th row (Matrix.txt). The file is mapped, row boundaries are found with the vectorized newline
+ * kernel and rows are parsed in parallel with std::async. Each task gets an equal share of bytes
+ * rather than an equal share of rows because rows grow linearly with their index. Tasks write into
+ * disjoint parts of the packed array, so no synchronization is needed.
+ *
+ * The binary format is laid out so that it can be used straight from a memory mapping:
+ *
+ *   header          MatrixBinaryHeader, 32 bytes
+ *   values          n * (n + 1) / 2 floats
+ *   padding         up to 8 bytes alignment
+ *   label offsets   n + 1 uint64_t, label i spans [offsets[i], offsets[i + 1])
+ *   label data      concatenated labels
+ */
+
+struct MatrixBinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t label_bytes;
+};
+
+static size_t matrix_values_offset() {
+    return sizeof(MatrixBinaryHeader);
+}
+
+static size_t matrix_label_offsets_offset(uint64_t size) {
+    size_t end_of_values = matrix_values_offset() + size * (size + 1) / 2 * sizeof(float);
+    return (end_of_values + 7) & ~static_cast<size_t>(7);
+}
+
+float TriangularMatrix::at(size_t i, size_t j) const {
+    if (j > i) {
+        std::swap(i, j); // the matrix is symmetric, only the lower triangle is stored
+    }
+    return values[i * (i + 1) / 2 + j];
+}
+
+float TriangularMatrixView::at(size_t i, size_t j) const {
+    if (j > i) {
+        std::swap(i, j);
+    }
+    return values[i * (i + 1) / 2 + j];
+}
+
+std::string_view TriangularMatrixView::label(size_t i) const {
+    return {label_data + label_offsets[i], static_cast<size_t>(label_offsets[i + 1] - label_offsets[i])};
+}
+
+static void parse_matrix_row(const char *begin, const char *end, size_t row, TriangularMatrix &matrix) {
+    /**
+     * Parse one text row into its label and its slot of the packed array.
+     *
+     * @param begin first character of the row
+     * @param end end of the row, line terminator excluded
+     * @param row row index
+     * @param matrix matrix with preallocated labels and values
+     */
+    const auto *tab = static_cast<const char *>(std::memchr(begin, '\t', end - begin));
+    if (tab == nullptr) {
+        throw std::runtime_error("Matrix row " + std::to_string(row + 1) + " has no values");
+    }
+    matrix.labels[row].assign(begin, tab);
+
+    float *row_values = matrix.values.data() + row * (row + 1) / 2;
+    size_t values_count = 0;
+    const char *cursor = tab;
+    while (cursor < end) {
+        while (cursor < end && (*cursor == '\t' || *cursor == ' ')) {
+            ++cursor;
+        }
+        if (cursor == end) {
+            break;
+        }
+        if (values_count > row) {
+            throw std::runtime_error("Matrix row " + std::to_string(row + 1) + " has too many values");
+        }
+        auto result = std::from_chars(cursor, end, row_values[values_count]);
+        if (result.ec != std::errc()) {
+            throw std::runtime_error("Matrix row " + std::to_string(row + 1) + " has a malformed value");
+        }
+        cursor = result.ptr;
+        ++values_count;
+    }
+    if (values_count != row + 1) {
+        throw std::runtime_error("Matrix row " + std::to_string(row + 1) + " has " + std::to_string(values_count) +
+                                 " values, expected " + std::to_string(row + 1));
+    }
+}
+
+TriangularMatrix read_triangular_matrix(const std::filesystem::path &file_path) {
+    /**
+     * Read a ragged lower-triangular matrix from its text representation.
+     *
+     * @param file_path path to the text file
+     * @return matrix with packed values
+     */
+    MappedFile map{file_path};
+
+    std::vector<size_t> newlines;
+    find_newlines(map.data, map.size, 0, newlines);
+
+    // Row spans without line terminators, blank lines are skipped
+    std::vector<std::pair<size_t, size_t>> rows;
+    rows.reserve(newlines.size() + 1);
+    size_t row_begin = 0;
+    auto add_row = [&](size_t row_end) {
+        if (row_end > row_begin && map.data[row_end - 1] == '\r') {
+            --row_end;
+        }
+        if (row_end > row_begin) {
+            rows.emplace_back(row_begin, row_end);
+        }
+    };
+    for (size_t newline: newlines) {
+        add_row(newline);
+        row_begin = newline + 1;
+    }
+    add_row(map.size);
+
+    TriangularMatrix matrix;
+    const size_t size = rows.size();
+    matrix.labels.resize(size);
+    matrix.values.resize(size * (size + 1) / 2);
+
+    size_t tasks = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::future<void>> futures;
+    futures.reserve(tasks);
+    size_t first_row = 0;
+    for (size_t task = 1; task <= tasks && first_row < size; ++task) {
+        // the task takes every row starting before its share of bytes ends
+        size_t bytes_end = map.size / tasks * task;
+        size_t last_row = task == tasks ? size : static_cast<size_t>(
+                std::lower_bound(rows.begin() + first_row, rows.end(), bytes_end,
+                                 [](const auto &row, size_t offset) { return row.first < offset; }) - rows.begin());
+        if (last_row == first_row) {
+            continue;
+        }
+        futures.push_back(std::async(std::launch::async, [&map, &rows, &matrix, first_row, last_row]() {
+            for (size_t row = first_row; row < last_row; ++row) {
+                parse_matrix_row(map.data + rows[row].first, map.data + rows[row].second, row, matrix);
+            }
+        }));
+        first_row = last_row;
+    }
+
+    for (auto &future: futures) {
+        future.get(); // rethrows parsing errors
+    }
+    return matrix;
+}
+
+void write_triangular_matrix_binary(const TriangularMatrix &matrix, const std::filesystem::path &file_path) {
+    /**
+     * Export the matrix to the binary format, see load_triangular_matrix_binary.
+     *
+     * @param matrix matrix to export
+     * @param file_path path to the binary file
+     */
+    const uint64_t size = matrix.labels.size();
+
+    std::vector<uint64_t> label_offsets;
+    label_offsets.reserve(size + 1);
+    label_offsets.push_back(0);
+    for (const auto &label: matrix.labels) {
+        label_offsets.push_back(label_offsets.back() + label.size());
+    }
+
+    MatrixBinaryHeader header{};
+    std::memcpy(header.magic, MATRIX_BINARY_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.size = size;
+    header.label_bytes = label_offsets.back();
+
+    std::ofstream file{file_path, std::ios::out | std::ios::binary | std::ios::trunc};
+    if (!file) {
+        throw std::runtime_error("Cannot create " + file_path.string());
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(matrix.values.data()),
+               static_cast<std::streamsize>(matrix.values.size() * sizeof(float)));
+    const char padding[8]{};
+    file.write(padding, static_cast<std::streamsize>(
+            matrix_label_offsets_offset(size) - matrix_values_offset() - matrix.values.size() * sizeof(float)));
+    file.write(reinterpret_cast<const char *>(label_offsets.data()),
+               static_cast<std::streamsize>(label_offsets.size() * sizeof(uint64_t)));
+    for (const auto &label: matrix.labels) {
+        file.write(label.data(), static_cast<std::streamsize>(label.size()));
+    }
+    if (!file) {
+        throw std::runtime_error("Cannot write " + file_path.string());
+    }
+}
+
+TriangularMatrixView load_triangular_matrix_binary(const std::filesystem::path &file_path) {
+    /**
+     * Load a matrix stored in the binary format. Nothing is parsed or copied: the file is mapped
+     * and the view points into the mapping, so loading time does not depend on the number of values.
+     * Only the header and the label offsets, one per row, are validated.
+     *
+     * @param file_path path to the binary file
+     * @return view over the mapped matrix
+     */
+    TriangularMatrixView view{MappedFile{file_path}};
+
+    MatrixBinaryHeader header{};
+    if (view.map.size < sizeof(header)) {
+        throw std::runtime_error("Truncated binary matrix " + file_path.string());
+    }
+    std::memcpy(&header, view.map.data, sizeof(header));
+    if (std::memcmp(header.magic, MATRIX_BINARY_MAGIC, sizeof(header.magic)) != 0 || header.version != 1) {
+        throw std::runtime_error("Not a binary matrix " + file_path.string());
+    }
+
+    // the header is untrusted: every row holds at least one float, and no size computation may wrap
+    uint64_t values_bytes = 0;
+    uint64_t expected_size = 0;
+    if (header.size > view.map.size / sizeof(float) ||
+        __builtin_mul_overflow(header.size, header.size + 1, &values_bytes) ||
+        __builtin_mul_overflow(values_bytes / 2, sizeof(float), &values_bytes) ||
+        __builtin_add_overflow(values_bytes, matrix_values_offset() + 7, &expected_size) ||
+        __builtin_add_overflow(expected_size & ~static_cast<uint64_t>(7), (header.size + 1) * sizeof(uint64_t),
+                               &expected_size) ||
+        __builtin_add_overflow(expected_size, header.label_bytes, &expected_size)) {
+        throw std::runtime_error("Not a binary matrix " + file_path.string());
+    }
+    size_t label_offsets_offset = matrix_label_offsets_offset(header.size);
+    if (view.map.size != expected_size) {
+        throw std::runtime_error("Truncated binary matrix " + file_path.string());
+    }
+    auto label_offsets = reinterpret_cast<const uint64_t *>(view.map.data + label_offsets_offset);
+    if (label_offsets[0] != 0 || label_offsets[header.size] != header.label_bytes) {
+        throw std::runtime_error("Not a binary matrix " + file_path.string());
+    }
+    for (uint64_t row = 0; row < header.size; ++row) {
+        if (label_offsets[row] > label_offsets[row + 1]) {
+            throw std::runtime_error("Not a binary matrix " + file_path.string());
+        }
+    }
+
+    view.size = header.size;
+    view.values = reinterpret_cast<const float *>(view.map.data + matrix_values_offset());
+    view.label_offsets = label_offsets;
+    view.label_data = view.map.data + label_offsets_offset + (header.size + 1) * sizeof(uint64_t);
+    return view;
+}
+
+static bool is_binary_matrix(const std::filesystem::path &file_path) {
+    std::ifstream file{file_path, std::ios::in | std::ios::binary};
+    char magic[8]{};
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, MATRIX_BINARY_MAGIC, sizeof(magic)) == 0;
+}
+
+int run_matrix_mode(const std::vector<std::string> &options) {
+    /**
+     * Read a matrix given by -matrix=FILE, text and binary files are detected by the magic bytes.
+     * A text matrix is exported to the binary format when -matrix-out=FILE is given.
+     *
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::filesystem::path matrix_path{option_value(options, "matrix")};
+    if (!std::filesystem::is_regular_file(matrix_path)) {
+        std::cout << "Path does not exist\n";
+        return 1;
+    }
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        if (is_binary_matrix(matrix_path)) {
+            TriangularMatrixView view = load_triangular_matrix_binary(matrix_path);
+            std::cout << "Matrix rows: " << view.size << "\n"
+                      << "Matrix values: " << view.size * (view.size + 1) / 2 << "\n";
+        } else {
+            TriangularMatrix matrix = read_triangular_matrix(matrix_path);
+            std::cout << "Matrix rows: " << matrix.labels.size() << "\n"
+                      << "Matrix values: " << matrix.values.size() << "\n";
+
+            std::string output_path = option_value(options, "matrix-out");
+            if (!output_path.empty()) {
+                write_triangular_matrix_binary(matrix, output_path);
+                std::cout << "Binary matrix written to " << output_path << "\n";
+            }
+        }
+        std::cout << "Matrix loading time: "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " millisecond \n";
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Chunking of mapped files for parallel processing.
+ *
+ * A file is cut into roughly equal byte ranges, one per hardware thread, and every cut is moved
+ * forward to the next boundary of the processed unit (line, record, ...). Neighbouring chunks use
+ * the same cut, so a unit that straddles a nominal offset is processed exactly once, by the chunk
+ * in which it starts.
+ */
+
+std::vector<std::string> split_list(const std::string &list, char separator) {
+    /**
+     * Split a separated list, e.g. the value of a "-fields=a,b,c" option. Empty items are dropped.
+     *
+     * @param list separated list
+     * @param separator separator character
+     * @return list items
+     */
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(separator, begin);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end > begin) {
+            items.push_back(list.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return items;
+}
+
+size_t next_line_start(const char *data, size_t size, size_t offset) {
+    /**
+     * @return start of the first line beginning at or after the offset
+     */
+    if (offset == 0 || offset >= size) {
+        return std::min(offset, size);
+    }
+    const auto *newline = static_cast<const char *>(std::memchr(data + offset - 1, '\n', size - offset + 1));
+    return newline == nullptr ? size : static_cast<size_t>(newline - data) + 1;
+}
+
+size_t next_record_start(const char *data, size_t size, size_t offset) {
+    /**
+     * Records are separated by one or more blank lines (a line with an optional '\r' only).
+     *
+     * @return start of the first line at or after the offset that follows a blank line
+     */
+    size_t line = next_line_start(data, size, offset);
+    while (line < size) {
+        size_t next = next_line_start(data, size, line + 1);
+        bool blank = data[line] == '\n' || (data[line] == '\r' && line + 1 < size && data[line + 1] == '\n');
+        if (blank) {
+            while (next < size && (data[next] == '\n' || (data[next] == '\r' && next + 1 < size && data[next + 1] == '\n'))) {
+                next = next_line_start(data, size, next + 1); // skip the whole run of blank lines
+            }
+            return next;
+        }
+        line = next;
+    }
+    return size;
+}
+
+std::vector<size_t> split_into_chunks(const char *data, size_t size,
+                                      size_t (*next_boundary)(const char *, size_t, size_t)) {
+    /**
+     * Split a memory range into per-thread chunks aligned to unit boundaries. Small ranges are not
+     * split below PARALLEL_CHUNK_MIN_SIZE bytes per chunk, thread start up would dominate otherwise.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     * @param next_boundary returns the first unit boundary at or after an offset
+     * @return chunk boundaries, chunk i spans [result[i], result[i + 1])
+     */
+    size_t chunks = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(),
+                                                         size / PARALLEL_CHUNK_MIN_SIZE));
+    std::vector<size_t> boundaries{0};
+    for (size_t chunk = 1; chunk < chunks; ++chunk) {
+        size_t boundary = next_boundary(data, size, size / chunks * chunk);
+        if (boundary > boundaries.back() && boundary < size) {
+            boundaries.push_back(boundary);
+        }
+    }
+    boundaries.push_back(size);
+    return boundaries;
+}
+
+/**
+ * Key-value record extractor (Phenokit.txt).
+ *
+ * Records are blocks of "Key: value" lines separated by blank lines. The file is mapped and split
+ * into chunks at record boundaries, every chunk is scanned in its own task: line ends come from the
+ * vectorized newline kernel, the key separator from memchr. Keys are matched case-insensitively
+ * because the same key is written as "NAME:" and "Name:" in the wild. Extracted values are views
+ * into the mapping, nothing is copied until the output is written.
+ */
+
+size_t KeyValueTable::records() const {
+    return fields.empty() ? 0 : cells.size() / fields.size();
+}
+
+static void extract_key_value_chunk(const char *data, size_t begin, size_t end,
+                                    const std::vector<std::string> &fields, std::vector<std::string_view> &cells) {
+    /**
+     * Extract records of one chunk.
+     *
+     * @param data mapped file
+     * @param begin chunk start, a record start
+     * @param end chunk end, a record start or the end of the file
+     * @param fields selected keys
+     * @param cells output cells, one row of fields.size() values per record
+     */
+    std::vector<size_t> newlines;
+    find_newlines(data + begin, end - begin, begin, newlines);
+    if (newlines.empty() || newlines.back() + 1 < end) {
+        newlines.push_back(end); // last line without a terminator
+    }
+
+    bool in_record = false;
+    size_t record_cells = 0;
+    size_t line_begin = begin;
+    for (size_t line_end: newlines) {
+        size_t line_size = line_end - line_begin;
+        if (line_size > 0 && data[line_end - 1] == '\r') {
+            --line_size;
+        }
+        const char *line = data + line_begin;
+        line_begin = line_end + 1;
+
+        if (line_size == 0) {
+            in_record = false; // blank line closes the record
+            continue;
+        }
+        if (!in_record) {
+            in_record = true;
+            record_cells = cells.size();
+            cells.resize(cells.size() + fields.size());
+        }
+
+        const auto *colon = static_cast<const char *>(std::memchr(line, ':', line_size));
+        if (colon == nullptr) {
+            continue;
+        }
+        auto key_size = static_cast<size_t>(colon - line);
+        for (size_t field = 0; field < fields.size(); ++field) {
+            if (fields[field].size() == key_size && strncasecmp(fields[field].data(), line, key_size) == 0) {
+                const char *value = colon + 1;
+                const char *value_end = line + line_size;
+                while (value < value_end && (*value == ' ' || *value == '\t')) {
+                    ++value;
+                }
+                while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                    --value_end;
+                }
+                cells[record_cells + field] = std::string_view{value, static_cast<size_t>(value_end - value)};
+                break;
+            }
+        }
+    }
+}
+
+KeyValueTable extract_key_value_records(const MappedFile &map, const std::vector<std::string> &fields) {
+    /**
+     * Extract selected fields of all records in parallel. Missing fields are empty.
+     *
+     * @param map mapped file, must outlive the returned table
+     * @param fields selected keys, without the trailing ':'
+     * @return table of records in file order
+     */
+    KeyValueTable table;
+    table.fields = fields;
+
+    std::vector<size_t> boundaries = split_into_chunks(map.data, map.size, next_record_start);
+    std::vector<std::vector<std::string_view>> chunk_cells(boundaries.size() - 1);
+    std::vector<std::future<void>> futures;
+    futures.reserve(chunk_cells.size());
+    for (size_t chunk = 0; chunk < chunk_cells.size(); ++chunk) {
+        futures.push_back(std::async(std::launch::async, extract_key_value_chunk, map.data, boundaries[chunk],
+                                     boundaries[chunk + 1], std::cref(fields), std::ref(chunk_cells[chunk])));
+    }
+
+    for (size_t chunk = 0; chunk < futures.size(); ++chunk) {
+        futures[chunk].get();
+        table.cells.insert(table.cells.end(), chunk_cells[chunk].begin(), chunk_cells[chunk].end());
+    }
+    return table;
+}
+
+static void append_tsv_escaped(std::string &line, std::string_view value) {
+    /**
+     * Append a value with tab, newline, carriage return and backslash escaped as \t, \n, \r and \\,
+     * so that a value never splits a row or a column.
+     */
+    for (char c: value) {
+        switch (c) {
+            case '\t':
+                line += "\\t";
+                break;
+            case '\n':
+                line += "\\n";
+                break;
+            case '\r':
+                line += "\\r";
+                break;
+            case '\\':
+                line += "\\\\";
+                break;
+            default:
+                line += c;
+        }
+    }
+}
+
+void write_key_value_tsv(const KeyValueTable &table, std::ostream &out) {
+    /**
+     * Write the table as TSV with a header line of field names. Names and values are escaped by
+     * append_tsv_escaped.
+     */
+    std::string line;
+    for (size_t field = 0; field < table.fields.size(); ++field) {
+        if (field != 0) {
+            line += '\t';
+        }
+        append_tsv_escaped(line, table.fields[field]);
+    }
+    line += '\n';
+    out.write(line.data(), static_cast<std::streamsize>(line.size()));
+
+    for (size_t record = 0; record < table.records(); ++record) {
+        line.clear();
+        for (size_t field = 0; field < table.fields.size(); ++field) {
+            if (field != 0) {
+                line += '\t';
+            }
+            append_tsv_escaped(line, table.cells[record * table.fields.size() + field]);
+        }
+        line += '\n';
+        out.write(line.data(), static_cast<std::streamsize>(line.size()));
+    }
+}
+
+void write_key_value_binary(const KeyValueTable &table, std::ostream &out) {
+    /**
+     * Write the table in a compact columnar binary format:
+     *
+     *   magic           KEY_VALUE_BINARY_MAGIC, 8 bytes
+     *   fields          uint32_t
+     *   reserved        uint32_t
+     *   records         uint64_t
+     *   field names     per field: uint32_t length, bytes
+     *   columns         per field: uint64_t offsets[records + 1], concatenated values
+     */
+    const uint32_t fields = static_cast<uint32_t>(table.fields.size());
+    const uint32_t reserved = 0;
+    const uint64_t records = table.records();
+    out.write(KEY_VALUE_BINARY_MAGIC, 8);
+    out.write(reinterpret_cast<const char *>(&fields), sizeof(fields));
+    out.write(reinterpret_cast<const char *>(&reserved), sizeof(reserved));
+    out.write(reinterpret_cast<const char *>(&records), sizeof(records));
+    for (const auto &name: table.fields) {
+        auto name_size = static_cast<uint32_t>(name.size());
+        out.write(reinterpret_cast<const char *>(&name_size), sizeof(name_size));
+        out.write(name.data(), name_size);
+    }
+
+    std::vector<uint64_t> offsets(records + 1);
+    for (size_t field = 0; field < fields; ++field) {
+        for (size_t record = 0; record < records; ++record) {
+            offsets[record + 1] = offsets[record] + table.cells[record * fields + field].size();
+        }
+        out.write(reinterpret_cast<const char *>(offsets.data()),
+                  static_cast<std::streamsize>(offsets.size() * sizeof(uint64_t)));
+        for (size_t record = 0; record < records; ++record) {
+            const auto &cell = table.cells[record * fields + field];
+            out.write(cell.data(), static_cast<std::streamsize>(cell.size()));
+        }
+    }
+}
+
+int run_key_value_mode(const std::vector<std::string> &options) {
+    /**
+     * Extract key-value records from -kv=FILE. Fields are given by -kv-fields=KEY,KEY,..., the output
+     * goes to -kv-out=FILE or to stdout, -kv-format=tsv (default, values escaped) or -kv-format=binary.
+     *
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::filesystem::path input_path{option_value(options, "kv")};
+    if (!std::filesystem::is_regular_file(input_path)) {
+        std::cout << "Path does not exist\n";
+        return 1;
+    }
+
+    std::vector<std::string> fields = split_list(option_value(options, "kv-fields"), ',');
+    if (fields.empty()) {
+        std::cout << "No fields provided, use -kv-fields=KEY,KEY,...\n";
+        return 1;
+    }
+
+    std::string format = option_value(options, "kv-format");
+    std::string output_path = option_value(options, "kv-out");
+    if (format == "binary" && output_path.empty()) {
+        std::cout << "Binary output requires -kv-out=FILE\n";
+        return 1;
+    }
+    if (!format.empty() && format != "tsv" && format != "binary") {
+        std::cout << "Unknown format " << format << "\n";
+        return 1;
+    }
+
+    try {
+        MappedFile map{input_path};
+        KeyValueTable table = extract_key_value_records(map, fields);
+
+        std::ofstream file;
+        if (!output_path.empty()) {
+            file.open(output_path, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!file) {
+                throw std::runtime_error("Cannot create " + output_path);
+            }
+        }
+        std::ostream &out = output_path.empty() ? std::cout : file;
+        if (format == "binary") {
+            write_key_value_binary(table, out);
+        } else {
+            write_key_value_tsv(table, out);
+        }
+        if (!output_path.empty()) {
+            std::cout << "Records: " << table.records() << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Fixed-width report extractor (FAME.TXT).
+ *
+ * Instrument reports are page formatted: blocks are delimited by lines made of dashes only and
+ * every line type keeps its fields at fixed columns. Which columns to take comes from a layout
+ * file (see layouts/FAME.layout), so fields are cut out by position without any tokenization.
+ * Separator lines are recognized 16 bytes at a time with SSE2. The file is split into chunks at
+ * line boundaries and processed in parallel, block numbers are made global when chunks are merged.
+ */
+
+FixedWidthLayout read_fixed_width_layout(const std::filesystem::path &file_path) {
+    /**
+     * Read a layout file. Every non-empty line that does not start with '#' is one of
+     *
+     *   line <type> <column> <pattern>
+     *   field <type> <name> <column> <width>
+     *
+     * @param file_path path to the layout file
+     * @return layout with line types in file order
+     */
+    std::ifstream file{file_path};
+    if (!file) {
+        throw std::runtime_error("Cannot open " + file_path.string());
+    }
+
+    FixedWidthLayout layout;
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(file, line)) {
+        ++line_number;
+        std::istringstream tokens{line};
+        std::string directive;
+        if (!(tokens >> directive) || directive[0] == '#') {
+            continue;
+        }
+
+        std::string type;
+        if (directive == "line") {
+            FixedWidthLineType line_type;
+            if (tokens >> line_type.name >> line_type.column >> line_type.pattern) {
+                layout.line_types.push_back(std::move(line_type));
+                continue;
+            }
+        } else if (directive == "field" && tokens >> type) {
+            FixedWidthField field;
+            auto line_type = std::find_if(layout.line_types.begin(), layout.line_types.end(),
+                                          [&type](const auto &candidate) { return candidate.name == type; });
+            if (line_type != layout.line_types.end() && tokens >> field.name >> field.column >> field.width) {
+                line_type->fields.push_back(std::move(field));
+                continue;
+            }
+        }
+        throw std::runtime_error("Malformed layout line " + std::to_string(line_number) + " in " + file_path.string());
+    }
+    return layout;
+}
+
+static bool is_separator_line(const char *line, size_t size) {
+    /**
+     * @return true if the line is made of dashes only and at least 3 characters long
+     */
+    if (size < 3 || line[0] != '-') {
+        return false;
+    }
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i dash = _mm_set1_epi8('-');
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(line + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dash)) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        if (line[i] != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool matches_line_type(const char *line, size_t size, const FixedWidthLineType &line_type) {
+    if (line_type.column + line_type.pattern.size() > size) {
+        return false;
+    }
+    for (size_t i = 0; i < line_type.pattern.size(); ++i) {
+        char expected = line_type.pattern[i];
+        char actual = line[line_type.column + i];
+        if (expected == '?' || (expected == '#' && actual >= '0' && actual <= '9') || expected == actual) {
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+static std::string_view fixed_width_cell(const char *line, size_t size, const FixedWidthField &field) {
+    if (field.column >= size) {
+        return {};
+    }
+    const char *begin = line + field.column;
+    const char *end = line + std::min(size, field.column + field.width);
+    while (begin < end && *begin == ' ') {
+        ++begin;
+    }
+    while (end > begin && end[-1] == ' ') {
+        --end;
+    }
+    return {begin, static_cast<size_t>(end - begin)};
+}
+
+static FixedWidthReport extract_fixed_width_chunk(const char *data, size_t begin, size_t end,
+                                                  const FixedWidthLayout &layout) {
+    /**
+     * Extract rows of one chunk. Row blocks are the number of separators seen in the chunk before
+     * the row, they are made global by the caller.
+     */
+    FixedWidthReport report;
+    std::vector<size_t> newlines;
+    find_newlines(data + begin, end - begin, begin, newlines);
+    report.lines = newlines.size();
+    if (newlines.empty() || newlines.back() + 1 < end) {
+        newlines.push_back(end); // last line without a terminator
+    }
+
+    size_t line_begin = begin;
+    for (size_t line_end: newlines) {
+        const char *line = data + line_begin;
+        size_t line_size = line_end - line_begin;
+        line_begin = line_end + 1;
+        if (line_size > 0 && line[line_size - 1] == '\r') {
+            --line_size;
+        }
+
+        if (is_separator_line(line, line_size)) {
+            ++report.blocks;
+            continue;
+        }
+        for (size_t type = 0; type < layout.line_types.size(); ++type) {
+            const auto &line_type = layout.line_types[type];
+            if (matches_line_type(line, line_size, line_type)) {
+                report.rows.push_back({report.blocks, type, report.cells.size()});
+                for (const auto &field: line_type.fields) {
+                    report.cells.push_back(fixed_width_cell(line, line_size, field));
+                }
+                break;
+            }
+        }
+    }
+    return report;
+}
+
+FixedWidthReport extract_fixed_width_records(const MappedFile &map, const FixedWidthLayout &layout) {
+    /**
+     * Extract rows of all line types defined by the layout in parallel.
+     *
+     * @param map mapped report, must outlive the returned report
+     * @param layout line types and their fields
+     * @return rows in file order, blocks numbered from 1 counting only blocks that have rows
+     */
+    std::vector<size_t> boundaries = split_into_chunks(map.data, map.size, next_line_start);
+    std::vector<std::future<FixedWidthReport>> futures;
+    futures.reserve(boundaries.size() - 1);
+    for (size_t chunk = 0; chunk + 1 < boundaries.size(); ++chunk) {
+        futures.push_back(std::async(std::launch::async, extract_fixed_width_chunk, map.data, boundaries[chunk],
+                                     boundaries[chunk + 1], std::cref(layout)));
+    }
+
+    FixedWidthReport report;
+    uint64_t separators = 0; // separators in the preceding chunks
+    uint64_t last_block = UINT64_MAX;
+    for (auto &future: futures) {
+        FixedWidthReport chunk = future.get();
+        for (const auto &row: chunk.rows) {
+            uint64_t block = separators + row.block;
+            if (block != last_block) {
+                last_block = block;
+                ++report.blocks;
+            }
+            report.rows.push_back({report.blocks, row.line_type, report.cells.size() + row.first_cell});
+        }
+        report.cells.insert(report.cells.end(), chunk.cells.begin(), chunk.cells.end());
+        report.lines += chunk.lines;
+        separators += chunk.blocks;
+    }
+    return report;
+}
+
+void write_fixed_width_tsv(const FixedWidthReport &report, const FixedWidthLayout &layout, std::ostream &out) {
+    /**
+     * Write rows as TSV: block, line type and the fields of the line type. Column names of every
+     * line type are listed first, one "#block" line per type that has the type name in the type
+     * column, so it has as many columns as the rows of that type.
+     */
+    for (const auto &line_type: layout.line_types) {
+        out << "#block\t" << line_type.name;
+        for (const auto &field: line_type.fields) {
+            out << "\t" << field.name;
+        }
+        out << "\n";
+    }
+
+    std::string line;
+    for (const auto &row: report.rows) {
+        const auto &line_type = layout.line_types[row.line_type];
+        line = std::to_string(row.block);
+        line += '\t';
+        line += line_type.name;
+        for (size_t field = 0; field < line_type.fields.size(); ++field) {
+            line += '\t';
+            line += report.cells[row.first_cell + field];
+        }
+        line += '\n';
+        out.write(line.data(), static_cast<std::streamsize>(line.size()));
+    }
+}
+
+int run_fixed_width_mode(const std::vector<std::string> &options) {
+    /**
+     * Extract fields from the fixed-width report -fw=FILE using the layout -fw-layout=FILE. Rows go
+     * to -fw-out=FILE or to stdout.
+     *
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::filesystem::path input_path{option_value(options, "fw")};
+    std::filesystem::path layout_path{option_value(options, "fw-layout")};
+    if (!std::filesystem::is_regular_file(input_path) || !std::filesystem::is_regular_file(layout_path)) {
+        std::cout << "Path does not exist\n";
+        return 1;
+    }
+
+    try {
+        FixedWidthLayout layout = read_fixed_width_layout(layout_path);
+        MappedFile map{input_path};
+        FixedWidthReport report = extract_fixed_width_records(map, layout);
+
+        std::string output_path = option_value(options, "fw-out");
+        if (output_path.empty()) {
+            write_fixed_width_tsv(report, layout, std::cout);
+        } else {
+            std::ofstream file{output_path, std::ios::out | std::ios::binary | std::ios::trunc};
+            if (!file) {
+                throw std::runtime_error("Cannot create " + output_path);
+            }
+            write_fixed_width_tsv(report, layout, file);
+            std::cout << "Lines: " << report.lines << "\n"
+                      << "Blocks: " << report.blocks << "\n"
+                      << "Rows: " << report.rows.size() << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Alignment block reader (example7.txt).
+ *
+ * Every line holds a 1-based column position followed by groups of 10 residues separated by single
+ * spaces, '-' marks a gap. Consecutive lines with the same position form a block, one line per
+ * sequence, so a block is a slice of columns of all sequences (a single sequence gives one line
+ * per block). Whole groups are copied with fixed-size memcpy at fixed offsets, only a trailing
+ * partial group is scanned character by character. Column statistics are computed block by block
+ * right after the block is copied, while it is still in cache, so the input is read once and the
+ * per-column counters never grow beyond one block.
+ */
+
+static void add_alignment_column_stats(Alignment &alignment, size_t first_column) {
+    /**
+     * Compute gap fraction, conservation and consensus of the columns starting at first_column.
+     * Conservation is the share of sequences holding the most frequent residue of the column.
+     */
+    size_t columns = 0;
+    for (const auto &sequence: alignment.sequences) {
+        columns = std::max(columns, sequence.size() - first_column);
+    }
+
+    // per column counters: 0..25 letters, 26 gap, 27 anything else
+    std::vector<std::array<uint32_t, 28>> counts(columns, std::array<uint32_t, 28>{});
+    for (const auto &sequence: alignment.sequences) {
+        for (size_t column = first_column; column < sequence.size(); ++column) {
+            auto residue = static_cast<unsigned char>(sequence[column]);
+            unsigned letter = (residue | 0x20u) - 'a';
+            size_t slot = letter < 26 ? letter : (residue == '-' || residue == '.') ? 26 : 27;
+            ++counts[column - first_column][slot];
+        }
+    }
+
+    const auto sequences = static_cast<float>(alignment.sequences.size());
+    for (const auto &column: counts) {
+        auto most_frequent = std::max_element(column.begin(), column.begin() + 26);
+        alignment.gap_fraction.push_back(static_cast<float>(column[26]) / sequences);
+        alignment.conservation.push_back(static_cast<float>(*most_frequent) / sequences);
+        alignment.consensus += *most_frequent == 0 ? '-' : static_cast<char>('A' + (most_frequent - column.begin()));
+    }
+}
+
+Alignment read_alignment(const std::filesystem::path &file_path) {
+    /**
+     * Reconstruct aligned sequences from position prefixed blocks and compute column statistics.
+     *
+     * @param file_path path to the alignment file
+     * @return sequences and per column statistics
+     */
+    MappedFile map{file_path};
+    std::vector<size_t> newlines;
+    find_newlines(map.data, map.size, 0, newlines);
+    if (newlines.empty() || newlines.back() + 1 < map.size) {
+        newlines.push_back(map.size); // last line without a terminator
+    }
+
+    Alignment alignment;
+    size_t block_position = 0; // position of the current block, 0 before the first block
+    size_t block_first_column = 0;
+    size_t sequence = 0;
+    size_t line_begin = 0;
+    for (size_t line_number = 1; line_number <= newlines.size(); ++line_number) {
+        const char *cursor = map.data + line_begin;
+        const char *end = map.data + newlines[line_number - 1];
+        line_begin = newlines[line_number - 1] + 1;
+        if (end > cursor && end[-1] == '\r') {
+            --end;
+        }
+        while (cursor < end && *cursor == ' ') {
+            ++cursor;
+        }
+        if (cursor == end) {
+            continue; // blank lines between blocks
+        }
+
+        size_t position = 0;
+        auto result = std::from_chars(cursor, end, position);
+        if (result.ec != std::errc() || position == 0) {
+            throw std::runtime_error("Missing position at line " + std::to_string(line_number));
+        }
+        cursor = result.ptr;
+
+        if (position == block_position) {
+            ++sequence;
+            if (sequence >= alignment.sequences.size()) {
+                if (block_first_column != 0 || !alignment.gap_fraction.empty()) {
+                    throw std::runtime_error("Unexpected sequence at line " + std::to_string(line_number));
+                }
+                alignment.sequences.emplace_back(); // sequences are discovered in the first block
+            }
+        } else {
+            if (block_position != 0) {
+                if (sequence + 1 != alignment.sequences.size()) {
+                    throw std::runtime_error("Incomplete block before line " + std::to_string(line_number));
+                }
+                add_alignment_column_stats(alignment, block_first_column);
+            } else {
+                alignment.sequences.emplace_back();
+            }
+            block_position = position;
+            block_first_column = position - 1;
+            sequence = 0;
+        }
+
+        std::string &residues = alignment.sequences[sequence];
+        if (residues.size() != position - 1) {
+            throw std::runtime_error("Position " + std::to_string(position) + " does not continue the sequence at line "
+                                     + std::to_string(line_number));
+        }
+        while (cursor < end && *cursor == ' ') {
+            ++cursor;
+        }
+        while (cursor < end) {
+            if (end - cursor >= 10 && (end - cursor == 10 || cursor[10] == ' ')) {
+                residues.append(cursor, 10); // whole group
+                cursor += 10;
+            } else {
+                while (cursor < end && *cursor != ' ') {
+                    residues += *cursor++; // partial group
+                }
+            }
+            while (cursor < end && *cursor == ' ') {
+                ++cursor;
+            }
+        }
+    }
+
+    if (block_position != 0) {
+        if (sequence + 1 != alignment.sequences.size()) {
+            throw std::runtime_error("Incomplete last block");
+        }
+        add_alignment_column_stats(alignment, block_first_column);
+    }
+    return alignment;
+}
+
+int run_alignment_mode(const std::vector<std::string> &options) {
+    /**
+     * Read the alignment -aln=FILE and print its summary. Sequences are written as FASTA to
+     * -aln-out=FILE, per column statistics as TSV to -aln-stats=FILE.
+     *
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::filesystem::path input_path{option_value(options, "aln")};
+    if (!std::filesystem::is_regular_file(input_path)) {
+        std::cout << "Path does not exist\n";
+        return 1;
+    }
+
+    try {
+        Alignment alignment = read_alignment(input_path);
+        double gap_fraction = 0;
+        for (float column_gap_fraction: alignment.gap_fraction) {
+            gap_fraction += column_gap_fraction;
+        }
+        std::cout << "Sequences: " << alignment.sequences.size() << "\n"
+                  << "Columns: " << alignment.gap_fraction.size() << "\n"
+                  << "Mean gap fraction: "
+                  << (alignment.gap_fraction.empty() ? 0 : gap_fraction / alignment.gap_fraction.size()) << "\n";
+
+        std::string output_path = option_value(options, "aln-out");
+        if (!output_path.empty()) {
+            std::ofstream file{output_path, std::ios::out | std::ios::trunc};
+            for (size_t sequence = 0; sequence < alignment.sequences.size(); ++sequence) {
+                file << ">seq" << sequence + 1 << "\n" << alignment.sequences[sequence] << "\n";
+            }
+            if (!file) {
+                throw std::runtime_error("Cannot write " + output_path);
+            }
+        }
+
+        std::string stats_path = option_value(options, "aln-stats");
+        if (!stats_path.empty()) {
+            std::ofstream file{stats_path, std::ios::out | std::ios::trunc};
+            file << "column\tgap_fraction\tconservation\tconsensus\n";
+            for (size_t column = 0; column < alignment.gap_fraction.size(); ++column) {
+                file << column + 1 << "\t" << alignment.gap_fraction[column] << "\t"
+                     << alignment.conservation[column] << "\t" << alignment.consensus[column] << "\n";
+            }
+            if (!file) {
+                throw std::runtime_error("Cannot write " + stats_path);
+            }
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Format sniffing and format specific record counting.
+ *
+ * The format of a file is decided from its first FORMAT_SNIFF_SIZE bytes. Byte histograms of the
+ * sample (tabs, colons) come from the SSE2 byte counter and rule out whole groups of formats before
+ * any per line check. Records are then counted over the whole mapped file in the same pass as
+ * lines, with the record definition of the detected format:
+ *
+ *   embl        entries terminated by a "//" line
+ *   tsv         tab separated rows, minus the header row if there is one
+ *   matrix      rows of a ragged lower-triangular matrix
+ *   key-value   "Key: value" blocks, a block starts after a blank line or at a repeat of its first key
+ *   report      fixed-width report blocks, one per "ID:" line
+ *   profile     binary profile records, each terminated by its 0/1 profile line (example2.txt)
+ *   numeric     rows of numbers, e.g. spectra
+ *   text        anything else, records are lines
+ */
+
+template<typename LineFunction>
+static void for_each_line(const char *data, size_t size, LineFunction &&line_function) {
+    /**
+     * Call line_function(line, size) for every line, terminators ("\n" or "\r\n") excluded. A last
+     * line without a terminator is a line too, as with std::getline.
+     */
+    const char *cursor = data;
+    const char *end = data + size;
+    while (cursor < end) {
+        const auto *newline = static_cast<const char *>(std::memchr(cursor, '\n', end - cursor));
+        const char *line_end = newline == nullptr ? end : newline;
+        auto line_size = static_cast<size_t>(line_end - cursor);
+        if (line_size > 0 && cursor[line_size - 1] == '\r') {
+            --line_size;
+        }
+        line_function(cursor, line_size);
+        cursor = line_end + 1;
+    }
+}
+
+const char *format_name(FileFormat format) {
+    switch (format) {
+        case FileFormat::embl:
+            return "embl";
+        case FileFormat::tsv:
+            return "tsv";
+        case FileFormat::matrix:
+            return "matrix";
+        case FileFormat::key_value:
+            return "key-value";
+        case FileFormat::report:
+            return "report";
+        case FileFormat::profile:
+            return "profile";
+        case FileFormat::numeric:
+            return "numeric";
+        case FileFormat::text:
+            break;
+    }
+    return "text";
+}
+
+static bool is_blank_line(const char *line, size_t size) {
+    return std::all_of(line, line + size, [](char c) { return c == ' ' || c == '\t'; });
+}
+
+static bool is_numeric_line(const char *line, size_t size) {
+    /**
+     * @return true if the line has at least one token and all its whitespace separated tokens are numbers
+     */
+    const char *cursor = line;
+    const char *end = line + size;
+    bool has_number = false;
+    while (cursor < end) {
+        if (*cursor == ' ' || *cursor == '\t') {
+            ++cursor;
+            continue;
+        }
+        if (*cursor == '+') {
+            ++cursor; // from_chars accepts '-' only
+        }
+        double number;
+        auto result = std::from_chars(cursor, end, number);
+        if (result.ec != std::errc() || (result.ptr != end && *result.ptr != ' ' && *result.ptr != '\t')) {
+            return false;
+        }
+        cursor = result.ptr;
+        has_number = true;
+    }
+    return has_number;
+}
+
+static bool is_profile_line(const char *line, size_t size) {
+    return size >= 8 && std::all_of(line, line + size, [](char c) { return c == '0' || c == '1'; });
+}
+
+static size_t key_size(const char *line, size_t size) {
+    /**
+     * @return size of the "Key" of a "Key: value" line, 0 if the line is not one
+     */
+    size_t i = 0;
+    while (i < size && (std::isalpha(static_cast<unsigned char>(line[i])) || line[i] == '_' ||
+                        (i > 0 && line[i] == ' '))) {
+        ++i;
+    }
+    return i > 0 && i < size && line[i] == ':' ? i : 0;
+}
+
+static bool has_numeric_field(const char *line, size_t size) {
+    const char *field = line;
+    const char *end = line + size;
+    while (field <= end) {
+        const auto *tab = static_cast<const char *>(std::memchr(field, '\t', end - field));
+        const char *field_end = tab == nullptr ? end : tab;
+        if (field_end > field && is_numeric_line(field, field_end - field)) {
+            return true;
+        }
+        field = field_end + 1;
+    }
+    return false;
+}
+
+FormatSniff sniff_format(const char *data, size_t size) {
+    /**
+     * Classify a file from its first FORMAT_SNIFF_SIZE bytes.
+     *
+     * @param data mapped file
+     * @param size file size
+     * @return detected format
+     */
+    size_t sample_size = std::min<size_t>(size, FORMAT_SNIFF_SIZE);
+    if (sample_size < size) {
+        const auto *last_newline = static_cast<const char *>(memrchr(data, '\n', sample_size));
+        if (last_newline != nullptr) {
+            sample_size = static_cast<size_t>(last_newline - data) + 1; // drop the truncated last line
+        }
+    }
+    const bool has_tabs = count_byte(data, sample_size, '\t') > 0;
+    const bool has_colons = count_byte(data, sample_size, ':') > 0;
+
+    size_t non_blank_lines = 0;
+    size_t tab_lines = 0;
+    size_t key_value_lines = 0;
+    size_t numeric_lines = 0;
+    size_t profile_lines = 0;
+    size_t id_lines = 0;
+    size_t separator_lines = 0;
+    bool embl = false;
+    bool matrix = true; // every row has one field more than the previous one, starting with two
+    size_t previous_fields = 1;
+    bool first_row_numeric = false;
+    bool second_row_numeric = false;
+    for_each_line(data, sample_size, [&](const char *line, size_t line_size) {
+        if (is_blank_line(line, line_size)) {
+            return;
+        }
+        if (++non_blank_lines == 1) {
+            embl = line_size >= 5 && std::memcmp(line, "ID   ", 5) == 0;
+        }
+        if (has_tabs) {
+            size_t fields = count_byte(line, line_size, '\t') + 1;
+            tab_lines += fields > 1;
+            matrix = matrix && fields == previous_fields + 1;
+            previous_fields = fields;
+            if (non_blank_lines <= 2) {
+                (non_blank_lines == 1 ? first_row_numeric : second_row_numeric) = has_numeric_field(line, line_size);
+            }
+        }
+        if (has_colons) {
+            key_value_lines += key_size(line, line_size) > 0;
+            id_lines += line_size >= 3 && std::memcmp(line, "ID:", 3) == 0;
+        }
+        separator_lines += line_size >= 20 && line[0] == '-' && count_byte(line, line_size, '-') == line_size;
+        numeric_lines += is_numeric_line(line, line_size);
+        profile_lines += is_profile_line(line, line_size);
+    });
+
+    if (non_blank_lines == 0) {
+        return {FileFormat::text, false};
+    }
+    if (embl) {
+        return {FileFormat::embl, false};
+    }
+    if (profile_lines > 0) {
+        return {FileFormat::profile, false};
+    }
+    if (tab_lines == non_blank_lines) {
+        if (matrix && non_blank_lines > 1) {
+            return {FileFormat::matrix, false};
+        }
+        return {FileFormat::tsv, !first_row_numeric && second_row_numeric};
+    }
+    if (separator_lines > 0) {
+        return {FileFormat::report, false};
+    }
+    if (key_value_lines * 2 >= non_blank_lines) {
+        return {FileFormat::key_value, false};
+    }
+    if (id_lines > 0) {
+        return {FileFormat::report, false};
+    }
+    if (numeric_lines == non_blank_lines) {
+        return {FileFormat::numeric, false};
+    }
+    return {FileFormat::text, false};
+}
+
+FormatCounts count_format_records(const std::filesystem::path &file_path) {
+    /**
+     * Sniff the format of a file and count its lines and records in one pass.
+     *
+     * @param file_path path to the file
+     * @return format, lines and records
+     */
+    MappedFile map{file_path};
+    FormatSniff sniff = sniff_format(map.data, map.size);
+
+    FormatCounts counts{sniff.format, 0, 0};
+    bool previous_blank = true;
+    std::string first_key;
+    for_each_line(map.data, map.size, [&](const char *line, size_t line_size) {
+        ++counts.lines;
+        switch (sniff.format) {
+            case FileFormat::embl:
+                counts.records += line_size >= 2 && line[0] == '/' && line[1] == '/';
+                break;
+            case FileFormat::tsv:
+            case FileFormat::matrix:
+            case FileFormat::numeric:
+                counts.records += !is_blank_line(line, line_size);
+                break;
+            case FileFormat::key_value: {
+                bool blank = is_blank_line(line, line_size);
+                if (!blank) {
+                    size_t size = key_size(line, line_size);
+                    if (first_key.empty()) {
+                        first_key.assign(line, size);
+                    }
+                    bool repeated_key = !first_key.empty() && size == first_key.size() &&
+                                        strncasecmp(line, first_key.data(), size) == 0;
+                    counts.records += previous_blank || repeated_key;
+                }
+                previous_blank = blank;
+                break;
+            }
+            case FileFormat::report:
+                counts.records += line_size >= 3 && std::memcmp(line, "ID:", 3) == 0;
+                break;
+            case FileFormat::profile:
+                counts.records += is_profile_line(line, line_size);
+                break;
+            case FileFormat::text:
+                ++counts.records;
+                break;
+        }
+    });
+    if (sniff.header && counts.records > 0) {
+        --counts.records;
+    }
+    return counts;
+}
+
+void print_format_report(const std::vector<std::filesystem::directory_entry> &files) {
+    /**
+     * Count records of every file with its own format definition, in parallel, and print file,
+     * line and record totals per format.
+     *
+     * @param files vector of files to count
+     */
+    std::vector<std::future<FormatCounts>> futures;
+    futures.reserve(files.size());
+    for (const auto &file: files) {
+        futures.push_back(std::async(std::launch::async, count_format_records, file.path()));
+    }
+
+    constexpr size_t formats = static_cast<size_t>(FileFormat::text) + 1;
+    std::array<uint64_t, formats> format_files{};
+    std::array<uint64_t, formats> format_lines{};
+    std::array<uint64_t, formats> format_records{};
+    for (auto &future: futures) {
+        FormatCounts counts = future.get();
+        auto format = static_cast<size_t>(counts.format);
+        ++format_files[format];
+        format_lines[format] += counts.lines;
+        format_records[format] += counts.records;
+    }
+
+    std::cout << std::left << std::setw(12) << "Format" << std::right << std::setw(8) << "Files"
+              << std::setw(12) << "Lines" << std::setw(12) << "Records" << "\n";
+    uint64_t total_files = 0, total_lines = 0, total_records = 0;
+    for (size_t format = 0; format < formats; ++format) {
+        if (format_files[format] == 0) {
+            continue;
+        }
+        std::cout << std::left << std::setw(12) << format_name(static_cast<FileFormat>(format)) << std::right
+                  << std::setw(8) << format_files[format] << std::setw(12) << format_lines[format]
+                  << std::setw(12) << format_records[format] << "\n";
+        total_files += format_files[format];
+        total_lines += format_lines[format];
+        total_records += format_records[format];
+    }
+    std::cout << std::left << std::setw(12) << "Total" << std::right << std::setw(8) << total_files
+              << std::setw(12) << total_lines << std::setw(12) << total_records << "\n";
+}
+
+/**
+ * Line hashing.
+ *
+ * Lines are hashed 8 bytes at a time with a multiply-xorshift mixer (the finalizer of MurmurHash3),
+ * which is fast enough to run inside the scan and mixes well enough for hash partitioning and
+ * cardinality sketches. It is not a cryptographic hash.
+ */
+
+static inline uint64_t mix64(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+uint64_t hash_bytes(const char *data, size_t size, uint64_t seed) {
+    /**
+     * Hash a memory range.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     * @param seed seed, different seeds give independent hash functions
+     * @return 64-bit hash
+     */
+    uint64_t hash = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        hash = (hash ^ mix64(word)) * 0x9e3779b97f4a7c15ULL;
+        data += 8;
+        size -= 8;
+    }
+    if (size > 0) {
+        uint64_t word = 0;
+        std::memcpy(&word, data, size);
+        hash = (hash ^ mix64(word ^ size)) * 0x9e3779b97f4a7c15ULL;
+    }
+    return mix64(hash);
+}
+
+/**
+ * Exact distinct line counting.
+ *
+ * Lines are hashed during the scan and routed by the top bits of their hash to one of
+ * DISTINCT_PARTITIONS partitions, so equal lines always meet in the same partition. Scanning
+ * workers batch records locally and append whole batches to a partition under its own mutex.
+ * When the buffered records of all partitions exceed half of the memory limit, the partition being
+ * appended to is spilled to a file in the spill directory.
+ *
+ * Partitions are then deduplicated independently by the workers, each owning its partitions
+ * exclusively, so the sets need no locking. A partition's set is an open-addressing table with
+ * linear probing over (hash, record offset) slots; equal hashes are confirmed by comparing the line
+ * bytes, so the count is exact. Only one partition per worker is in memory at a time. The other
+ * half of the limit is shared by the workers, first for their scan batches, then for the partition
+ * each deduplicates, so there are at most as many workers as 2 * NCOUNT_BUFFER_SIZE shares fit.
+ * A partition whose records, table and output exceed its share is not loaded: its records are
+ * streamed into DISTINCT_SPLITS sub-partition spill files by the next DISTINCT_SPLIT_BITS bits of
+ * the hash, which are deduplicated the same way, recursively. Records sharing all 64 hash bits are
+ * in practice one line repeated, they are streamed and compared with the few distinct lines among
+ * them. The limit holds however skewed the lines are, except for a single line larger than a share.
+ *
+ * A record is the 64-bit hash, the 32-bit line size and the line bytes, lines of 4 GiB and more
+ * are rejected.
+ */
+
+struct DistinctLinePartition {
+    std::mutex mutex;
+    std::string records;
+    std::filesystem::path spill_path;
+    uint64_t spilled_bytes = 0;
+    uint64_t record_count = 0; // spilled and buffered
+};
+
+static void append_distinct_record(std::string &records, uint64_t hash, const char *line, uint32_t size) {
+    size_t offset = records.size();
+    records.resize(offset + sizeof(hash) + sizeof(size) + size);
+    std::memcpy(&records[offset], &hash, sizeof(hash));
+    std::memcpy(&records[offset + sizeof(hash)], &size, sizeof(size));
+    std::memcpy(&records[offset + sizeof(hash) + sizeof(size)], line, size);
+}
+
+static void spill_distinct_records(DistinctLinePartition &partition) {
+    /**
+     * Append the buffered records of a partition to its spill file and release them.
+     */
+    std::ofstream spill{partition.spill_path, std::ios::out | std::ios::binary | std::ios::app};
+    spill.write(partition.records.data(), static_cast<std::streamsize>(partition.records.size()));
+    if (!spill) {
+        throw std::runtime_error("Cannot write " + partition.spill_path.string());
+    }
+    partition.spilled_bytes += partition.records.size();
+    partition.records = std::string{};
+}
+
+template<typename RecordFunction>
+static void for_each_distinct_record(DistinctLinePartition &partition, RecordFunction &&record_function) {
+    /**
+     * Call record_function(hash, line, size) for the spilled records of a partition, streamed from
+     * its spill file, then for its buffered ones.
+     */
+    if (partition.spilled_bytes > 0) {
+        std::ifstream spill{partition.spill_path, std::ios::in | std::ios::binary};
+        std::string line;
+        for (uint64_t offset = 0; offset < partition.spilled_bytes;) {
+            char header[sizeof(uint64_t) + sizeof(uint32_t)];
+            uint64_t hash;
+            uint32_t size;
+            if (!spill.read(header, sizeof(header))) {
+                throw std::runtime_error("Cannot read " + partition.spill_path.string());
+            }
+            std::memcpy(&hash, header, sizeof(hash));
+            std::memcpy(&size, header + sizeof(hash), sizeof(size));
+            line.resize(size);
+            if (!spill.read(line.data(), static_cast<std::streamsize>(size))) {
+                throw std::runtime_error("Cannot read " + partition.spill_path.string());
+            }
+            record_function(hash, line.data(), size);
+            offset += sizeof(header) + size;
+        }
+    }
+    for (size_t offset = 0; offset < partition.records.size();) {
+        uint64_t hash;
+        uint32_t size;
+        std::memcpy(&hash, &partition.records[offset], sizeof(hash));
+        std::memcpy(&size, &partition.records[offset + sizeof(hash)], sizeof(size));
+        record_function(hash, &partition.records[offset + sizeof(hash) + sizeof(size)], size);
+        offset += sizeof(hash) + sizeof(size) + size;
+    }
+}
+
+static void split_distinct_partition(DistinctLinePartition &partition, std::vector<DistinctLinePartition> &parts,
+                                     unsigned hash_bits) {
+    /**
+     * Move the records of a partition, spilled and buffered, to sub-partition spill files by the
+     * DISTINCT_SPLIT_BITS hash bits after the first hash_bits.
+     */
+    const size_t batch_limit = NCOUNT_BUFFER_SIZE / DISTINCT_SPLITS;
+    for_each_distinct_record(partition, [&](uint64_t hash, const char *line, uint32_t size) {
+        DistinctLinePartition &part = parts[(hash >> (64 - hash_bits - DISTINCT_SPLIT_BITS)) & (DISTINCT_SPLITS - 1)];
+        append_distinct_record(part.records, hash, line, size);
+        ++part.record_count;
+        if (part.records.size() > batch_limit) {
+            spill_distinct_records(part);
+        }
+    });
+    partition.records = std::string{};
+    for (auto &part: parts) {
+        if (!part.records.empty()) {
+            spill_distinct_records(part);
+        }
+    }
+}
+
+static void deduplicate_partition(DistinctLinePartition &partition, size_t partition_limit, unsigned hash_bits,
+                                  std::atomic<uint64_t> &distinct_lines, std::mutex &output_mutex,
+                                  std::ostream *unique_out) {
+    /**
+     * Count distinct lines of one partition and write them to unique_out if given. Partitions
+     * needing more than partition_limit bytes are split by more hash bits than the hash_bits they
+     * share.
+     */
+    if (partition.record_count == 0) {
+        return;
+    }
+
+    struct Slot {
+        uint64_t hash;
+        uint64_t offset; // record offset + 1, 0 marks an empty slot
+    };
+    size_t capacity = 16;
+    while (capacity < partition.record_count * 2) {
+        capacity *= 2;
+    }
+    const uint64_t record_bytes = partition.spilled_bytes + partition.records.size();
+    const uint64_t needed = record_bytes + capacity * sizeof(Slot) + (unique_out != nullptr ? record_bytes : 0);
+
+    if (needed > partition_limit && partition.record_count > 1 && hash_bits + DISTINCT_SPLIT_BITS > 64) {
+        // every record has the same hash, the same line repeated unless there is a 64-bit collision
+        std::vector<std::string> seen;
+        std::string output;
+        for_each_distinct_record(partition, [&](uint64_t, const char *line, uint32_t size) {
+            if (std::find(seen.begin(), seen.end(), std::string_view{line, size}) == seen.end()) {
+                seen.emplace_back(line, size);
+                if (unique_out != nullptr) {
+                    output.append(line, size);
+                    output += '\n';
+                }
+            }
+        });
+        partition.records = std::string{};
+        distinct_lines += seen.size();
+        if (unique_out != nullptr) {
+            std::lock_guard<std::mutex> lock{output_mutex};
+            unique_out->write(output.data(), static_cast<std::streamsize>(output.size()));
+        }
+        return;
+    }
+
+    if (needed > partition_limit && partition.record_count > 1) {
+        std::vector<DistinctLinePartition> parts(DISTINCT_SPLITS);
+        for (size_t part = 0; part < parts.size(); ++part) {
+            parts[part].spill_path = partition.spill_path.string() + "_" + std::to_string(part);
+        }
+        try {
+            split_distinct_partition(partition, parts, hash_bits);
+            if (partition.spilled_bytes > 0) {
+                std::filesystem::remove(partition.spill_path);
+            }
+            for (auto &part: parts) {
+                deduplicate_partition(part, partition_limit, hash_bits + DISTINCT_SPLIT_BITS, distinct_lines,
+                                      output_mutex, unique_out);
+                if (part.spilled_bytes > 0) {
+                    std::filesystem::remove(part.spill_path);
+                }
+            }
+        } catch (...) {
+            for (const auto &part: parts) {
+                std::filesystem::remove(part.spill_path);
+            }
+            throw;
+        }
+        return;
+    }
+
+    std::string records;
+    if (partition.spilled_bytes > 0) {
+        records.resize(partition.spilled_bytes);
+        std::ifstream spill{partition.spill_path, std::ios::in | std::ios::binary};
+        if (!spill.read(records.data(), static_cast<std::streamsize>(records.size()))) {
+            throw std::runtime_error("Cannot read " + partition.spill_path.string());
+        }
+    }
+    records += partition.records;
+    partition.records = std::string{};
+
+    std::vector<Slot> table(capacity);
+    const size_t mask = capacity - 1;
+
+    uint64_t distinct = 0;
+    std::string output;
+    for (size_t offset = 0; offset < records.size();) {
+        uint64_t hash;
+        uint32_t size;
+        std::memcpy(&hash, &records[offset], sizeof(hash));
+        std::memcpy(&size, &records[offset + sizeof(hash)], sizeof(size));
+        const char *line = &records[offset + sizeof(hash) + sizeof(size)];
+
+        bool duplicate = false;
+        size_t slot = hash & mask; // the top bits are the same within a partition, the low ones are not
+        while (table[slot].offset != 0) {
+            if (table[slot].hash == hash) {
+                uint32_t other_size;
+                std::memcpy(&other_size, &records[table[slot].offset - 1 + sizeof(hash)], sizeof(other_size));
+                if (other_size == size &&
+                    std::memcmp(&records[table[slot].offset - 1 + sizeof(hash) + sizeof(size)], line, size) == 0) {
+                    duplicate = true;
+                    break;
+                }
+            }
+            slot = (slot + 1) & mask;
+        }
+        if (!duplicate) {
+            table[slot] = {hash, offset + 1};
+            ++distinct;
+            if (unique_out != nullptr) {
+                output.append(line, size);
+                output += '\n';
+            }
+        }
+        offset += sizeof(hash) + sizeof(size) + size;
+    }
+
+    distinct_lines += distinct;
+    if (unique_out != nullptr) {
+        std::lock_guard<std::mutex> lock{output_mutex};
+        unique_out->write(output.data(), static_cast<std::streamsize>(output.size()));
+    }
+}
+
+DistinctLineResult count_distinct_lines(const std::vector<std::filesystem::directory_entry> &files,
+                                        size_t memory_limit, const std::filesystem::path &spill_directory,
+                                        std::ostream *unique_out) {
+    /**
+     * Count lines and exactly count distinct lines of all files.
+     *
+     * @param files vector of files to scan
+     * @param memory_limit bytes for buffered records, scan batches and deduplication, half of it
+     *        for buffered records above which partitions spill to disk
+     * @param spill_directory directory for spill files, they are removed before returning
+     * @param unique_out stream receiving every distinct line once, grouped by partition, or nullptr
+     * @return line, distinct line and spilled byte counts
+     */
+    std::vector<DistinctLinePartition> partitions(DISTINCT_PARTITIONS);
+    for (size_t partition = 0; partition < partitions.size(); ++partition) {
+        partitions[partition].spill_path = spill_directory / ("axxonsoft_distinct_" + std::to_string(::getpid()) +
+                                                              "_" + std::to_string(partition) + ".spill");
+    }
+    std::atomic<size_t> buffered_bytes{0};
+    std::atomic<uint64_t> lines{0};
+    const size_t buffer_limit = memory_limit / 2;
+
+    auto flush = [&](size_t partition_index, std::string &batch, uint64_t &batch_records) {
+        DistinctLinePartition &partition = partitions[partition_index];
+        std::lock_guard<std::mutex> lock{partition.mutex};
+        partition.records += batch;
+        partition.record_count += batch_records;
+        buffered_bytes += batch.size();
+        batch.clear();
+        batch_records = 0;
+        if (buffered_bytes > buffer_limit) {
+            size_t spilled = partition.records.size();
+            spill_distinct_records(partition);
+            buffered_bytes -= spilled;
+        }
+    };
+
+    // Scan: workers take files one by one and route line records to partitions
+    const size_t workers = std::clamp<size_t>((memory_limit - buffer_limit) / (2 * NCOUNT_BUFFER_SIZE), 1,
+                                              std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic<size_t> next_file{0};
+    auto scan = [&]() {
+        std::vector<std::string> batches(DISTINCT_PARTITIONS);
+        std::vector<uint64_t> batch_records(DISTINCT_PARTITIONS);
+        size_t batched_bytes = 0;
+        for (size_t file = next_file++; file < files.size(); file = next_file++) {
+            MappedFile map{files[file].path()};
+            uint64_t file_lines = 0;
+            for_each_line(map.data, map.size, [&](const char *line, size_t size) {
+                ++file_lines;
+                if (size > UINT32_MAX) {
+                    throw std::runtime_error("Line of 4 GiB or more in " + files[file].path().string());
+                }
+                uint64_t hash = hash_bytes(line, size, 0);
+                const size_t partition = hash >> (64 - DISTINCT_PARTITION_BITS);
+                append_distinct_record(batches[partition], hash, line, static_cast<uint32_t>(size));
+                ++batch_records[partition];
+                batched_bytes += sizeof(hash) + sizeof(uint32_t) + size;
+                if (batched_bytes > NCOUNT_BUFFER_SIZE) {
+                    for (size_t flushed = 0; flushed < batches.size(); ++flushed) {
+                        flush(flushed, batches[flushed], batch_records[flushed]);
+                    }
+                    batched_bytes = 0;
+                }
+            });
+            lines += file_lines;
+        }
+        for (size_t partition = 0; partition < batches.size(); ++partition) {
+            flush(partition, batches[partition], batch_records[partition]);
+        }
+    };
+
+    std::exception_ptr error;
+    std::vector<std::future<void>> futures;
+    for (size_t worker = 0; worker < workers; ++worker) {
+        futures.push_back(std::async(std::launch::async, scan));
+    }
+    for (auto &future: futures) {
+        try {
+            future.get();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    // Deduplicate: every partition is owned by exactly one worker
+    std::atomic<uint64_t> distinct_lines{0};
+    std::atomic<size_t> next_partition{0};
+    std::mutex output_mutex;
+    const size_t partition_limit = (memory_limit - buffer_limit) / workers;
+    futures.clear();
+    for (size_t worker = 0; worker < workers && !error; ++worker) {
+        futures.push_back(std::async(std::launch::async, [&]() {
+            for (size_t partition = next_partition++; partition < partitions.size(); partition = next_partition++) {
+                deduplicate_partition(partitions[partition], partition_limit, DISTINCT_PARTITION_BITS,
+                                      distinct_lines, output_mutex, unique_out);
+            }
+        }));
+    }
+
+    DistinctLineResult result{lines, 0, 0};
+    for (auto &future: futures) {
+        try {
+            future.get();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    for (const auto &partition: partitions) {
+        if (partition.spilled_bytes > 0) {
+            result.spilled_bytes += partition.spilled_bytes;
+            std::filesystem::remove(partition.spill_path);
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    result.distinct_lines = distinct_lines;
+    return result;
+}
+
+int run_distinct_mode(const std::vector<std::filesystem::directory_entry> &files,
+                      const std::vector<std::string> &options) {
+    /**
+     * Print line and exact distinct line counts of the files. Distinct lines are written to
+     * -distinct-out=FILE, buffered records and deduplication are limited to -distinct-memory=MB
+     * (default DISTINCT_MEMORY_LIMIT_MB) and records spill to -distinct-spill=DIR (default: system
+     * temp directory).
+     *
+     * @param files vector of files to scan
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::string memory_option = option_value(options, "distinct-memory");
+    std::string spill_option = option_value(options, "distinct-spill");
+    std::string output_path = option_value(options, "distinct-out");
+
+    size_t memory_limit_mb = DISTINCT_MEMORY_LIMIT_MB;
+    if (!memory_option.empty() &&
+        (std::from_chars(memory_option.data(), memory_option.data() + memory_option.size(), memory_limit_mb).ec !=
+         std::errc() || memory_limit_mb == 0)) {
+        std::cout << "Invalid memory limit " << memory_option << "\n";
+        return 1;
+    }
+
+    try {
+        std::filesystem::path spill_directory = spill_option.empty() ? std::filesystem::temp_directory_path()
+                                                                     : std::filesystem::path{spill_option};
+        std::ofstream output;
+        if (!output_path.empty()) {
+            output.open(output_path, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!output) {
+                throw std::runtime_error("Cannot create " + output_path);
+            }
+        }
+
+        MemoryReservation reservation{memory_limit_mb * 1024 * 1024,
+                                      std::min<size_t>(memory_limit_mb, GOVERNOR_MIN_DISTINCT_MB) * 1024 * 1024};
+        DistinctLineResult result = count_distinct_lines(files, reservation.bytes, spill_directory,
+                                                         output_path.empty() ? nullptr : &output);
+        std::cout << "Lines: " << result.lines << "\n"
+                  << "Distinct lines: " << result.distinct_lines << "\n";
+        if (result.spilled_bytes > 0) {
+            std::cout << "Spilled bytes: " << result.spilled_bytes << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * HyperLogLog cardinality sketches.
+ *
+ * A sketch has 2^HLL_PRECISION registers, each keeps the highest rank (position of the first set
+ * bit) of hashes routed to it by their top bits. With 16384 registers the standard error is about
+ * 0.8%. Cardinality is estimated with Ertl's improved estimator ("New cardinality estimation
+ * algorithms for HyperLogLog sketches", 2017), which is unbiased over the whole range without the
+ * empirical bias tables of HyperLogLog++. Sketches merge by taking register maximums, so sketches of
+ * threads, shards and previous runs combine into exactly the sketch of the union.
+ */
+
+void HyperLogLog::add(uint64_t hash) {
+    const uint64_t remaining = hash << HLL_PRECISION;
+    const uint8_t rank = remaining == 0 ? 64 - HLL_PRECISION + 1 : static_cast<uint8_t>(__builtin_clzll(remaining) + 1);
+    uint8_t &reg = registers[hash >> (64 - HLL_PRECISION)];
+    reg = std::max(reg, rank);
+}
+
+void HyperLogLog::merge(const HyperLogLog &other) {
+    for (size_t i = 0; i < registers.size(); ++i) {
+        registers[i] = std::max(registers[i], other.registers[i]);
+    }
+}
+
+double HyperLogLog::estimate() const {
+    /**
+     * @return estimated number of distinct hashes added
+     */
+    constexpr int q = 64 - HLL_PRECISION;
+    const auto m = static_cast<double>(registers.size());
+
+    std::array<double, q + 2> histogram{};
+    for (uint8_t reg: registers) {
+        histogram[reg] += 1;
+    }
+
+    auto sigma = [](double x) {
+        if (x == 1) {
+            return std::numeric_limits<double>::infinity();
+        }
+        double y = 1, z = x, previous;
+        do {
+            x *= x;
+            previous = z;
+            z += x * y;
+            y += y;
+        } while (z != previous);
+        return z;
+    };
+    auto tau = [](double x) {
+        if (x == 0 || x == 1) {
+            return 0.0;
+        }
+        double y = 1, z = 1 - x, previous;
+        do {
+            x = std::sqrt(x);
+            previous = z;
+            y *= 0.5;
+            z -= (1 - x) * (1 - x) * y;
+        } while (z != previous);
+        return z / 3;
+    };
+
+    double z = m * tau(1 - histogram[q + 1] / m);
+    for (int k = q; k >= 1; --k) {
+        z = 0.5 * (z + histogram[k]);
+    }
+    z += m * sigma(histogram[0] / m);
+    return 0.5 / std::log(2.0) * m * m / z;
+}
+
+static void write_hyperloglog(std::ostream &out, uint8_t kind, const std::string &name, const HyperLogLog &sketch) {
+    auto name_size = static_cast<uint32_t>(name.size());
+    out.write(reinterpret_cast<const char *>(&kind), sizeof(kind));
+    out.write(reinterpret_cast<const char *>(&name_size), sizeof(name_size));
+    out.write(name.data(), name_size);
+    out.write(reinterpret_cast<const char *>(sketch.registers.data()),
+              static_cast<std::streamsize>(sketch.registers.size()));
+}
+
+static void merge_hyperloglog_file(const std::filesystem::path &file_path, HyperLogLog &lines, HyperLogLog &tokens) {
+    /**
+     * Merge the aggregate sketches ("*") of a sketch file written by -hll-out into lines and tokens.
+     */
+    std::ifstream file{file_path, std::ios::in | std::ios::binary};
+    char magic[8]{};
+    uint8_t precision = 0;
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, HLL_BINARY_MAGIC, sizeof(magic)) != 0 ||
+        !file.read(reinterpret_cast<char *>(&precision), sizeof(precision)) || precision != HLL_PRECISION) {
+        throw std::runtime_error("Not a sketch file " + file_path.string());
+    }
+    const uintmax_t file_size = std::filesystem::file_size(file_path);
+
+    uint8_t kind;
+    while (file.read(reinterpret_cast<char *>(&kind), sizeof(kind))) {
+        uint32_t name_size = 0;
+        if (!file.read(reinterpret_cast<char *>(&name_size), sizeof(name_size))) {
+            throw std::runtime_error("Truncated sketch file " + file_path.string());
+        }
+        auto position = static_cast<uintmax_t>(file.tellg());
+        if (name_size > HLL_NAME_LIMIT || name_size > file_size - position) {
+            throw std::runtime_error("Invalid sketch name size in " + file_path.string());
+        }
+        std::string name(name_size, '\0');
+        if (!file.read(name.data(), name_size)) {
+            throw std::runtime_error("Truncated sketch file " + file_path.string());
+        }
+        HyperLogLog sketch;
+        if (!file.read(reinterpret_cast<char *>(sketch.registers.data()),
+                       static_cast<std::streamsize>(sketch.registers.size()))) {
+            throw std::runtime_error("Truncated sketch file " + file_path.string());
+        }
+        if (name == "*") {
+            (kind == 0 ? lines : tokens).merge(sketch);
+        }
+    }
+}
+
+int run_hyperloglog_mode(const std::vector<std::filesystem::directory_entry> &files,
+                         const std::vector<std::string> &options) {
+    /**
+     * Count lines and estimate distinct lines per file and in total; with -hll-tokens distinct
+     * whitespace separated tokens are estimated too. Sketches of every file and the aggregate
+     * ("*") are saved to -hll-out=FILE, aggregates of earlier runs or shards are merged in from
+     * -hll-merge=FILE,FILE,...
+     *
+     * @param files vector of files to scan
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    const bool with_tokens = std::find(options.begin(), options.end(), "hll-tokens") != options.end();
+    const std::string output_path = option_value(options, "hll-out");
+
+    struct FileEstimate {
+        uint64_t lines = 0;
+        double distinct_lines = 0;
+        double distinct_tokens = 0;
+    };
+    std::vector<FileEstimate> estimates(files.size());
+
+    try {
+        std::ofstream output;
+        if (!output_path.empty()) {
+            output.open(output_path, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!output) {
+                throw std::runtime_error("Cannot create " + output_path);
+            }
+            const uint8_t precision = HLL_PRECISION;
+            output.write(HLL_BINARY_MAGIC, 8);
+            output.write(reinterpret_cast<const char *>(&precision), sizeof(precision));
+        }
+        std::mutex output_mutex;
+
+        // Workers take files one by one, per file sketches are folded into per worker aggregates
+        struct Aggregate {
+            HyperLogLog lines;
+            HyperLogLog tokens;
+        };
+        std::atomic<size_t> next_file{0};
+        auto scan = [&]() {
+            Aggregate aggregate;
+            for (size_t file = next_file++; file < files.size(); file = next_file++) {
+                MappedFile map{files[file].path()};
+                Aggregate sketch;
+                uint64_t lines = 0;
+                for_each_line(map.data, map.size, [&](const char *line, size_t size) {
+                    ++lines;
+                    sketch.lines.add(hash_bytes(line, size, 0));
+                    if (with_tokens) {
+                        for (size_t begin = 0; begin < size;) {
+                            while (begin < size && (line[begin] == ' ' || line[begin] == '\t')) {
+                                ++begin;
+                            }
+                            size_t end = begin;
+                            while (end < size && line[end] != ' ' && line[end] != '\t') {
+                                ++end;
+                            }
+                            if (end > begin) {
+                                sketch.tokens.add(hash_bytes(line + begin, end - begin, 1));
+                            }
+                            begin = end;
+                        }
+                    }
+                });
+
+                estimates[file] = {lines, sketch.lines.estimate(), with_tokens ? sketch.tokens.estimate() : 0};
+                if (!output_path.empty()) {
+                    std::lock_guard<std::mutex> lock{output_mutex};
+                    write_hyperloglog(output, 0, files[file].path().string(), sketch.lines);
+                    if (with_tokens) {
+                        write_hyperloglog(output, 1, files[file].path().string(), sketch.tokens);
+                    }
+                }
+                aggregate.lines.merge(sketch.lines);
+                aggregate.tokens.merge(sketch.tokens);
+            }
+            return aggregate;
+        };
+
+        std::vector<std::future<Aggregate>> futures;
+        for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+            futures.push_back(std::async(std::launch::async, scan));
+        }
+        Aggregate total;
+        for (auto &future: futures) {
+            Aggregate aggregate = future.get();
+            total.lines.merge(aggregate.lines);
+            total.tokens.merge(aggregate.tokens);
+        }
+        for (const auto &merge_path: split_list(option_value(options, "hll-merge"), ',')) {
+            merge_hyperloglog_file(merge_path, total.lines, total.tokens);
+        }
+        if (!output_path.empty()) {
+            write_hyperloglog(output, 0, "*", total.lines);
+            if (with_tokens) {
+                write_hyperloglog(output, 1, "*", total.tokens);
+            }
+            if (!output) {
+                throw std::runtime_error("Cannot write " + output_path);
+            }
+        }
+
+        uint64_t lines = 0;
+        std::cout << std::fixed << std::setprecision(0);
+        for (size_t file = 0; file < files.size(); ++file) {
+            lines += estimates[file].lines;
+            std::cout << files[file].path().string() << "\t" << estimates[file].lines << "\t"
+                      << estimates[file].distinct_lines;
+            if (with_tokens) {
+                std::cout << "\t" << estimates[file].distinct_tokens;
+            }
+            std::cout << "\n";
+        }
+        std::cout << "Total lines: " << lines << "\n"
+                  << "Distinct lines (approx.): " << total.lines.estimate() << "\n";
+        if (with_tokens) {
+            std::cout << "Distinct tokens (approx.): " << total.tokens.estimate() << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Heavy hitters (most frequent lines).
+ *
+ * Line frequencies are estimated by a count-min sketch: HEAVY_HITTERS_DEPTH rows of
+ * HEAVY_HITTERS_WIDTH counters, a line increments one counter per row and its estimate is the
+ * smallest of them. An estimate never underestimates and, with probability 1 - e^-depth (98%),
+ * overestimates by at most e * total / width. Next to the sketch, a min-heap keeps the `capacity`
+ * lines with the highest estimates seen so far, the text of a line is kept only while it is a
+ * candidate. Memory is fixed by the sketch size and the capacity whatever the corpus size, apart
+ * from the candidate texts. Both are reserved from the memory governor, which also caps the workers
+ * by the sketch size.
+ *
+ * Every worker fills its own summary. Summaries are merged by adding the sketches and re-estimating
+ * the union of the candidates against the merged sketch.
+ */
+
+CountMinSketch::CountMinSketch(): counters(size_t{HEAVY_HITTERS_DEPTH} * HEAVY_HITTERS_WIDTH) {}
+
+uint32_t CountMinSketch::add(uint64_t hash) {
+    /**
+     * Count a hash once.
+     *
+     * @return new estimate of the hash count
+     */
+    uint32_t estimate = UINT32_MAX;
+    // row indices come from double hashing of the two 32-bit halves of the hash
+    auto low = static_cast<uint32_t>(hash);
+    auto high = static_cast<uint32_t>(hash >> 32) | 1u;
+    for (size_t row = 0; row < HEAVY_HITTERS_DEPTH; ++row) {
+        uint32_t &counter = counters[row * HEAVY_HITTERS_WIDTH + ((low + row * high) & (HEAVY_HITTERS_WIDTH - 1))];
+        if (counter != UINT32_MAX) {
+            ++counter;
+        }
+        estimate = std::min(estimate, counter);
+    }
+    return estimate;
+}
+
+uint32_t CountMinSketch::estimate(uint64_t hash) const {
+    uint32_t estimate = UINT32_MAX;
+    auto low = static_cast<uint32_t>(hash);
+    auto high = static_cast<uint32_t>(hash >> 32) | 1u;
+    for (size_t row = 0; row < HEAVY_HITTERS_DEPTH; ++row) {
+        estimate = std::min(estimate,
+                            counters[row * HEAVY_HITTERS_WIDTH + ((low + row * high) & (HEAVY_HITTERS_WIDTH - 1))]);
+    }
+    return estimate;
+}
+
+void CountMinSketch::merge(const CountMinSketch &other) {
+    for (size_t i = 0; i < counters.size(); ++i) {
+        uint64_t sum = uint64_t{counters[i]} + other.counters[i];
+        counters[i] = static_cast<uint32_t>(std::min<uint64_t>(sum, UINT32_MAX));
+    }
+}
+
+HeavyHitters::HeavyHitters(size_t capacity): reservation{fixed_bytes(capacity)}, capacity{capacity} {
+    entries.reserve(capacity);
+    heap.reserve(capacity);
+}
+
+size_t HeavyHitters::fixed_bytes(size_t capacity) {
+    /**
+     * @return memory of a summary without its line texts: the sketch, entries, heap and hash nodes
+     */
+    return size_t{HEAVY_HITTERS_DEPTH} * HEAVY_HITTERS_WIDTH * sizeof(uint32_t) +
+           capacity * (sizeof(Entry) + sizeof(size_t) + sizeof(std::pair<uint64_t, size_t>) + 3 * sizeof(void *));
+}
+
+void HeavyHitters::reserve_text(size_t bytes) {
+    /**
+     * Account bytes of new candidate text, the reservation grows in NCOUNT_BUFFER_SIZE steps.
+     */
+    text_bytes += bytes;
+    size_t needed = fixed_bytes(capacity) + text_bytes;
+    if (needed > reservation.bytes) {
+        reservation.resize(std::max(needed, reservation.bytes + NCOUNT_BUFFER_SIZE));
+    }
+}
+
+void HeavyHitters::sift_down(size_t position) {
+    while (true) {
+        size_t smallest = position;
+        for (size_t child = 2 * position + 1; child <= 2 * position + 2 && child < heap.size(); ++child) {
+            if (entries[heap[child]].count < entries[heap[smallest]].count) {
+                smallest = child;
+            }
+        }
+        if (smallest == position) {
+            return;
+        }
+        std::swap(heap[position], heap[smallest]);
+        entries[heap[position]].heap_position = position;
+        entries[heap[smallest]].heap_position = smallest;
+        position = smallest;
+    }
+}
+
+void HeavyHitters::offer(uint64_t hash, std::string_view line, uint64_t count) {
+    /**
+     * Make the line a candidate with the given estimate if it beats the least counted candidate.
+     */
+    auto found = slots.find(hash);
+    if (found != slots.end()) {
+        Entry &entry = entries[found->second];
+        entry.count = count; // estimates only grow, the heap order is restored downwards
+        sift_down(entry.heap_position);
+        return;
+    }
+
+    if (entries.size() < capacity) {
+        reserve_text(line.size());
+        entries.push_back({hash, std::string{line}, count, heap.size()});
+        heap.push_back(entries.size() - 1);
+        slots.emplace(hash, entries.size() - 1);
+        for (size_t position = heap.size() - 1; position > 0;) { // sift up
+            size_t parent = (position - 1) / 2;
+            if (entries[heap[parent]].count <= entries[heap[position]].count) {
+                break;
+            }
+            std::swap(heap[position], heap[parent]);
+            entries[heap[position]].heap_position = position;
+            entries[heap[parent]].heap_position = parent;
+            position = parent;
+        }
+        return;
+    }
+
+    Entry &least = entries[heap[0]];
+    if (count <= least.count) {
+        return;
+    }
+    if (line.size() > least.line.capacity()) {
+        reserve_text(line.size() - least.line.capacity());
+        least.line = std::string{line};
+    } else {
+        least.line.assign(line.data(), line.size());
+    }
+    slots.erase(least.hash);
+    slots.emplace(hash, heap[0]);
+    least.hash = hash;
+    least.count = count;
+    sift_down(0);
+}
+
+void HeavyHitters::add(uint64_t hash, std::string_view line) {
+    ++total;
+    offer(hash, line, sketch.add(hash));
+}
+
+void HeavyHitters::merge(const HeavyHitters &other) {
+    sketch.merge(other.sketch);
+    total += other.total;
+
+    std::vector<Entry> candidates = std::move(entries);
+    for (const auto &entry: other.entries) {
+        if (slots.find(entry.hash) == slots.end()) {
+            reserve_text(entry.line.size());
+            candidates.push_back(entry);
+        }
+    }
+    entries.clear();
+    entries.reserve(capacity);
+    heap.clear();
+    slots.clear();
+    for (const auto &candidate: candidates) {
+        offer(candidate.hash, candidate.line, sketch.estimate(candidate.hash));
+    }
+
+    // only the texts kept by the new candidates stay reserved
+    candidates = std::vector<Entry>{};
+    text_bytes = 0;
+    for (const auto &entry: entries) {
+        text_bytes += entry.line.capacity();
+    }
+    reservation.resize(fixed_bytes(capacity) + text_bytes);
+}
+
+uint64_t HeavyHitters::error_bound() const {
+    /**
+     * @return overestimation bound of counts, e * total / width, holding with probability 1 - e^-depth
+     */
+    return static_cast<uint64_t>(std::ceil(std::exp(1.0) * static_cast<double>(total) / HEAVY_HITTERS_WIDTH));
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::top(size_t n) const {
+    std::vector<Entry> result = entries;
+    size_t keep = std::min(n, result.size());
+    std::partial_sort(result.begin(), result.begin() + keep, result.end(),
+                      [](const Entry &a, const Entry &b) { return a.count > b.count; });
+    result.resize(keep);
+    return result;
+}
+
+int run_heavy_hitters_mode(const std::vector<std::filesystem::directory_entry> &files,
+                           const std::vector<std::string> &options) {
+    /**
+     * Print the -top=N (default 10) most frequent lines with their count bounds. Summaries keep
+     * max(HEAVY_HITTERS_CAPACITY, 4 * N) candidates.
+     *
+     * @param files vector of files to scan
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    size_t top_n = 10;
+    std::string top_option = option_value(options, "top");
+    if (!top_option.empty() &&
+        (std::from_chars(top_option.data(), top_option.data() + top_option.size(), top_n).ec != std::errc() ||
+         top_n == 0)) {
+        std::cout << "Invalid number of lines " << top_option << "\n";
+        return 1;
+    }
+    const size_t capacity = std::max<size_t>(HEAVY_HITTERS_CAPACITY, 4 * top_n);
+
+    try {
+        std::atomic<size_t> next_file{0};
+        auto scan = [&]() {
+            HeavyHitters summary{capacity};
+            for (size_t file = next_file++; file < files.size(); file = next_file++) {
+                MappedFile map{files[file].path()};
+                for_each_line(map.data, map.size, [&summary](const char *line, size_t size) {
+                    summary.add(hash_bytes(line, size, 0), {line, size});
+                });
+            }
+            return summary;
+        };
+
+        std::vector<std::future<HeavyHitters>> futures;
+        for (size_t worker = 0; worker < governed_workers(HeavyHitters::fixed_bytes(capacity) + NCOUNT_BUFFER_SIZE); ++worker) {
+            futures.push_back(std::async(std::launch::async, scan));
+        }
+        HeavyHitters summary = futures[0].get();
+        for (size_t worker = 1; worker < futures.size(); ++worker) {
+            summary.merge(futures[worker].get());
+        }
+
+        const uint64_t error = summary.error_bound();
+        std::cout << "Total lines: " << summary.total << "\n"
+                  << "Counts overestimate by at most " << error << " with 98% probability\n"
+                  << "Count\tAt least\tLine\n";
+        for (const auto &entry: summary.top(top_n)) {
+            std::cout << entry.count << "\t" << (entry.count > error ? entry.count - error : 1) << "\t"
+                      << entry.line << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Near-duplicate files with MinHash and LSH banding.
+ *
+ * A file is the set of its shingles, a shingle being the hash of MINHASH_SHINGLE_LINES consecutive
+ * line hashes. Signatures use one permutation hashing: the top bits of a shingle hash pick one of
+ * MINHASH_BINS bins and the bin keeps the smallest hash it sees, so each shingle costs one update
+ * instead of one per hash function. Bins left empty by small files are filled by optimal
+ * densification (Shrivastava, 2017), borrowing the value of a bin chosen by a fixed pseudo-random
+ * probe sequence, which is the same for every file. The share of equal bins of two signatures
+ * estimates the Jaccard similarity of the files.
+ *
+ * Signatures are cut into MINHASH_BANDS bands, files with an identical band land in the same
+ * bucket and only such candidate pairs are compared, instead of all N^2 pairs. With 16 bands of 8
+ * bins, pairs above about 0.7 similarity are found with high probability.
+ */
+
+MinHashSignature minhash_file(const char *data, size_t size, uint64_t &lines) {
+    /**
+     * Count lines and compute the MinHash signature of a mapped file.
+     *
+     * @param data mapped file
+     * @param size file size
+     * @param lines output line count
+     * @return signature, empty if the file has less than MINHASH_SHINGLE_LINES lines
+     */
+    MinHashSignature signature(MINHASH_BINS, UINT64_MAX);
+    std::array<uint64_t, MINHASH_SHINGLE_LINES> window{};
+    lines = 0;
+    for_each_line(data, size, [&](const char *line, size_t line_size) {
+        window[lines++ % MINHASH_SHINGLE_LINES] = hash_bytes(line, line_size, 0);
+        if (lines < MINHASH_SHINGLE_LINES) {
+            return;
+        }
+        uint64_t shingle = 0;
+        for (size_t i = lines; i < lines + MINHASH_SHINGLE_LINES; ++i) { // oldest to newest line
+            shingle = mix64(shingle ^ window[i % MINHASH_SHINGLE_LINES]);
+        }
+        uint64_t &bin = signature[shingle >> (64 - MINHASH_BIN_BITS)];
+        bin = std::min(bin, shingle);
+    });
+
+    if (lines < MINHASH_SHINGLE_LINES) {
+        return {};
+    }
+    MinHashSignature densified = signature;
+    for (size_t bin = 0; bin < MINHASH_BINS; ++bin) {
+        for (uint64_t attempt = 1; densified[bin] == UINT64_MAX; ++attempt) {
+            densified[bin] = signature[mix64(bin * 0x9e3779b97f4a7c15ULL + attempt) % MINHASH_BINS];
+        }
+    }
+    return densified;
+}
+
+double minhash_similarity(const MinHashSignature &a, const MinHashSignature &b) {
+    size_t equal = 0;
+    for (size_t bin = 0; bin < MINHASH_BINS; ++bin) {
+        equal += a[bin] == b[bin];
+    }
+    return static_cast<double>(equal) / MINHASH_BINS;
+}
+
+int run_near_duplicates_mode(const std::vector<std::filesystem::directory_entry> &files,
+                             const std::vector<std::string> &options) {
+    /**
+     * Print pairs of files whose estimated Jaccard similarity is at least -similarity=S (0.8 by
+     * default), most similar first.
+     *
+     * @param files vector of files to scan
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    double threshold = 0.8;
+    std::string threshold_option = option_value(options, "similarity");
+    if (!threshold_option.empty()) {
+        char *end = nullptr;
+        threshold = std::strtod(threshold_option.c_str(), &end);
+        if (*end != '\0' || !(threshold > 0.0 && threshold <= 1.0)) {
+            std::cout << "Invalid similarity " << threshold_option << ", expected a number in (0, 1]\n";
+            return 1;
+        }
+    }
+
+    try {
+        std::vector<MinHashSignature> signatures(files.size());
+        std::atomic<size_t> next_file{0};
+        std::atomic<uint64_t> lines{0};
+        auto scan = [&]() {
+            for (size_t file = next_file++; file < files.size(); file = next_file++) {
+                MappedFile map{files[file].path()};
+                uint64_t file_lines = 0;
+                signatures[file] = minhash_file(map.data, map.size, file_lines);
+                lines += file_lines;
+            }
+        };
+        std::vector<std::future<void>> futures;
+        for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+            futures.push_back(std::async(std::launch::async, scan));
+        }
+        for (auto &future: futures) {
+            future.get();
+        }
+
+        // LSH: files sharing a band bucket become candidate pairs
+        constexpr size_t rows = MINHASH_BINS / MINHASH_BANDS;
+        std::vector<std::pair<size_t, size_t>> candidates;
+        for (size_t band = 0; band < MINHASH_BANDS; ++band) {
+            std::unordered_map<uint64_t, std::vector<size_t>> buckets;
+            for (size_t file = 0; file < files.size(); ++file) {
+                if (!signatures[file].empty()) {
+                    buckets[hash_bytes(reinterpret_cast<const char *>(&signatures[file][band * rows]),
+                                       rows * sizeof(uint64_t), band)].push_back(file);
+                }
+            }
+            for (const auto &bucket: buckets) {
+                for (size_t i = 0; i < bucket.second.size(); ++i) {
+                    for (size_t j = i + 1; j < bucket.second.size(); ++j) {
+                        candidates.emplace_back(bucket.second[i], bucket.second[j]);
+                    }
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        std::vector<std::pair<double, std::pair<size_t, size_t>>> pairs;
+        for (const auto &candidate: candidates) {
+            double similarity = minhash_similarity(signatures[candidate.first], signatures[candidate.second]);
+            if (similarity >= threshold) {
+                pairs.emplace_back(similarity, candidate);
+            }
+        }
+        std::sort(pairs.begin(), pairs.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+        std::cout << "Total lines: " << lines << "\n"
+                  << "Near-duplicate pairs: " << pairs.size() << "\n";
+        for (const auto &pair: pairs) {
+            std::cout << std::fixed << std::setprecision(3) << pair.first << "\t"
+                      << files[pair.second.first].path().string() << "\t"
+                      << files[pair.second.second].path().string() << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Incremental recount with a content-defined chunk cache.
+ *
+ * Files are cut into chunks with FastCDC (Xia et al., 2016): a gear rolling hash is updated with
+ * every byte and a chunk ends where its top bits are zero, using a stricter mask before the
+ * average chunk size and a looser one after it (normalized chunking). Boundaries depend only on
+ * nearby content, so an in-place edit changes the chunks around it and leaves the others intact.
+ * Newline counts are cached by chunk hash: on a rerun only chunks with an unknown hash are counted.
+ *
+ * Before any hashing, the size, modification time and inode reported by the kernel are compared
+ * with the cached ones, and a file whose metadata did not change is not read at all. The cache is
+ * rewritten after every run with the chunks of the current files only, so it does not grow with
+ * obsolete chunks. Before a file is chunked, its cache entries are reserved for the most chunks it
+ * can have (one per CDC_MIN_CHUNK bytes) and trimmed to the real count afterwards.
+ */
+
+static const std::array<uint64_t, 256> &gear_table() {
+    static const std::array<uint64_t, 256> table = []() {
+        std::array<uint64_t, 256> values{};
+        for (size_t i = 0; i < values.size(); ++i) {
+            values[i] = mix64(i + 0x9e3779b97f4a7c15ULL);
+        }
+        return values;
+    }();
+    return table;
+}
+
+size_t fastcdc_cut(const char *data, size_t size) {
+    /**
+     * Find the end of the chunk starting at data.
+     *
+     * @param data first byte of the chunk
+     * @param size bytes left in the file
+     * @return chunk size
+     */
+    if (size <= CDC_MIN_CHUNK) {
+        return size;
+    }
+    const auto &gear = gear_table();
+    const uint64_t strict_mask = ~uint64_t{0} << (64 - CDC_STRICT_MASK_BITS);
+    const uint64_t loose_mask = ~uint64_t{0} << (64 - CDC_LOOSE_MASK_BITS);
+    const size_t normal = std::min<size_t>(CDC_AVERAGE_CHUNK, size);
+    const size_t maximum = std::min<size_t>(CDC_MAX_CHUNK, size);
+    const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_CHUNK; // no cut point can be found before the minimum size, skip hashing it
+    for (; i < normal; ++i) {
+        hash = (hash << 1) + gear[bytes[i]];
+        if ((hash & strict_mask) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < maximum; ++i) {
+        hash = (hash << 1) + gear[bytes[i]];
+        if ((hash & loose_mask) == 0) {
+            return i + 1;
+        }
+    }
+    return maximum;
+}
+
+size_t ChunkCache::file_bytes(size_t path_size, size_t chunk_keys) {
+    /**
+     * @return estimated memory of a file entry, its chunks are counted separately
+     */
+    return path_size + sizeof(FileEntry) + CDC_CACHE_ENTRY_BYTES + chunk_keys * sizeof(uint64_t);
+}
+
+ChunkCache load_chunk_cache(const std::filesystem::path &file_path) {
+    /**
+     * Load a chunk cache, a missing file gives an empty cache.
+     *
+     * Format: magic, uint64_t file count, per file uint32_t path size, path, size, mtime, inode,
+     * lines and chunk count as 64-bit integers and its chunk keys, then uint64_t chunk count and
+     * (chunk key, newlines) pairs.
+     */
+    ChunkCache cache;
+    std::ifstream file{file_path, std::ios::in | std::ios::binary};
+    if (!file) {
+        return cache;
+    }
+
+    char magic[8]{};
+    uint64_t count = 0;
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, CDC_CACHE_MAGIC, sizeof(magic)) != 0 ||
+        !file.read(reinterpret_cast<char *>(&count), sizeof(count))) {
+        throw std::runtime_error("Not a chunk cache " + file_path.string());
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t path_size = 0;
+        file.read(reinterpret_cast<char *>(&path_size), sizeof(path_size));
+        cache.reservation.resize(cache.reservation.bytes + ChunkCache::file_bytes(file ? path_size : 0, 0));
+        std::string path(file ? path_size : 0, '\0');
+        file.read(path.data(), static_cast<std::streamsize>(path.size()));
+        uint64_t fields[5]{};
+        file.read(reinterpret_cast<char *>(fields), sizeof(fields));
+        ChunkCache::FileEntry entry{fields[0], static_cast<int64_t>(fields[1]), fields[2], fields[3], {}};
+        if (file && fields[4] > SIZE_MAX / CDC_CACHE_ENTRY_BYTES) {
+            throw std::runtime_error("Not a chunk cache " + file_path.string());
+        }
+        cache.reservation.resize(cache.reservation.bytes + (file ? fields[4] : 0) * sizeof(uint64_t));
+        entry.chunk_keys.resize(file ? fields[4] : 0);
+        file.read(reinterpret_cast<char *>(entry.chunk_keys.data()),
+                  static_cast<std::streamsize>(entry.chunk_keys.size() * sizeof(uint64_t)));
+        cache.files.emplace(std::move(path), std::move(entry));
+    }
+    if (!file.read(reinterpret_cast<char *>(&count), sizeof(count)) || count > SIZE_MAX / CDC_CACHE_ENTRY_BYTES) {
+        throw std::runtime_error("Truncated chunk cache " + file_path.string());
+    }
+    cache.reservation.resize(cache.reservation.bytes + count * CDC_CACHE_ENTRY_BYTES);
+    cache.chunks.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t chunk[2];
+        file.read(reinterpret_cast<char *>(chunk), sizeof(chunk));
+        cache.chunks.emplace(chunk[0], chunk[1]);
+    }
+    if (!file) {
+        throw std::runtime_error("Truncated chunk cache " + file_path.string());
+    }
+    return cache;
+}
+
+void save_chunk_cache(const ChunkCache &cache, const std::filesystem::path &file_path) {
+    /**
+     * Save a chunk cache through a temporary file, a crash never leaves a truncated cache behind.
+     */
+    std::filesystem::path temporary_path = file_path;
+    temporary_path += ".tmp";
+    {
+        std::ofstream file{temporary_path, std::ios::out | std::ios::binary | std::ios::trunc};
+        uint64_t count = cache.files.size();
+        file.write(CDC_CACHE_MAGIC, 8);
+        file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (const auto &[path, entry]: cache.files) {
+            auto path_size = static_cast<uint32_t>(path.size());
+            file.write(reinterpret_cast<const char *>(&path_size), sizeof(path_size));
+            file.write(path.data(), path_size);
+            const uint64_t fields[5]{entry.size, static_cast<uint64_t>(entry.mtime_ns), entry.inode, entry.lines,
+                                     entry.chunk_keys.size()};
+            file.write(reinterpret_cast<const char *>(fields), sizeof(fields));
+            file.write(reinterpret_cast<const char *>(entry.chunk_keys.data()),
+                       static_cast<std::streamsize>(entry.chunk_keys.size() * sizeof(uint64_t)));
+        }
+        count = cache.chunks.size();
+        file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (const auto &[key, newlines]: cache.chunks) {
+            const uint64_t chunk[2]{key, newlines};
+            file.write(reinterpret_cast<const char *>(chunk), sizeof(chunk));
+        }
+        if (!file) {
+            throw std::runtime_error("Cannot write " + temporary_path.string());
+        }
+    }
+    std::filesystem::rename(temporary_path, file_path);
+}
+
+int run_chunk_cache_mode(const std::vector<std::filesystem::directory_entry> &files,
+                         const std::vector<std::string> &options) {
+    /**
+     * Count lines using and updating the chunk cache -cdc-cache=FILE (.axxonsoft_cdc_cache in the
+     * working directory by default).
+     *
+     * @param files vector of files to count
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::string cache_option = option_value(options, "cdc-cache");
+    std::filesystem::path cache_path = cache_option.empty() ? ".axxonsoft_cdc_cache" : cache_option;
+
+    try {
+        const ChunkCache cache = load_chunk_cache(cache_path);
+
+        struct WorkerResult {
+            ChunkCache cache;
+            uint64_t lines = 0;
+            uint64_t unchanged_files = 0;
+            uint64_t chunks = 0;
+            uint64_t counted_chunks = 0;
+        };
+        std::atomic<size_t> next_file{0};
+        auto scan = [&]() {
+            WorkerResult result;
+            for (size_t file = next_file++; file < files.size(); file = next_file++) {
+                const std::string path = std::filesystem::absolute(files[file].path()).string();
+                struct stat file_stat{};
+                if (::stat(path.c_str(), &file_stat) != 0) {
+                    throw std::runtime_error("Cannot stat " + path);
+                }
+                ChunkCache::FileEntry entry{static_cast<uint64_t>(file_stat.st_size),
+                                            file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec,
+                                            static_cast<uint64_t>(file_stat.st_ino), 0, {}};
+
+                auto cached = cache.files.find(path);
+                if (cached != cache.files.end() && cached->second.size == entry.size &&
+                    cached->second.mtime_ns == entry.mtime_ns && cached->second.inode == entry.inode) {
+                    const size_t keys = cached->second.chunk_keys.size();
+                    result.cache.reservation.resize(result.cache.reservation.bytes +
+                                                    ChunkCache::file_bytes(path.size(), keys) +
+                                                    keys * CDC_CACHE_ENTRY_BYTES);
+                    result.lines += cached->second.lines;
+                    ++result.unchanged_files;
+                    for (uint64_t key: cached->second.chunk_keys) {
+                        result.cache.chunks.emplace(key, cache.chunks.at(key));
+                    }
+                    result.cache.files.emplace(path, cached->second);
+                    continue; // metadata unchanged, chunk hashes are not needed either
+                }
+
+                MappedFile map{files[file].path()};
+                // reserve for the most chunks the file can have, then keep what was used
+                const size_t reserved = result.cache.reservation.bytes;
+                const size_t most_chunks = map.size / CDC_MIN_CHUNK + 1;
+                result.cache.reservation.resize(reserved + ChunkCache::file_bytes(path.size(), most_chunks) +
+                                                most_chunks * CDC_CACHE_ENTRY_BYTES);
+                entry.chunk_keys.reserve(most_chunks);
+                for (size_t offset = 0; offset < map.size;) {
+                    size_t chunk_size = fastcdc_cut(map.data + offset, map.size - offset);
+                    uint64_t key = hash_bytes(map.data + offset, chunk_size, chunk_size);
+                    auto chunk = cache.chunks.find(key);
+                    uint64_t newlines;
+                    if (chunk != cache.chunks.end()) {
+                        newlines = chunk->second;
+                    } else {
+                        newlines = count_newlines(map.data + offset, chunk_size);
+                        ++result.counted_chunks;
+                    }
+                    result.cache.chunks.emplace(key, newlines);
+                    entry.chunk_keys.push_back(key);
+                    entry.lines += newlines;
+                    ++result.chunks;
+                    offset += chunk_size;
+                }
+                if (map.size > 0 && map.data[map.size - 1] != '\n') {
+                    ++entry.lines; // last line without a terminator, as counted by getline
+                }
+                entry.chunk_keys.shrink_to_fit();
+                const size_t chunks = entry.chunk_keys.size();
+                result.cache.reservation.resize(reserved + ChunkCache::file_bytes(path.size(), chunks) +
+                                                chunks * CDC_CACHE_ENTRY_BYTES);
+                result.lines += entry.lines;
+                result.cache.files.emplace(path, std::move(entry));
+            }
+            return result;
+        };
+
+        std::vector<std::future<WorkerResult>> futures;
+        for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+            futures.push_back(std::async(std::launch::async, scan));
+        }
+        WorkerResult total;
+        for (auto &future: futures) {
+            WorkerResult result = future.get();
+            total.lines += result.lines;
+            total.unchanged_files += result.unchanged_files;
+            total.chunks += result.chunks;
+            total.counted_chunks += result.counted_chunks;
+            total.cache.files.merge(result.cache.files);
+            total.cache.chunks.merge(result.cache.chunks);
+            total.cache.reservation.merge(std::move(result.cache.reservation)); // the merged nodes moved too
+        }
+        save_chunk_cache(total.cache, cache_path);
+
+        std::cout << "Total lines: " << total.lines << "\n"
+                  << "Unchanged files: " << total.unchanged_files << "\n"
+                  << "Chunks: " << total.chunks << ", counted: " << total.counted_chunks << "\n";
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Token frequencies.
+ *
+ * Tokens are maximal runs of bytes that are neither whitespace nor one of the delimiters
+ * ;,"'()[]{}<>=. Separator masks are built 16 bytes at a time with SSE2 (bytes <= ' ' with an
+ * unsigned max trick, delimiters with equality tests), token starts and ends are the bit
+ * transitions of the mask, carried over from block to block. Tokens are hashed in place in the
+ * mapped file; a token's text is copied only the first time it is seen by a worker. Every worker
+ * counts into its own open-addressing table, tables are merged once all files are scanned. Table
+ * and text growth is reserved from the memory governor first.
+ */
+
+template<typename TokenFunction>
+static void for_each_token(const char *data, size_t size, TokenFunction &&token_function) {
+    /**
+     * Call token_function(token, size) for every token of the memory range.
+     */
+    auto is_separator = [](unsigned char c) {
+        return c <= ' ' || c == ';' || c == ',' || c == '"' || c == '\'' || c == '(' || c == ')' || c == '[' ||
+               c == ']' || c == '{' || c == '}' || c == '<' || c == '>' || c == '=';
+    };
+
+    size_t token_start = SIZE_MAX; // SIZE_MAX outside of a token
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    const char delimiters[] = ";,\"'()[]{}<>=";
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i separators = _mm_cmpeq_epi8(_mm_max_epu8(chunk, space), space); // unsigned chunk <= ' '
+        for (size_t d = 0; d + 1 < sizeof(delimiters); ++d) {
+            separators = _mm_or_si128(separators, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(delimiters[d])));
+        }
+        auto in_token = static_cast<uint32_t>(~_mm_movemask_epi8(separators)) & 0xFFFFu;
+        uint32_t carry = token_start != SIZE_MAX ? 1u : 0u;
+        uint32_t previous = (in_token << 1) | carry; // bit k: byte k - 1 is in a token
+        uint32_t starts = in_token & ~previous;
+        uint32_t ends = ~in_token & previous & 0xFFFFu;
+        // starts and ends alternate, so merging both sets in bit order visits them in file order
+        for (uint32_t events = starts | ends; events != 0; events &= events - 1) {
+            uint32_t bit = __builtin_ctz(events);
+            if (starts & (1u << bit)) {
+                token_start = i + bit;
+            } else {
+                token_function(data + token_start, i + bit - token_start);
+                token_start = SIZE_MAX;
+            }
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        bool separator = is_separator(static_cast<unsigned char>(data[i]));
+        if (!separator && token_start == SIZE_MAX) {
+            token_start = i;
+        } else if (separator && token_start != SIZE_MAX) {
+            token_function(data + token_start, i - token_start);
+            token_start = SIZE_MAX;
+        }
+    }
+    if (token_start != SIZE_MAX) {
+        token_function(data + token_start, size - token_start);
+    }
+}
+
+TokenCounts::TokenCounts(): reservation{TOKEN_TABLE_INITIAL_SLOTS * sizeof(Slot)}, slots(TOKEN_TABLE_INITIAL_SLOTS) {}
+
+void TokenCounts::add(uint64_t hash, const char *token, size_t size, uint64_t count) {
+    /**
+     * Count a token `count` times. Tokens with equal hashes are compared byte by byte, so a hash
+     * collision can not merge the counts of two different tokens.
+     */
+    if ((used + 1) * 2 > slots.size()) {
+        grow();
+    }
+    const size_t mask = slots.size() - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        Slot &candidate = slots[slot];
+        if (candidate.count == 0) {
+            if (text.size() + size > text.capacity()) {
+                size_t capacity = std::max(text.capacity() * 2, text.size() + size);
+                reservation.resize(slots.size() * sizeof(Slot) + capacity);
+                text.reserve(capacity);
+            }
+            candidate = {hash, text.size(), static_cast<uint32_t>(size), count};
+            text.append(token, size);
+            ++used;
+            return;
+        }
+        if (candidate.hash == hash && candidate.size == size &&
+            std::memcmp(text.data() + candidate.offset, token, size) == 0) {
+            candidate.count += count;
+            return;
+        }
+    }
+}
+
+void TokenCounts::grow() {
+    // old and new slots exist together while rehashing
+    reservation.resize(slots.size() * 3 * sizeof(Slot) + text.capacity());
+    std::vector<Slot> old = std::move(slots);
+    slots.assign(old.size() * 2, Slot{});
+    const size_t mask = slots.size() - 1;
+    for (const auto &slot: old) {
+        if (slot.count != 0) {
+            size_t position = slot.hash & mask;
+            while (slots[position].count != 0) {
+                position = (position + 1) & mask;
+            }
+            slots[position] = slot;
+        }
+    }
+    old = std::vector<Slot>{};
+    reservation.resize(slots.size() * sizeof(Slot) + text.capacity());
+}
+
+void TokenCounts::merge(const TokenCounts &other) {
+    for (const auto &slot: other.slots) {
+        if (slot.count != 0) {
+            add(slot.hash, other.text.data() + slot.offset, slot.size, slot.count);
+        }
+    }
+}
+
+std::vector<std::pair<uint64_t, std::string_view>> TokenCounts::sorted(size_t n) const {
+    /**
+     * @return the n most frequent tokens, most frequent first
+     */
+    std::vector<std::pair<uint64_t, std::string_view>> tokens;
+    tokens.reserve(used);
+    for (const auto &slot: slots) {
+        if (slot.count != 0) {
+            tokens.emplace_back(slot.count, std::string_view{text.data() + slot.offset, slot.size});
+        }
+    }
+    size_t keep = std::min(n, tokens.size());
+    std::partial_sort(tokens.begin(), tokens.begin() + keep, tokens.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    tokens.resize(keep);
+    return tokens;
+}
+
+int run_token_frequency_mode(const std::vector<std::filesystem::directory_entry> &files,
+                             const std::vector<std::string> &options) {
+    /**
+     * Print the -top=N (default 10) most frequent tokens. With -tokens-prefix=P only lines starting
+     * with P are tokenized (the prefix itself is not counted), -tokens-out=FILE receives all tokens
+     * with their counts.
+     *
+     * @param files vector of files to scan
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    size_t top_n = 10;
+    std::string top_option = option_value(options, "top");
+    if (!top_option.empty() &&
+        (std::from_chars(top_option.data(), top_option.data() + top_option.size(), top_n).ec != std::errc() ||
+         top_n == 0)) {
+        std::cout << "Invalid number of tokens " << top_option << "\n";
+        return 1;
+    }
+    const std::string prefix = option_value(options, "tokens-prefix");
+    const std::string output_path = option_value(options, "tokens-out");
+
+    try {
+        std::atomic<size_t> next_file{0};
+        auto scan = [&]() {
+            TokenCounts counts;
+            auto count_token = [&counts](const char *token, size_t size) {
+                counts.add(hash_bytes(token, size, 0), token, size, 1);
+            };
+            for (size_t file = next_file++; file < files.size(); file = next_file++) {
+                MappedFile map{files[file].path()};
+                if (prefix.empty()) {
+                    for_each_token(map.data, map.size, count_token);
+                    continue;
+                }
+                for_each_line(map.data, map.size, [&](const char *line, size_t size) {
+                    if (size >= prefix.size() && std::memcmp(line, prefix.data(), prefix.size()) == 0) {
+                        for_each_token(line + prefix.size(), size - prefix.size(), count_token);
+                    }
+                });
+            }
+            return counts;
+        };
+
+        std::vector<std::future<TokenCounts>> futures;
+        for (size_t worker = 0; worker < governed_workers(TOKEN_TABLE_INITIAL_SLOTS * sizeof(TokenCounts::Slot));
+             ++worker) {
+            futures.push_back(std::async(std::launch::async, scan));
+        }
+        TokenCounts counts = futures[0].get();
+        for (size_t worker = 1; worker < futures.size(); ++worker) {
+            counts.merge(futures[worker].get());
+        }
+        MemoryReservation sorted_reservation{counts.used * sizeof(std::pair<uint64_t, std::string_view>)};
+
+        uint64_t tokens = 0;
+        for (const auto &slot: counts.slots) {
+            tokens += slot.count;
+        }
+        std::cout << "Tokens: " << tokens << "\n"
+                  << "Distinct tokens: " << counts.used << "\n";
+        for (const auto &[count, token]: counts.sorted(top_n)) {
+            std::cout << count << "\t" << token << "\n";
+        }
+
+        if (!output_path.empty()) {
+            std::ofstream output{output_path, std::ios::out | std::ios::binary | std::ios::trunc};
+            if (!output) {
+                throw std::runtime_error("Cannot open " + output_path);
+            }
+            for (const auto &[count, token]: counts.sorted(counts.used)) {
+                output << count << "\t" << token << "\n";
+            }
+            if (!output) {
+                throw std::runtime_error("Cannot write " + output_path);
+            }
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * RFC 4180 CSV record counting.
+ *
+ * Quoted fields may contain delimiters and newlines, so only newlines outside quotes end records.
+ * The input is processed in 64-byte blocks: SSE2 comparisons give 64-bit masks of quotes,
+ * delimiters and newlines, and the "inside quotes" mask is the prefix XOR of the quote mask (an
+ * escaped "" toggles twice and cancels out), computed with one carry-less multiplication by an
+ * all-ones operand (PCLMULQDQ, as in simdcsv) when the CPU has it and with a shift-XOR ladder
+ * otherwise. The state at the end of a block is carried into the next one.
+ *
+ * Chunks are parsed in parallel assuming they start outside quotes, counting their quotes at the
+ * same time. Once all chunks are done, the quote parity of the preceding chunks tells the real
+ * starting state of each chunk and the rare chunk that actually starts inside a quoted field is
+ * parsed again. Records straddling chunk boundaries are stitched from the partial field counts at
+ * the head and tail of each chunk. Empty records (blank lines) are skipped.
+ */
+
+static uint64_t prefix_xor_shift(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("pclmul"))) static uint64_t prefix_xor_clmul(uint64_t bits) {
+    __m128i product = _mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<long long>(bits)), _mm_set1_epi8(-1), 0);
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(product));
+}
+#endif
+
+static uint64_t (*select_prefix_xor())(uint64_t) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("pclmul")) {
+        return prefix_xor_clmul;
+    }
+#endif
+    return prefix_xor_shift;
+}
+
+static uint64_t byte_mask64(const char *block, char byte) {
+    /**
+     * @return bit i set if block[i] == byte, for the 64 bytes of the block
+     */
+#if defined(__SSE2__)
+    const __m128i pattern = _mm_set1_epi8(byte);
+    uint64_t mask = 0;
+    for (int part = 0; part < 4; ++part) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * part));
+        mask |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern))))
+                << (16 * part);
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; ++i) {
+        mask |= static_cast<uint64_t>(block[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+static CsvChunk scan_csv_chunk(const char *data, size_t size, bool inside_quotes, char delimiter,
+                               uint64_t expected_fields) {
+    /**
+     * Parse a chunk starting in the given quote state.
+     *
+     * @param data first byte of the chunk
+     * @param size chunk size
+     * @param inside_quotes the chunk starts inside a quoted field
+     * @param delimiter field delimiter
+     * @param expected_fields number of fields every record must have
+     * @return partial records at both ends and statistics of the records in between
+     */
+    static uint64_t (*const prefix_xor)(uint64_t) = select_prefix_xor();
+
+    CsvChunk chunk;
+    uint64_t carry = inside_quotes ? ~uint64_t{0} : 0; // all ones while inside quotes
+    uint64_t separators = 0; // delimiters of the open record
+    size_t record_start = 0;
+    char padded[64];
+    for (size_t offset = 0; offset < size; offset += 64) {
+        const char *block = data + offset;
+        if (size - offset < 64) {
+            std::memset(padded, 0, sizeof(padded)); // zero bytes are neither quotes nor delimiters
+            std::memcpy(padded, block, size - offset);
+            block = padded;
+        }
+
+        uint64_t quotes = byte_mask64(block, '"');
+        chunk.quotes += __builtin_popcountll(quotes);
+        uint64_t inside = prefix_xor(quotes) ^ carry;
+        carry = static_cast<uint64_t>(static_cast<int64_t>(inside) >> 63);
+
+        uint64_t newlines = byte_mask64(block, '\n') & ~inside;
+        uint64_t events = (byte_mask64(block, delimiter) & ~inside) | newlines;
+        for (; events != 0; events &= events - 1) {
+            int bit = __builtin_ctzll(events);
+            if ((newlines >> bit & 1) == 0) {
+                ++separators;
+                continue;
+            }
+
+            size_t record_end = offset + bit;
+            size_t bytes = record_end - record_start - (record_end > record_start && data[record_end - 1] == '\r');
+            if (!chunk.closed_head) {
+                chunk.closed_head = true;
+                chunk.head_separators = separators;
+                chunk.head_bytes = bytes;
+            } else if (bytes > 0) {
+                if (separators + 1 != expected_fields && chunk.bad_records++ == 0) {
+                    chunk.first_bad_record = chunk.records;
+                }
+                ++chunk.records;
+            }
+            separators = 0;
+            record_start = record_end + 1;
+        }
+    }
+
+    if (!chunk.closed_head) {
+        chunk.head_separators = separators;
+        chunk.head_bytes = size;
+    } else {
+        chunk.tail_separators = separators;
+        chunk.tail_bytes = size - record_start;
+    }
+    return chunk;
+}
+
+static uint64_t csv_expected_fields(const char *data, size_t size, char delimiter) {
+    /**
+     * @return number of fields of the first record
+     */
+    bool inside_quotes = false;
+    uint64_t fields = 1;
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == '"') {
+            inside_quotes = !inside_quotes;
+        } else if (!inside_quotes && data[i] == delimiter) {
+            ++fields;
+        } else if (!inside_quotes && data[i] == '\n') {
+            break;
+        }
+    }
+    return size == 0 ? 0 : fields;
+}
+
+CsvCounts count_csv_records(const char *data, size_t size, char delimiter) {
+    /**
+     * Count records of a CSV file and validate their field counts against the first record.
+     *
+     * @param data mapped file
+     * @param size file size
+     * @param delimiter field delimiter
+     * @return record statistics
+     */
+    CsvCounts counts;
+    counts.fields = csv_expected_fields(data, size, delimiter);
+
+    std::vector<size_t> boundaries = split_into_chunks(
+            data, size, [](const char *, size_t, size_t offset) { return offset; });
+    std::vector<std::future<CsvChunk>> futures;
+    for (size_t chunk = 0; chunk + 1 < boundaries.size(); ++chunk) {
+        futures.push_back(std::async(std::launch::async, scan_csv_chunk, data + boundaries[chunk],
+                                     boundaries[chunk + 1] - boundaries[chunk], false, delimiter, counts.fields));
+    }
+
+    bool inside_quotes = false;
+    uint64_t open_separators = 0;
+    uint64_t open_bytes = 0;
+    auto close_record = [&](uint64_t separators, uint64_t bytes) {
+        if (bytes == 0) {
+            return;
+        }
+        if (separators + 1 != counts.fields && counts.bad_records++ == 0) {
+            counts.first_bad_record = counts.records + 1;
+        }
+        ++counts.records;
+    };
+    for (size_t chunk = 0; chunk < futures.size(); ++chunk) {
+        CsvChunk result = futures[chunk].get();
+        if (inside_quotes) {
+            // the speculation failed, the chunk starts inside a quoted field
+            result = scan_csv_chunk(data + boundaries[chunk], boundaries[chunk + 1] - boundaries[chunk], true,
+                                    delimiter, counts.fields);
+            ++counts.respeculated_chunks;
+        }
+        inside_quotes ^= result.quotes % 2 == 1;
+
+        if (!result.closed_head) {
+            open_separators += result.head_separators;
+            open_bytes += result.head_bytes;
+            continue;
+        }
+        close_record(open_separators + result.head_separators, open_bytes + result.head_bytes);
+        if (result.bad_records > 0 && counts.bad_records == 0) {
+            counts.first_bad_record = counts.records + result.first_bad_record + 1;
+        }
+        counts.records += result.records;
+        counts.bad_records += result.bad_records;
+        open_separators = result.tail_separators;
+        open_bytes = result.tail_bytes;
+    }
+    close_record(open_separators, open_bytes);
+    counts.unterminated_quote = inside_quotes;
+    return counts;
+}
+
+int run_csv_mode(const std::vector<std::filesystem::directory_entry> &files, const std::vector<std::string> &options) {
+    /**
+     * Count CSV records of every file, -csv-delimiter=C sets the delimiter (',' by default).
+     *
+     * @param files vector of files to count
+     * @param options parsed command line options
+     * @return process exit code, 1 if any file has malformed records
+     */
+    std::string delimiter_option = option_value(options, "csv-delimiter");
+    char delimiter = delimiter_option.empty() ? ',' : delimiter_option == "\\t" ? '\t' : delimiter_option[0];
+
+    bool valid = true;
+    uint64_t records = 0;
+    try {
+        for (const auto &file: files) {
+            MappedFile map{file.path()};
+            CsvCounts counts = count_csv_records(map.data, map.size, delimiter);
+            records += counts.records;
+            std::cout << file.path().string() << "\t" << counts.records << " records\t" << counts.fields << " fields";
+            if (counts.bad_records > 0) {
+                std::cout << "\t" << counts.bad_records << " with a different field count, first is record "
+                          << counts.first_bad_record;
+                valid = false;
+            }
+            if (counts.unterminated_quote) {
+                std::cout << "\tunterminated quoted field";
+                valid = false;
+            }
+            std::cout << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    std::cout << "Total records: " << records << "\n";
+    return valid ? 0 : 1;
+}
+
+/**
+ * Line ending normalization.
+ *
+ * Files are rewritten to LF (CRLF and bare CR become LF) or to CRLF (bare LF and bare CR become
+ * CRLF). A single scan finds the line ending bytes with SSE2 comparisons and copies the runs
+ * between them with memcpy/memmove, so most of the file moves at memory bandwidth. Nothing is
+ * written until the first ending that has to change, so files that are already normalized are
+ * detected in the same pass and never touched. Output goes to a temporary file next to the source
+ * that replaces it by rename. Conversion to LF never grows a file, with -normalize-in-place it is
+ * compacted inside a shared mapping and truncated instead.
+ */
+
+template<typename Begin, typename Emit>
+static bool convert_line_endings(const char *data, size_t size, bool to_crlf, Begin &&begin, Emit &&emit) {
+    /**
+     * Convert line endings, calling begin() before the first emitted byte.
+     *
+     * @param data source bytes
+     * @param size source size
+     * @param to_crlf convert to CRLF instead of LF
+     * @param begin called once when the first ending that has to change is found
+     * @param emit called with consecutive pieces of the converted output
+     * @return true if any line ending changed, false if emit was never called
+     */
+    bool changed = false;
+    size_t run_start = 0;
+    size_t skip_until = 0; // LF of a CRLF pair already handled
+    auto change = [&](size_t run_end, const char *insert, size_t insert_size, size_t next_start) {
+        if (!changed) {
+            begin();
+            changed = true;
+        }
+        emit(data + run_start, run_end - run_start);
+        emit(insert, insert_size);
+        run_start = next_start;
+    };
+    auto handle = [&](size_t position) {
+        if (position < skip_until) {
+            return;
+        }
+        if (data[position] == '\r') {
+            bool pair = position + 1 < size && data[position + 1] == '\n';
+            if (!to_crlf) {
+                change(position, "\n", pair ? 0 : 1, position + 1); // drop the CR of a pair, replace a bare CR
+            } else if (pair) {
+                skip_until = position + 2;
+            } else {
+                change(position + 1, "\n", 1, position + 1);
+            }
+        } else {
+            change(position, "\r\n", 2, position + 1); // bare LF, only reported when converting to CRLF
+        }
+    };
+
+    size_t offset = 0;
+#if defined(__SSE2__)
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    const __m128i line_feed = _mm_set1_epi8('\n');
+    for (; offset + 16 <= size; offset += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + offset));
+        __m128i hits = _mm_cmpeq_epi8(block, carriage_return);
+        if (to_crlf) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, line_feed));
+        }
+        for (auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits)); mask != 0; mask &= mask - 1) {
+            handle(offset + __builtin_ctz(mask));
+        }
+    }
+#endif
+    for (; offset < size; ++offset) {
+        if (data[offset] == '\r' || (to_crlf && data[offset] == '\n')) {
+            handle(offset);
+        }
+    }
+    if (changed) {
+        emit(data + run_start, size - run_start);
+    }
+    return changed;
+}
+
+static NormalizeResult normalize_in_place(const std::filesystem::path &file_path) {
+    /**
+     * Convert a file to LF inside a shared writable mapping, the file only shrinks.
+     */
+    NormalizeResult result;
+    int fd = ::open(file_path.c_str(), O_RDWR);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + file_path.string());
+    }
+    struct stat file_stat{};
+    if (::fstat(fd, &file_stat) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot stat " + file_path.string());
+    }
+    result.size_before = result.size_after = static_cast<uint64_t>(file_stat.st_size);
+    if (result.size_before == 0) {
+        ::close(fd);
+        return result;
+    }
+    void *address = ::mmap(nullptr, result.size_before, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Cannot map " + file_path.string());
+    }
+    ::madvise(address, result.size_before, MADV_SEQUENTIAL);
+
+    // the write position never passes the read position, so runs can be moved forward in place
+    char *data = static_cast<char *>(address);
+    size_t written = 0;
+    result.changed = convert_line_endings(
+            data, result.size_before, false, [] {},
+            [&](const char *piece, size_t piece_size) {
+                std::memmove(data + written, piece, piece_size);
+                written += piece_size;
+            });
+    ::munmap(address, result.size_before);
+    if (result.changed) {
+        result.size_after = written;
+        if (::ftruncate(fd, static_cast<off_t>(written)) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot truncate " + file_path.string());
+        }
+    }
+    ::close(fd);
+    return result;
+}
+
+NormalizeResult normalize_line_endings(const std::filesystem::path &file_path, bool to_crlf, bool in_place) {
+    /**
+     * Rewrite the line endings of a file if any of them differs from the target.
+     *
+     * @param file_path file to normalize
+     * @param to_crlf convert to CRLF instead of LF
+     * @param in_place convert to LF inside the file instead of through a temporary file, not with to_crlf
+     * @return whether the file changed and its size before and after
+     */
+    if (in_place) {
+        if (to_crlf) {
+            throw std::invalid_argument("In-place normalization supports only LF line endings");
+        }
+        return normalize_in_place(file_path);
+    }
+
+    MappedFile map{file_path};
+    NormalizeResult result;
+    result.size_before = result.size_after = map.size;
+
+    std::filesystem::path temporary_path = file_path;
+    temporary_path += ".normalize.tmp";
+    int fd = -1;
+    std::vector<char> buffer;
+    uint64_t written = 0;
+    auto flush = [&] {
+        for (size_t offset = 0; offset < buffer.size();) {
+            ssize_t count = ::write(fd, buffer.data() + offset, buffer.size() - offset);
+            if (count < 0) {
+                throw std::runtime_error("Cannot write " + temporary_path.string());
+            }
+            offset += static_cast<size_t>(count);
+        }
+        written += buffer.size();
+        buffer.clear();
+    };
+
+    try {
+        result.changed = convert_line_endings(
+                map.data, map.size, to_crlf,
+                [&] {
+                    struct stat file_stat{};
+                    if (::stat(file_path.c_str(), &file_stat) != 0) {
+                        throw std::runtime_error("Cannot stat " + file_path.string());
+                    }
+                    fd = ::open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, file_stat.st_mode & 07777);
+                    if (fd < 0) {
+                        throw std::runtime_error("Cannot create " + temporary_path.string());
+                    }
+                    buffer.reserve(NCOUNT_BUFFER_SIZE);
+                },
+                [&](const char *piece, size_t piece_size) {
+                    if (buffer.size() + piece_size > NCOUNT_BUFFER_SIZE) {
+                        flush();
+                    }
+                    if (piece_size >= NCOUNT_BUFFER_SIZE) {
+                        buffer.assign(piece, piece + piece_size); // large runs go out in one write
+                        flush();
+                    } else {
+                        buffer.insert(buffer.end(), piece, piece + piece_size);
+                    }
+                });
+        if (result.changed) {
+            flush();
+            if (::close(fd) != 0) {
+                fd = -1;
+                throw std::runtime_error("Cannot write " + temporary_path.string());
+            }
+            fd = -1;
+            std::filesystem::rename(temporary_path, file_path);
+            result.size_after = written;
+        }
+    } catch (...) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (result.changed || fd >= 0) {
+            std::filesystem::remove(temporary_path);
+        }
+        throw;
+    }
+    return result;
+}
+
+int run_normalize_mode(const std::vector<std::filesystem::directory_entry> &files,
+                       const std::vector<std::string> &options) {
+    /**
+     * Normalize line endings of every file, -normalize-to=crlf selects CRLF instead of LF and
+     * -normalize-in-place converts to LF without a temporary file.
+     *
+     * @param files vector of files to normalize
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::string target = option_value(options, "normalize-to");
+    if (!target.empty() && target != "lf" && target != "crlf") {
+        std::cout << "Unknown line ending " << target << ", expected lf or crlf\n";
+        return 1;
+    }
+    bool to_crlf = target == "crlf";
+    bool in_place = std::find(options.begin(), options.end(), "normalize-in-place") != options.end();
+    if (in_place && to_crlf) {
+        std::cout << "-normalize-in-place is not supported with -normalize-to=crlf, CRLF output grows the files\n";
+        return 1;
+    }
+
+    std::vector<NormalizeResult> results(files.size());
+    std::atomic<size_t> next_file{0};
+    auto normalize = [&] {
+        for (size_t file = next_file++; file < files.size(); file = next_file++) {
+            results[file] = normalize_line_endings(files[file].path(), to_crlf, in_place);
+        }
+    };
+
+    try {
+        std::vector<std::future<void>> futures;
+        for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+            futures.push_back(std::async(std::launch::async, normalize));
+        }
+        for (auto &future: futures) {
+            future.get();
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+
+    size_t changed = 0;
+    for (size_t file = 0; file < files.size(); ++file) {
+        if (results[file].changed) {
+            ++changed;
+            std::cout << files[file].path().string() << "\t" << results[file].size_before << " -> "
+                      << results[file].size_after << " bytes\n";
+        }
+    }
+    std::cout << "Normalized files: " << changed << ", unchanged: " << files.size() - changed << "\n";
+    return 0;
+}
+
+/**
+ * UTF-8 validation fused with line counting.
+ *
+ * The vector path is the lookup algorithm of simdutf/simdjson (Keiser and Lemire): for every
+ * byte, three 16-entry tables indexed by the high nibble of the previous byte, its low nibble and
+ * the high nibble of the current byte are combined with AND, and each bit of the result flags one
+ * kind of error (too short, too long, overlong, surrogate, too large, stray continuation). Two
+ * saturating subtractions check that third and fourth bytes are continuations. The tables need
+ * PSHUFB, so the vector path is compiled for SSSE3 and selected at run time. Pure ASCII blocks
+ * skip the tables. Newlines are counted from the same loaded registers.
+ *
+ * The vector path only says that a block is invalid. From the first invalid block on, the file is
+ * decoded by the scalar validator, which finds exact offsets and counts invalid sequences
+ * (maximal invalid subparts, as replaced by U+FFFD). Valid files never leave the vector loop.
+ */
+
+static size_t utf8_prefix_length(const unsigned char *data, size_t size, size_t offset, size_t &length) {
+    /**
+     * Match the sequence starting at offset against the well-formed byte ranges of Unicode 3.9.
+     *
+     * @param length set to the length announced by the lead byte, 0 for a byte that cannot lead
+     * @return number of bytes that form a well-formed prefix, equal to length for a valid sequence
+     */
+    unsigned char lead = data[offset];
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    if (lead < 0x80) {
+        length = 1;
+        return 1;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        low = lead == 0xE0 ? 0xA0 : 0x80;
+        high = lead == 0xED ? 0x9F : 0xBF;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        low = lead == 0xF0 ? 0x90 : 0x80;
+        high = lead == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        length = 0;
+        return 0;
+    }
+
+    size_t prefix = 1;
+    if (offset + 1 < size && data[offset + 1] >= low && data[offset + 1] <= high) {
+        prefix = 2;
+        while (prefix < length && offset + prefix < size && (data[offset + prefix] & 0xC0) == 0x80) {
+            ++prefix;
+        }
+    }
+    return prefix;
+}
+
+static void validate_utf8_scalar(const unsigned char *data, size_t size, size_t offset, Utf8Report &report) {
+    /**
+     * Validate and count newlines from offset to the end, offset must be a character boundary.
+     */
+    while (offset < size) {
+        size_t length;
+        size_t prefix = utf8_prefix_length(data, size, offset, length);
+        if (length > 0 && prefix == length) {
+            report.newlines += data[offset] == '\n';
+            offset += length;
+            continue;
+        }
+        if (report.invalid_sequences++ == 0) {
+            report.first_invalid_offset = offset;
+            report.first_invalid_line = report.newlines + 1;
+        }
+        offset += std::max<size_t>(prefix, 1); // skip the maximal invalid subpart
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) static size_t validate_utf8_ssse3(const unsigned char *data, size_t size,
+                                                                   uint64_t &newlines) {
+    /**
+     * Validate 16-byte blocks and count their newlines.
+     *
+     * @return end of the valid blocks, the start of the first block with an error or of the tail
+     */
+    constexpr uint8_t too_short = 1 << 0;
+    constexpr uint8_t too_long = 1 << 1;
+    constexpr uint8_t overlong_3 = 1 << 2;
+    constexpr uint8_t too_large = 1 << 3;
+    constexpr uint8_t surrogate = 1 << 4;
+    constexpr uint8_t overlong_2 = 1 << 5;
+    constexpr uint8_t too_large_1000 = 1 << 6;
+    constexpr uint8_t overlong_4 = 1 << 6;
+    constexpr uint8_t two_continuations = 1 << 7;
+    constexpr uint8_t carry = too_short | too_long | two_continuations;
+
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+            too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+            two_continuations, two_continuations, two_continuations, two_continuations,
+            too_short | overlong_2, too_short, too_short | overlong_3 | surrogate,
+            static_cast<char>(too_short | too_large | too_large_1000 | overlong_4));
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+            static_cast<char>(carry | overlong_3 | overlong_2 | overlong_4), static_cast<char>(carry | overlong_2),
+            static_cast<char>(carry), static_cast<char>(carry), static_cast<char>(carry | too_large),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000 | surrogate),
+            static_cast<char>(carry | too_large | too_large_1000),
+            static_cast<char>(carry | too_large | too_large_1000));
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+            too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+            static_cast<char>(too_long | overlong_2 | two_continuations | overlong_3 | too_large_1000 | overlong_4),
+            static_cast<char>(too_long | overlong_2 | two_continuations | overlong_3 | too_large),
+            static_cast<char>(too_long | overlong_2 | two_continuations | surrogate | too_large),
+            static_cast<char>(too_long | overlong_2 | two_continuations | surrogate | too_large),
+            too_short, too_short, too_short, too_short);
+    // the last three bytes of a block must not start sequences longer than what remains
+    const __m128i incomplete_limits = _mm_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    const __m128i line_feed = _mm_set1_epi8('\n');
+
+    __m128i previous = _mm_setzero_si128();
+    __m128i previous_incomplete = _mm_setzero_si128();
+    size_t offset = 0;
+    for (; offset + 16 <= size; offset += 16) {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + offset));
+        newlines += __builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(input, line_feed))));
+
+        __m128i error;
+        if (_mm_movemask_epi8(input) == 0) {
+            error = previous_incomplete; // ASCII block, only a sequence cut at its start can be wrong
+        } else {
+            __m128i previous_1 = _mm_alignr_epi8(input, previous, 15);
+            __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table,
+                                                   _mm_and_si128(_mm_srli_epi16(previous_1, 4), nibble_mask));
+            __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(previous_1, nibble_mask));
+            __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table,
+                                                   _mm_and_si128(_mm_srli_epi16(input, 4), nibble_mask));
+            __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+            __m128i previous_2 = _mm_alignr_epi8(input, previous, 14);
+            __m128i previous_3 = _mm_alignr_epi8(input, previous, 13);
+            __m128i third_byte = _mm_subs_epu8(previous_2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+            __m128i fourth_byte = _mm_subs_epu8(previous_3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+            __m128i must_continue = _mm_and_si128(_mm_or_si128(third_byte, fourth_byte),
+                                                  _mm_set1_epi8(static_cast<char>(0x80)));
+            error = _mm_xor_si128(must_continue, special_cases);
+            previous_incomplete = _mm_subs_epu8(input, incomplete_limits);
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+            newlines -= __builtin_popcount(
+                    static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(input, line_feed))));
+            return offset;
+        }
+        previous = input;
+    }
+    return offset; // the tail shorter than a block is left to the scalar validator
+}
+#endif
+
+Utf8Report validate_utf8(const char *data, size_t size) {
+    /**
+     * Validate UTF-8 and count lines in one pass.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     * @return lines, number of invalid sequences and the position of the first one
+     */
+    auto bytes = reinterpret_cast<const unsigned char *>(data);
+    Utf8Report report;
+    size_t offset = 0;
+#if defined(__x86_64__)
+    static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    if (has_ssse3) {
+        offset = validate_utf8_ssse3(bytes, size, report.newlines);
+    }
+#endif
+    // restart at the last character before the failed block or the tail, it may be cut by the block end
+    size_t start = offset;
+    if (start > 0) {
+        start = offset - 1;
+        while (start > 0 && offset - start < 4 && (bytes[start] & 0xC0) == 0x80) {
+            --start;
+        }
+    }
+    report.newlines -= std::count(bytes + start, bytes + offset, '\n');
+    validate_utf8_scalar(bytes, size, start, report);
+    report.lines = report.newlines + (size > 0 && data[size - 1] != '\n');
+    return report;
+}
+
+int run_utf8_mode(const std::vector<std::filesystem::directory_entry> &files) {
+    /**
+     * Count lines and validate UTF-8 of every file.
+     *
+     * @param files vector of files to check
+     * @return process exit code, 1 if any file is not valid UTF-8
+     */
+    std::vector<Utf8Report> reports(files.size());
+    std::atomic<size_t> next_file{0};
+    auto validate = [&] {
+        for (size_t file = next_file++; file < files.size(); file = next_file++) {
+            MappedFile map{files[file].path()};
+            reports[file] = validate_utf8(map.data, map.size);
+        }
+    };
+
+    try {
+        std::vector<std::future<void>> futures;
+        for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+            futures.push_back(std::async(std::launch::async, validate));
+        }
+        for (auto &future: futures) {
+            future.get();
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+
+    uint64_t lines = 0;
+    size_t invalid_files = 0;
+    for (size_t file = 0; file < files.size(); ++file) {
+        const Utf8Report &report = reports[file];
+        lines += report.lines;
+        if (report.invalid_sequences > 0) {
+            ++invalid_files;
+            std::cout << files[file].path().string() << "\tfirst invalid byte at offset "
+                      << report.first_invalid_offset << ", line " << report.first_invalid_line << ", "
+                      << report.invalid_sequences << " invalid sequences\n";
+        }
+    }
+    std::cout << "Total lines: " << lines << "\n"
+              << "Invalid UTF-8 files: " << invalid_files << "\n";
+    return invalid_files == 0 ? 0 : 1;
+}
+
+/**
+ * Zero-copy line iteration.
+ *
+ * LineRange walks a memory range with memchr and hands out views, it is what for_each_line does
+ * behind an iterator. LineReader does the same over read(2) into a pooled buffer. Only lines cut
+ * by the end of a read are copied, into the carry buffer, which is reused for the whole file.
+ * Both offer a batch variant that passes arrays of views, which keeps the per-line call out of
+ * tight loops. count_lines_view counts lines like count_lines_getline without building a
+ * std::string per line.
+ */
+
+LineRange::iterator::iterator(const char *cursor, const char *end) : cursor{cursor}, end{end} {
+    if (cursor != end) {
+        const auto *newline = static_cast<const char *>(std::memchr(cursor, '\n', end - cursor));
+        line_end = newline == nullptr ? end : newline;
+        line = LineReader::strip_carriage_return({cursor, static_cast<size_t>(line_end - cursor)});
+    }
+}
+
+LineRange::iterator &LineRange::iterator::operator++() {
+    *this = iterator{line_end == end ? end : line_end + 1, end};
+    return *this;
+}
+
+LineRange::iterator LineRange::iterator::operator++(int) {
+    iterator previous = *this;
+    ++*this;
+    return previous;
+}
+
+std::unique_ptr<char[]> BufferPool::acquire() {
+    /**
+     * Take a free buffer or allocate one if the memory governor allows it. Otherwise wait for a
+     * buffer of this pool to come back, pooled buffers stay reserved for the life of the process.
+     */
+    std::unique_lock<std::mutex> lock{mutex};
+    for (;;) {
+        if (!free_buffers.empty()) {
+            std::unique_ptr<char[]> buffer = std::move(free_buffers.back());
+            free_buffers.pop_back();
+            ++outstanding;
+            return buffer;
+        }
+        if (memory_governor().try_reserve(buffer_size)) {
+            break;
+        }
+        if (outstanding == 0) {
+            // no buffer of ours will come back, wait for the rest of the process instead
+            lock.unlock();
+            memory_governor().reserve(buffer_size);
+            lock.lock();
+            break;
+        }
+        memory_governor().record_stall();
+        buffer_returned.wait(lock);
+    }
+    ++outstanding;
+    return std::unique_ptr<char[]>{new char[buffer_size]};
+}
+
+void BufferPool::release(std::unique_ptr<char[]> buffer) {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        free_buffers.push_back(std::move(buffer));
+        --outstanding;
+    }
+    buffer_returned.notify_one();
+}
+
+BufferPool &line_buffer_pool() {
+    static BufferPool pool{NCOUNT_BUFFER_SIZE};
+    return pool;
+}
+
+LineReader::LineReader(const std::filesystem::path &file_path, BufferPool &pool) : pool{pool} {
+    fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + file_path.string());
+    }
+    buffer = pool.acquire();
+    cursor = filled_end = buffer.get();
+}
+
+LineReader::~LineReader() {
+    ::close(fd);
+    pool.release(std::move(buffer));
+}
+
+bool LineReader::fill() {
+    /**
+     * Read the next part of the file into the buffer.
+     *
+     * @return false at the end of the file
+     */
+    ssize_t count;
+    do {
+        count = ::read(fd, buffer.get(), pool.buffer_size);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        throw std::runtime_error("Cannot read file");
+    }
+    cursor = buffer.get();
+    filled_end = cursor + count;
+    return count > 0;
+}
+
+void LineReader::carry_tail() {
+    /**
+     * Move the unterminated rest of the buffer into the carry before the buffer is refilled.
+     */
+    if (cursor < filled_end) {
+        if (!carrying) {
+            carry.clear();
+            carrying = true;
+        }
+        carry.append(cursor, filled_end);
+        cursor = filled_end;
+    }
+}
+
+std::string_view LineReader::strip_carriage_return(std::string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    return line;
+}
+
+bool LineReader::next(std::string_view &line) {
+    /**
+     * Get the next line.
+     *
+     * @param line set to the line, valid until the next call
+     * @return false at the end of the file
+     */
+    for (;;) {
+        const auto *newline = static_cast<const char *>(std::memchr(cursor, '\n', filled_end - cursor));
+        if (newline != nullptr) {
+            if (carrying) {
+                carry.append(cursor, newline);
+                line = strip_carriage_return(carry);
+                carrying = false;
+            } else {
+                line = strip_carriage_return({cursor, static_cast<size_t>(newline - cursor)});
+            }
+            cursor = newline + 1;
+            return true;
+        }
+        carry_tail();
+        if (!fill()) {
+            if (carrying) {
+                carrying = false;
+                line = strip_carriage_return(carry);
+                return true;
+            }
+            return false;
+        }
+    }
+}
+
+LineReader::iterator LineReader::begin() {
+    iterator first{this, {}};
+    return ++first;
+}
+
+LineReader::iterator &LineReader::iterator::operator++() {
+    if (!reader->next(line)) {
+        reader = nullptr;
+    }
+    return *this;
+}
+
+uint64_t count_lines_view(const std::filesystem::path &file_path) {
+    /**
+     * Count lines using zero-copy line views, same result as count_lines_getline.
+     *
+     * @param file_path path to the file to count lines
+     * @return total lines count
+     */
+    LineReader reader{file_path};
+    uint64_t lines_count = 0;
+    reader.for_each_batch([&lines_count](const std::string_view *, size_t count) { lines_count += count; });
+    return lines_count;
+}
+
+uint64_t count_view_async(const std::vector<std::filesystem::directory_entry> &files, Verifier *verifier) {
+    /**
+     * Count lines using zero-copy line view method.
+     *
+     * @param files vector of files to count lines
+     * @param verifier receives the count of every file if not null
+     * @return total lines count
+     */
+    std::vector<std::future<uint64_t>> futures;
+    futures.reserve(files.size());
+    for (const auto &file: files) {
+        futures.push_back(std::async(std::launch::async, count_lines_view, file.path()));
+    }
+
+    uint64_t lines_count = 0;
+    for (size_t file = 0; file < futures.size(); ++file) {
+        uint64_t file_lines = futures[file].get();
+        lines_count += file_lines;
+        if (verifier != nullptr) {
+            verifier->submit(files[file].path(), "line view", file_lines);
+        }
+    }
+    return lines_count;
+}
+
+/**
+ * Parallel map over lines with ordered output.
+ *
+ * All files are mapped and cut into MAP_CHUNK_SIZE chunks aligned to line starts, numbered in
+ * input order. Workers take chunk numbers in order and run the mapper into the output buffer of a
+ * slot, chunk i uses slot i % window. The calling thread is the writer: it waits for the slot of
+ * the next chunk to write, writes it and frees the slot. A worker may only start chunk i once chunk
+ * i - window is written, so at most window chunk outputs exist at any time and a slow writer (a
+ * pipe, a disk) stalls the workers instead of buffering the whole output. The window is
+ * MAP_WINDOW_PER_WORKER slots per worker, enough to hide the spread of chunk processing times.
+ * Slot buffers keep their capacity, after the first round no output allocation is needed. Each
+ * chunk in flight also reserves its input size from the memory governor, in input order.
+ */
+
+ChunkMapper map_each_line(LineMapper line_mapper) {
+    /**
+     * Adapt a line mapper to a chunk mapper.
+     */
+    return [line_mapper = std::move(line_mapper)](const char *data, size_t size, std::string &output) {
+        for (std::string_view line: LineRange{data, size}) {
+            line_mapper(line, output);
+        }
+    };
+}
+
+uint64_t map_lines_ordered(const std::vector<std::filesystem::directory_entry> &files, const ChunkMapper &mapper,
+                           std::ostream &out) {
+    /**
+     * Run the mapper over all lines of the files in parallel and write its output in input order.
+     *
+     * @param files files to process, in output order
+     * @param mapper function applied to every chunk
+     * @param out stream receiving the output
+     * @return number of chunks processed
+     */
+    struct Chunk {
+        size_t file;
+        size_t begin;
+        size_t end;
+    };
+    struct Slot {
+        std::string output;
+        MemoryReservation reservation;
+        bool ready = false;
+    };
+
+    std::vector<MappedFile> maps;
+    std::vector<Chunk> chunks;
+    for (const auto &file: files) {
+        const MappedFile &map = maps.emplace_back(file.path());
+        for (size_t begin = 0; begin < map.size;) {
+            size_t end = next_line_start(map.data, map.size, begin + MAP_CHUNK_SIZE);
+            chunks.push_back({maps.size() - 1, begin, end});
+            begin = end;
+        }
+    }
+
+    const size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    const size_t window = workers * MAP_WINDOW_PER_WORKER;
+    std::vector<Slot> slots(window);
+    std::mutex reserve_order; // chunks reserve memory in input order, the next chunk to write always can
+    std::mutex mutex;
+    std::condition_variable slot_ready;
+    std::condition_variable slot_free;
+    size_t next_chunk = 0;
+    size_t written = 0;
+    std::exception_ptr failure;
+
+    auto work = [&] {
+        for (;;) {
+            size_t chunk;
+            std::unique_lock<std::mutex> order_lock{reserve_order};
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                chunk = next_chunk++;
+                slot_free.wait(lock, [&] { return chunk < written + window || failure; });
+                if (chunk >= chunks.size() || failure) {
+                    return;
+                }
+            }
+
+            // the slot belongs to this worker until the writer has seen it ready
+            Slot &slot = slots[chunk % window];
+            slot.reservation = MemoryReservation{chunks[chunk].end - chunks[chunk].begin};
+            order_lock.unlock();
+            slot.output.clear();
+            try {
+                const Chunk &range = chunks[chunk];
+                mapper(maps[range.file].data + range.begin, range.end - range.begin, slot.output);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{mutex};
+                failure = std::current_exception();
+                slot_ready.notify_all();
+                slot_free.notify_all();
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock{mutex};
+            slot.ready = true;
+            slot_ready.notify_all();
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (size_t worker = 0; worker < workers; ++worker) {
+        futures.push_back(std::async(std::launch::async, work));
+    }
+
+    auto stop = [&] {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (!failure) {
+                failure = std::make_exception_ptr(std::runtime_error("Cannot write the output"));
+            }
+            slot_free.notify_all();
+        }
+        for (auto &future: futures) {
+            future.wait();
+        }
+    };
+
+    for (size_t chunk = 0; chunk < chunks.size(); ++chunk) {
+        Slot &slot = slots[chunk % window];
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            slot_ready.wait(lock, [&] { return slot.ready || failure; });
+            if (failure) {
+                break;
+            }
+        }
+        out.write(slot.output.data(), static_cast<std::streamsize>(slot.output.size()));
+        if (!out) {
+            stop();
+            break;
+        }
+
+        slot.reservation = MemoryReservation{};
+        std::lock_guard<std::mutex> lock{mutex};
+        slot.ready = false;
+        ++written;
+        slot_free.notify_all();
+    }
+    for (auto &future: futures) {
+        future.wait();
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    out.flush();
+    return chunks.size();
+}
+
+int run_map_mode(const std::vector<std::filesystem::directory_entry> &files, const std::vector<std::string> &options) {
+    /**
+     * Filter lines and extract fields across the directory, output keeps the input order.
+     * -map-grep=TEXT keeps lines containing TEXT, -map-field=N keeps the N-th whitespace separated
+     * field (1-based) and -map-out=FILE writes to a file instead of the standard output.
+     *
+     * @param files vector of files to process
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::string pattern = option_value(options, "map-grep");
+    std::string field_option = option_value(options, "map-field");
+    std::string output_path = option_value(options, "map-out");
+
+    size_t field = 0;
+    if (!field_option.empty()) {
+        auto [end, error] = std::from_chars(field_option.data(), field_option.data() + field_option.size(), field);
+        if (error != std::errc{} || end != field_option.data() + field_option.size() || field == 0) {
+            std::cout << "Invalid field number " << field_option << "\n";
+            return 1;
+        }
+    }
+
+    ChunkMapper mapper = map_each_line([&pattern, field](std::string_view line, std::string &output) {
+        if (!pattern.empty() && line.find(pattern) == std::string_view::npos) {
+            return;
+        }
+        if (field == 0) {
+            output.append(line).push_back('\n');
+            return;
+        }
+        size_t index = 0;
+        for (size_t i = 0; i < line.size();) {
+            while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
+                ++i;
+            }
+            size_t start = i;
+            while (i < line.size() && line[i] != ' ' && line[i] != '\t') {
+                ++i;
+            }
+            if (i > start && ++index == field) {
+                output.append(line.substr(start, i - start)).push_back('\n');
+                return;
+            }
+        }
+    });
+
+    try {
+        if (output_path.empty()) {
+            map_lines_ordered(files, mapper, std::cout);
+        } else {
+            std::ofstream out{output_path, std::ios::out | std::ios::binary | std::ios::trunc};
+            if (!out) {
+                throw std::runtime_error("Cannot write " + output_path);
+            }
+            uint64_t chunks = map_lines_ordered(files, mapper, out);
+            std::cout << "Chunks: " << chunks << "\n";
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Plugins.
+ *
+ * A plugin supplies the per-buffer kernel, the host keeps the reading and the threads: the usual
+ * worker pool pulls files, reads them with read(2) into buffers from line_buffer_pool() and hands
+ * the buffers to the plugin as they are, without copying. Buffers are cut after their last
+ * newline, the partial line is moved to the front of the buffer before the next read, so plugins
+ * see whole lines. Each worker owns one plugin state, states are merged after the workers finish.
+ */
+
+Plugin::Plugin(const std::filesystem::path &file_path) {
+    handle = ::dlopen(file_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        throw std::runtime_error(std::string{"Cannot load plugin: "} + ::dlerror());
+    }
+
+    auto symbol = [this, &file_path](const char *name) {
+        void *address = ::dlsym(handle, name);
+        if (address == nullptr) {
+            ::dlclose(handle);
+            throw std::runtime_error("Plugin " + file_path.string() + " does not export " + name);
+        }
+        return address;
+    };
+    auto abi_version = reinterpret_cast<axxonsoft_plugin_abi_version_function>(
+            symbol("axxonsoft_plugin_abi_version"));
+    init = reinterpret_cast<axxonsoft_plugin_init_function>(symbol("axxonsoft_plugin_init"));
+    process = reinterpret_cast<axxonsoft_plugin_process_function>(symbol("axxonsoft_plugin_process"));
+    merge = reinterpret_cast<axxonsoft_plugin_merge_function>(symbol("axxonsoft_plugin_merge"));
+    finalize = reinterpret_cast<axxonsoft_plugin_finalize_function>(symbol("axxonsoft_plugin_finalize"));
+    if (abi_version() != AXXONSOFT_PLUGIN_ABI_VERSION) {
+        ::dlclose(handle);
+        throw std::runtime_error("Plugin " + file_path.string() + " was built for ABI version " +
+                                 std::to_string(abi_version()) + ", expected " +
+                                 std::to_string(AXXONSOFT_PLUGIN_ABI_VERSION));
+    }
+}
+
+Plugin::~Plugin() {
+    ::dlclose(handle);
+}
+
+static void plugin_process_file(const Plugin &plugin, void *state, const std::filesystem::path &file_path,
+                                uint64_t file_index, char *buffer, size_t buffer_size) {
+    /**
+     * Feed one file to the plugin in line-aligned buffers.
+     */
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + file_path.string());
+    }
+    std::string path = file_path.string();
+    axxonsoft_buffer view{buffer, 0, path.c_str(), file_index, 0, 0};
+    size_t filled = 0; // bytes in the buffer, a partial line carried over from the previous read first
+    for (;;) {
+        ssize_t count = ::read(fd, buffer + filled, buffer_size - filled);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot read " + path);
+        }
+        filled += static_cast<size_t>(count);
+        view.last = count == 0;
+
+        size_t size = filled;
+        if (!view.last && filled == buffer_size) {
+            const auto *newline = static_cast<const char *>(::memrchr(buffer, '\n', filled));
+            size = newline == nullptr ? filled : static_cast<size_t>(newline - buffer) + 1; // a long line is cut
+        } else if (!view.last) {
+            continue; // short read, fill the buffer first
+        }
+
+        if (size > 0 || view.last) { // the last buffer may be empty, it still ends the file
+            view.size = size;
+            if (plugin.process(state, &view) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Plugin failed on " + path);
+            }
+        }
+        if (view.last) {
+            break;
+        }
+        std::memmove(buffer, buffer + size, filled - size);
+        filled -= size;
+        view.offset += size;
+    }
+    ::close(fd);
+}
+
+void run_plugin(const Plugin &plugin, const std::vector<std::filesystem::directory_entry> &files,
+                const std::string &arguments, std::ostream &out) {
+    /**
+     * Run a plugin over the files on the worker pool and write its report.
+     *
+     * @param plugin loaded plugin
+     * @param files files to process
+     * @param arguments passed to the init function of every worker
+     * @param out stream receiving the report
+     */
+    BufferPool &pool = line_buffer_pool();
+    std::atomic<size_t> next_file{0};
+    auto work = [&]() -> void * {
+        void *state = plugin.init(arguments.c_str());
+        if (state == nullptr) {
+            throw std::runtime_error("Plugin initialization failed");
+        }
+        std::unique_ptr<char[]> buffer = pool.acquire();
+        try {
+            for (size_t file = next_file++; file < files.size(); file = next_file++) {
+                plugin_process_file(plugin, state, files[file].path(), file, buffer.get(), pool.buffer_size);
+            }
+        } catch (...) {
+            pool.release(std::move(buffer));
+            plugin.finalize(state, [](void *, const char *, size_t) {}, nullptr);
+            throw;
+        }
+        pool.release(std::move(buffer));
+        return state;
+    };
+
+    std::vector<std::future<void *>> futures;
+    for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+        futures.push_back(std::async(std::launch::async, work));
+    }
+
+    // collect every state before reporting a failure, so none of them leaks
+    std::vector<void *> states;
+    std::exception_ptr failure;
+    for (auto &future: futures) {
+        try {
+            states.push_back(future.get());
+        } catch (...) {
+            failure = std::current_exception();
+        }
+    }
+    for (size_t state = 1; state < states.size(); ++state) {
+        if (plugin.merge(states[0], states[state]) != 0 && !failure) {
+            failure = std::make_exception_ptr(std::runtime_error("Plugin merge failed"));
+        }
+    }
+    if (states.empty()) {
+        std::rethrow_exception(failure);
+    }
+
+    std::string report;
+    auto emit = [](void *context, const char *text, size_t size) {
+        static_cast<std::string *>(context)->append(text, size);
+    };
+    if (plugin.finalize(states[0], emit, &report) != 0 && !failure) {
+        failure = std::make_exception_ptr(std::runtime_error("Plugin finalization failed"));
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    out << report;
+}
+
+int run_plugin_mode(const std::vector<std::filesystem::directory_entry> &files,
+                    const std::vector<std::string> &options) {
+    /**
+     * Run the plugin given by -plugin=PATH with the arguments given by -plugin-args=TEXT.
+     *
+     * @param files vector of files to process
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    try {
+        Plugin plugin{option_value(options, "plugin")};
+        run_plugin(plugin, files, option_value(options, "plugin-args"), std::cout);
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * C API (axxonsoft.h).
+ *
+ * A context is a ThreadPool. A request is split into one task per pool thread, the tasks pull
+ * files through a shared atomic index like the other workers here and the last task to finish
+ * runs the completion callback. The synchronous functions queue an asynchronous request and wait
+ * for it. Files are mapped and counted with the vectorized newline kernel, paths are read in
+ * place and counts are stored straight into the caller's array. Exceptions never cross the C
+ * boundary, they become status codes. Directory jobs (axxonsoft_submit_job) go through the
+ * context's JobScheduler, on the same pool.
+ */
+
+ThreadPool::ThreadPool(size_t threads) {
+    /**
+     * Start the threads. If one can not be started, those already running are joined before the
+     * error propagates, a joinable std::thread must not be destroyed.
+     */
+    try {
+        this->threads.reserve(threads);
+        for (size_t thread = 0; thread < threads; ++thread) {
+            this->threads.emplace_back([this] {
+                for (;;) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock{mutex};
+                        task_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+                        if (tasks.empty()) {
+                            return;
+                        }
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            });
+        }
+    } catch (...) {
+        stop();
+        throw;
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+void ThreadPool::stop() {
+    /**
+     * Run the pending tasks and join the threads.
+     */
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        stopping = true;
+    }
+    task_available.notify_all();
+    for (auto &thread: threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        tasks.push_back(std::move(task));
+    }
+    task_available.notify_one();
+}
+
+uint64_t count_lines_mapped(const std::filesystem::path &file_path) {
+    /**
+     * Count lines of a mapped file, same result as count_lines_getline.
+     *
+     * @param file_path path to the file to count lines
+     * @return total lines count
+     */
+    MappedFile map{file_path};
+    uint64_t lines_count = count_newlines(map.data, map.size);
+    if (map.size > 0 && map.data[map.size - 1] != '\n') {
+        ++lines_count; // last line without a terminator
+    }
+    return lines_count;
+}
+
+/**
+ * Fair-share job scheduler.
+ *
+ * Count jobs of many clients share the context's ThreadPool. A job is a list of file ranges of at
+ * most SCHEDULER_TASK_SIZE bytes, so a worker is never held by one job for longer than a 16 MB
+ * read. The scheduler keeps up to one token per pool thread in the pool queue; a token runs one
+ * task, chosen when the token starts and not when it was queued, then puts itself at the back of
+ * the queue, so the other requests of the C API interleave with scheduled jobs. Every task is one
+ * sequential read plus the newline kernel, so a worker slot is also the I/O slot of that read and
+ * sharing workers shares the disks.
+ *
+ * Tasks are chosen by priority first: the client whose next job has the highest priority wins.
+ * Clients at the same priority are served by stride scheduling: each client has a pass that grows
+ * by the bytes of each task it gets divided by its weight and the client with the lowest pass is
+ * next, so over time clients get worker time in proportion to their weights. A client that was
+ * idle starts at the current virtual time instead of its old pass, it cannot bank credit. Within
+ * a client, jobs run in priority order, then in submission order. A small interactive job of
+ * another client therefore waits for at most one task per worker, whatever the size of the batch
+ * jobs in front of it.
+ *
+ * Admission control refuses a job when SCHEDULER_MAX_JOBS jobs are admitted and not done, or
+ * SCHEDULER_MAX_CLIENT_JOBS of the same client, instead of letting queues grow without bound.
+ */
+
+static uint64_t count_file_range(const std::filesystem::path &path, uint64_t offset, uint64_t size, bool file_end,
+                                 char *buffer, size_t buffer_size) {
+    /**
+     * Count newlines of a byte range of a file with positioned reads.
+     *
+     * @param path file to read
+     * @param offset first byte of the range
+     * @param size bytes in the range
+     * @param file_end the range ends the file, a last line without a terminator counts
+     * @param buffer read buffer
+     * @param buffer_size size of the buffer
+     * @return lines in the range
+     */
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+    ::posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_SEQUENTIAL);
+    uint64_t lines = 0;
+    char last_byte = '\n';
+    while (size > 0) {
+        ssize_t count = ::pread(fd, buffer, static_cast<size_t>(std::min<uint64_t>(size, buffer_size)),
+                                static_cast<off_t>(offset));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot read " + path.string()); // also if the file shrank
+        }
+        lines += count_newlines(buffer, static_cast<size_t>(count));
+        last_byte = buffer[count - 1];
+        offset += static_cast<uint64_t>(count);
+        size -= static_cast<uint64_t>(count);
+    }
+    ::close(fd);
+    if (file_end && last_byte != '\n') {
+        ++lines; // last line without a terminator
+    }
+    return lines;
+}
+
+JobScheduler::JobScheduler(ThreadPool &pool, size_t max_jobs, size_t max_client_jobs)
+    : pool{pool}, max_jobs{max_jobs}, max_client_jobs{max_client_jobs} {
+}
+
+std::shared_ptr<CountJob> JobScheduler::submit(const std::string &client, unsigned weight, int priority,
+                                               std::vector<std::filesystem::path> files) {
+    /**
+     * Queue a job counting the lines of the files.
+     *
+     * @param client name of the submitting client, the unit of fair sharing
+     * @param weight share of the client relative to other clients, 0 is taken as 1
+     * @param priority jobs with a higher priority are served first
+     * @param files files to count
+     * @return the job, null if admission control refused it
+     */
+    auto job = std::make_shared<CountJob>();
+    job->client = client;
+    job->priority = priority;
+    job->files = std::move(files);
+    job->file_sizes.resize(job->files.size());
+    job->failed.resize(job->files.size());
+    for (size_t file = 0; file < job->files.size(); ++file) {
+        std::error_code error;
+        uint64_t size = std::filesystem::file_size(job->files[file], error);
+        if (error) {
+            job->failed[file] = true;
+            continue;
+        }
+        job->file_sizes[file] = size;
+        for (uint64_t offset = 0; offset < size; offset += SCHEDULER_TASK_SIZE) {
+            job->ranges.push_back({file, offset, std::min<uint64_t>(SCHEDULER_TASK_SIZE, size - offset)});
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        Client &entry = clients[client];
+        if (admitted >= max_jobs || entry.admitted >= max_client_jobs) {
+            ++rejected;
+            return nullptr;
+        }
+        job->id = next_id++;
+        job->submitted = std::chrono::steady_clock::now();
+        entry.weight = std::max(1u, weight);
+        ++entry.admitted;
+        ++admitted;
+        if (job->ranges.empty()) {
+            job->state = CountJob::State::done;
+            job->started = job->finished = job->submitted;
+            --entry.admitted;
+            --admitted;
+            return job;
+        }
+        if (entry.jobs.empty()) {
+            entry.pass = std::max(entry.pass, virtual_time); // no credit for the idle time
+        }
+        auto position = std::find_if(entry.jobs.begin(), entry.jobs.end(), [&](const auto &queued) {
+            return queued->priority < priority;
+        });
+        entry.jobs.insert(position, job);
+    }
+    dispatch();
+    return job;
+}
+
+bool JobScheduler::take_task(std::shared_ptr<CountJob> &job, size_t &range) {
+    /**
+     * Pick the next task, the caller holds the mutex.
+     *
+     * @param job receives the job of the task
+     * @param range receives the index of the task range in the job
+     * @return false if no job has undispatched tasks
+     */
+    Client *chosen = nullptr;
+    for (auto &[name, client]: clients) {
+        if (client.jobs.empty()) {
+            continue;
+        }
+        int priority = client.jobs.front()->priority;
+        if (chosen == nullptr || priority > chosen->jobs.front()->priority ||
+            (priority == chosen->jobs.front()->priority && client.pass < chosen->pass)) {
+            chosen = &client;
+        }
+    }
+    if (chosen == nullptr) {
+        return false;
+    }
+    job = chosen->jobs.front();
+    range = job->next_range++;
+    if (job->next_range == job->ranges.size()) {
+        chosen->jobs.pop_front();
+    }
+    if (job->state == CountJob::State::queued) {
+        job->state = CountJob::State::running;
+        job->started = std::chrono::steady_clock::now();
+    }
+    virtual_time = chosen->pass;
+    uint64_t cost = std::max<uint64_t>(job->ranges[range].size, SCHEDULER_MIN_TASK_COST);
+    chosen->pass += static_cast<double>(cost) / chosen->weight;
+    return true;
+}
+
+void JobScheduler::run_tasks() {
+    /**
+     * Body of a token: run one task, then requeue the token or retire it if nothing is left.
+     */
+    std::shared_ptr<CountJob> job;
+    size_t range = 0;
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!take_task(job, range)) {
+            --tokens;
+            job_finished.notify_all();
+            return;
+        }
+    }
+
+    const CountJob::Range &task = job->ranges[range];
+    uint64_t lines = 0;
+    bool failed = false;
+    BufferPool &buffers = line_buffer_pool();
+    std::unique_ptr<char[]> buffer = buffers.acquire();
+    try {
+        lines = count_file_range(job->files[task.file], task.offset, task.size,
+                                 task.offset + task.size == job->file_sizes[task.file], buffer.get(),
+                                 buffers.buffer_size);
+    } catch (const std::exception &) {
+        failed = true;
+    }
+    buffers.release(std::move(buffer));
+
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        job->lines += lines;
+        job->bytes_done += task.size;
+        if (failed) {
+            job->failed[task.file] = true;
+        }
+        if (++job->finished_ranges == job->ranges.size()) {
+            job->state = CountJob::State::done;
+            job->finished = std::chrono::steady_clock::now();
+            --clients[job->client].admitted;
+            --admitted;
+            job_finished.notify_all();
+        }
+    }
+    pool.submit([this] { run_tasks(); });
+}
+
+void JobScheduler::dispatch() {
+    /**
+     * Queue tokens until there is one per pool thread.
+     */
+    size_t new_tokens;
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        new_tokens = pool.threads.size() - std::min(tokens, pool.threads.size());
+        tokens += new_tokens;
+    }
+    for (size_t token = 0; token < new_tokens; ++token) {
+        pool.submit([this] { run_tasks(); });
+    }
+}
+
+uint64_t JobScheduler::wait(CountJob &job) {
+    /**
+     * Wait for the job to finish.
+     *
+     * @return lines of the files that could be read
+     */
+    std::unique_lock<std::mutex> lock{mutex};
+    job_finished.wait(lock, [&] { return job.state == CountJob::State::done; });
+    return job.lines;
+}
+
+JobStats JobScheduler::stats(const CountJob &job) {
+    /**
+     * @return a consistent snapshot of the progress of the job
+     */
+    std::lock_guard<std::mutex> lock{mutex};
+    auto now = std::chrono::steady_clock::now();
+    auto seconds = [](auto duration) { return std::chrono::duration<double>(duration).count(); };
+    JobStats stats{};
+    stats.id = job.id;
+    stats.state = job.state;
+    stats.files = job.files.size();
+    stats.failed_files = static_cast<uint64_t>(std::count(job.failed.begin(), job.failed.end(), true));
+    for (uint64_t size: job.file_sizes) {
+        stats.bytes += size;
+    }
+    stats.bytes_done = job.bytes_done;
+    stats.lines = job.lines;
+    stats.tasks = job.ranges.size();
+    stats.tasks_done = job.finished_ranges;
+    if (job.state == CountJob::State::queued) {
+        stats.queued_seconds = seconds(now - job.submitted);
+    } else {
+        stats.queued_seconds = seconds(job.started - job.submitted);
+        stats.running_seconds = seconds((job.state == CountJob::State::done ? job.finished : now) - job.started);
+    }
+    return stats;
+}
+
+void JobScheduler::wait_idle() {
+    /**
+     * Wait until all admitted jobs are done and no token is left in the pool.
+     */
+    std::unique_lock<std::mutex> lock{mutex};
+    job_finished.wait(lock, [this] { return admitted == 0 && tokens == 0; });
+}
+
+struct axxonsoft_context {
+    ThreadPool pool;
+    JobScheduler scheduler{pool};
+
+    explicit axxonsoft_context(size_t threads) : pool{threads} {}
+    ~axxonsoft_context() { scheduler.wait_idle(); } // tokens use the scheduler until they retire
+};
+
+struct axxonsoft_job {
+    axxonsoft_context *context;
+    std::shared_ptr<CountJob> job;
+};
+
+extern "C" axxonsoft_context *axxonsoft_create(unsigned threads) {
+    try {
+        return new axxonsoft_context{threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads};
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+extern "C" void axxonsoft_destroy(axxonsoft_context *context) {
+    delete context;
+}
+
+extern "C" int axxonsoft_count_files_async(axxonsoft_context *context, const char *const *paths, size_t count,
+                                           uint64_t *lines, axxonsoft_callback callback, void *user_data) {
+    if (context == nullptr || callback == nullptr || (count > 0 && (paths == nullptr || lines == nullptr))) {
+        return AXXONSOFT_ERROR_ARGUMENT;
+    }
+
+    struct Request {
+        const char *const *paths;
+        size_t count;
+        uint64_t *lines;
+        axxonsoft_callback callback;
+        void *user_data;
+        std::atomic<size_t> next_file{0};
+        std::atomic<size_t> running_tasks{0};
+        std::atomic<int> status{AXXONSOFT_OK};
+    };
+
+    try {
+        auto request = std::make_shared<Request>();
+        request->paths = paths;
+        request->count = count;
+        request->lines = lines;
+        request->callback = callback;
+        request->user_data = user_data;
+        size_t tasks = std::max<size_t>(1, std::min(context->pool.threads.size(), count));
+        request->running_tasks = tasks;
+
+        for (size_t task = 0; task < tasks; ++task) {
+            context->pool.submit([request] {
+                for (size_t file = request->next_file++; file < request->count; file = request->next_file++) {
+                    try {
+                        request->lines[file] = count_lines_mapped(request->paths[file]);
+                    } catch (const std::exception &) {
+                        request->lines[file] = AXXONSOFT_LINES_ERROR;
+                        request->status = AXXONSOFT_ERROR_IO;
+                    }
+                }
+                if (--request->running_tasks == 0) {
+                    request->callback(request->user_data, request->status);
+                }
+            });
+        }
+    } catch (...) {
+        return AXXONSOFT_ERROR_INTERNAL;
+    }
+    return AXXONSOFT_OK;
+}
+
+extern "C" int axxonsoft_count_files(axxonsoft_context *context, const char *const *paths, size_t count,
+                                     uint64_t *lines) {
+    try {
+        std::promise<int> done;
+        std::future<int> status = done.get_future();
+        int queued = axxonsoft_count_files_async(context, paths, count, lines, [](void *user_data, int status) {
+            static_cast<std::promise<int> *>(user_data)->set_value(status);
+        }, &done);
+        return queued == AXXONSOFT_OK ? status.get() : queued;
+    } catch (...) {
+        return AXXONSOFT_ERROR_INTERNAL;
+    }
+}
+
+extern "C" int axxonsoft_count_directory(axxonsoft_context *context, const char *directory, uint64_t *total_lines,
+                                         uint64_t *files) {
+    if (context == nullptr || directory == nullptr || total_lines == nullptr) {
+        return AXXONSOFT_ERROR_ARGUMENT;
+    }
+    try {
+        std::vector<std::string> paths;
+        std::error_code error;
+        for (const auto &entry: std::filesystem::directory_iterator{directory, error}) {
+            if (entry.is_regular_file()) {
+                paths.push_back(entry.path().string());
+            }
+        }
+        if (error) {
+            return AXXONSOFT_ERROR_IO;
+        }
+
+        std::vector<const char *> path_pointers;
+        path_pointers.reserve(paths.size());
+        for (const auto &path: paths) {
+            path_pointers.push_back(path.c_str());
+        }
+        std::vector<uint64_t> lines(paths.size());
+        int status = axxonsoft_count_files(context, path_pointers.data(), paths.size(), lines.data());
+        *total_lines = 0;
+        for (uint64_t file_lines: lines) {
+            if (file_lines != AXXONSOFT_LINES_ERROR) {
+                *total_lines += file_lines;
+            }
+        }
+        if (files != nullptr) {
+            *files = paths.size();
+        }
+        return status;
+    } catch (...) {
+        return AXXONSOFT_ERROR_INTERNAL;
+    }
+}
+
+extern "C" int axxonsoft_submit_job(axxonsoft_context *context, const char *directory, const char *client,
+                                    unsigned weight, int priority, axxonsoft_job **job) {
+    if (context == nullptr || directory == nullptr || job == nullptr) {
+        return AXXONSOFT_ERROR_ARGUMENT;
+    }
+    *job = nullptr;
+    try {
+        std::vector<std::filesystem::path> paths;
+        std::error_code error;
+        for (const auto &entry: std::filesystem::directory_iterator{directory, error}) {
+            if (entry.is_regular_file()) {
+                paths.push_back(entry.path());
+            }
+        }
+        if (error) {
+            return AXXONSOFT_ERROR_IO;
+        }
+        auto submitted = context->scheduler.submit(client == nullptr ? "" : client, weight, priority, std::move(paths));
+        if (submitted == nullptr) {
+            return AXXONSOFT_ERROR_BUSY;
+        }
+        *job = new axxonsoft_job{context, std::move(submitted)};
+    } catch (...) {
+        return AXXONSOFT_ERROR_INTERNAL;
+    }
+    return AXXONSOFT_OK;
+}
+
+extern "C" int axxonsoft_job_wait(axxonsoft_job *job, uint64_t *total_lines) {
+    if (job == nullptr) {
+        return AXXONSOFT_ERROR_ARGUMENT;
+    }
+    try {
+        uint64_t lines = job->context->scheduler.wait(*job->job);
+        if (total_lines != nullptr) {
+            *total_lines = lines;
+        }
+        return job->context->scheduler.stats(*job->job).failed_files == 0 ? AXXONSOFT_OK : AXXONSOFT_ERROR_IO;
+    } catch (...) {
+        return AXXONSOFT_ERROR_INTERNAL;
+    }
+}
+
+extern "C" int axxonsoft_job_get_stats(axxonsoft_job *job, axxonsoft_job_stats *stats) {
+    if (job == nullptr || stats == nullptr) {
+        return AXXONSOFT_ERROR_ARGUMENT;
+    }
+    try {
+        JobStats snapshot = job->context->scheduler.stats(*job->job);
+        stats->id = snapshot.id;
+        stats->state = snapshot.state == CountJob::State::queued    ? AXXONSOFT_JOB_QUEUED
+                       : snapshot.state == CountJob::State::running ? AXXONSOFT_JOB_RUNNING
+                                                                    : AXXONSOFT_JOB_DONE;
+        stats->files = snapshot.files;
+        stats->failed_files = snapshot.failed_files;
+        stats->bytes = snapshot.bytes;
+        stats->bytes_done = snapshot.bytes_done;
+        stats->lines = snapshot.lines;
+        stats->tasks = snapshot.tasks;
+        stats->tasks_done = snapshot.tasks_done;
+        stats->queued_seconds = snapshot.queued_seconds;
+        stats->running_seconds = snapshot.running_seconds;
+    } catch (...) {
+        return AXXONSOFT_ERROR_INTERNAL;
+    }
+    return AXXONSOFT_OK;
+}
+
+extern "C" void axxonsoft_job_release(axxonsoft_job *job) {
+    delete job;
+}
+
+extern "C" const char *axxonsoft_status_string(int status) {
+    switch (status) {
+        case AXXONSOFT_OK:
+            return "ok";
+        case AXXONSOFT_ERROR_ARGUMENT:
+            return "invalid argument";
+        case AXXONSOFT_ERROR_IO:
+            return "file could not be read";
+        case AXXONSOFT_ERROR_INTERNAL:
+            return "internal error";
+        case AXXONSOFT_ERROR_BUSY:
+            return "job refused, too many jobs queued";
+        default:
+            return "unknown status";
+    }
+}
+
+/**
+ * Cross-engine verification.
+ *
+ * The counting engines hand every per-file result to the verifier, which keeps a Bernoulli sample
+ * of them (each file with probability rate) and queues it for a background thread. That thread
+ * lowers its own nice value to 19, so the reference re-count only uses CPU time the engines leave
+ * idle, and compares the counts with count_lines_getline. finish() waits for the queue to drain and
+ * prints the mismatches and a summary.
+ */
+
+Verifier::Verifier(double rate) : rate{rate}, random{std::random_device{}()} {
+    thread = std::thread{[this] {
+        ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19); // this thread only
+        for (;;) {
+            Mismatch check;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                work_available.wait(lock, [this] { return closed || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                check = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            bool readable = std::ifstream{check.path}.good();
+            check.reference_lines = readable ? count_lines_getline(check.path) : 0;
+            std::lock_guard<std::mutex> lock{mutex};
+            if (!readable) {
+                ++failed;
+            } else if (check.reference_lines != check.lines) {
+                mismatches.push_back(std::move(check));
+            }
+        }
+    }};
+}
+
+Verifier::~Verifier() {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        closed = true;
+    }
+    work_available.notify_one();
+    if (thread.joinable()) { // not yet joined by finish()
+        thread.join();
+    }
+}
+
+void Verifier::submit(const std::filesystem::path &path, const char *engine, uint64_t lines) {
+    /**
+     * Offer the result of an engine for one file, it is verified with probability rate.
+     */
+    std::lock_guard<std::mutex> lock{mutex};
+    ++submitted;
+    if (std::uniform_real_distribution<double>{0.0, 1.0}(random) >= rate) {
+        return;
+    }
+    ++sampled;
+    queue.push_back({path, engine, lines, 0});
+    work_available.notify_one();
+}
+
+void Verifier::finish(std::ostream &out) {
+    /**
+     * Wait for the sampled files to be verified and print mismatches and a summary.
+     */
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        closed = true;
+    }
+    work_available.notify_one();
+    thread.join();
+
+    for (const auto &mismatch: mismatches) {
+        out << "Verification mismatch: " << mismatch.path.string() << "\t" << mismatch.engine << " "
+            << mismatch.lines << " lines, reference " << mismatch.reference_lines << " lines\n";
+    }
+    out << "Verified files: " << sampled << " of " << submitted << ", mismatches: " << mismatches.size();
+    if (failed > 0) {
+        out << ", unreadable: " << failed;
+    }
+    out << "\n";
+}
+
+/**
+ * Memory governor.
+ *
+ * Without a budget the governor only keeps statistics. With -max-memory=MB the budget is a hard
+ * ceiling of the reserved bytes: reserve() waits until the bytes fit and reserve_up_to() grants
+ * whatever fits between a minimum and the preferred size and only waits when not even the minimum
+ * fits. Callers that can work with less use the second one: read buffers degrade to
+ * GOVERNOR_MIN_BUFFER_SIZE, the distinct line buffer to a smaller spill threshold. A request
+ * larger than the whole budget throws instead of waiting forever. The waits are the backpressure:
+ * a worker that can not get a buffer stops reading until another one releases its own.
+ *
+ * Structures that grow while their owner holds other memory (token tables, heavy hitter
+ * candidates, chunk caches) grow their reservation with MemoryReservation::resize before
+ * allocating. It never waits, since every worker could be waiting for another, and throws when the
+ * growth does not fit: the run fails instead of exceeding the budget. Workers with a fixed
+ * footprint are capped by governed_workers so that all of them fit.
+ *
+ * Governed memory: read buffers of the buffered ncount method, the line reader buffer pool (also
+ * used by plugins), the chunk outputs of -map, the distinct line buffer with its deduplication
+ * tables, the heavy hitter sketches and candidates, token tables and chunk caches. Not governed:
+ * file mappings, which are page cache the kernel reclaims under pressure, and the stream state of
+ * the getline and ncount reference methods, whose workers are only capped in number.
+ */
+
+static std::runtime_error budget_too_small(size_t budget, size_t bytes) {
+    return std::runtime_error("Memory budget of " + std::to_string(budget / (1024 * 1024)) +
+                              " MB is too small for " + std::to_string(bytes) + " bytes");
+}
+
+void MemoryGovernor::reserve(size_t bytes) {
+    std::unique_lock<std::mutex> lock{mutex};
+    if (bytes > budget) {
+        throw budget_too_small(budget, bytes);
+    }
+    auto fits = [&] { return bytes <= budget - in_use; };
+    if (!fits()) {
+        ++stalls;
+        released.wait(lock, fits);
+    }
+    in_use += bytes;
+    peak = std::max(peak, in_use);
+}
+
+bool MemoryGovernor::try_reserve(size_t bytes) {
+    /**
+     * @return false instead of waiting when the bytes do not fit
+     */
+    std::lock_guard<std::mutex> lock{mutex};
+    if (bytes > budget - in_use) {
+        return false;
+    }
+    in_use += bytes;
+    peak = std::max(peak, in_use);
+    return true;
+}
+
+size_t MemoryGovernor::reserve_up_to(size_t preferred, size_t minimum) {
+    /**
+     * @return reserved bytes, between minimum and preferred
+     */
+    std::unique_lock<std::mutex> lock{mutex};
+    if (minimum > budget) {
+        throw budget_too_small(budget, minimum);
+    }
+    auto available = [&] { return budget - in_use; };
+    if (available() < minimum) {
+        ++stalls;
+        released.wait(lock, [&] { return available() >= minimum; });
+    }
+    size_t bytes = std::max(minimum, std::min(preferred, available()));
+    if (bytes < preferred) {
+        ++degraded;
+    }
+    in_use += bytes;
+    peak = std::max(peak, in_use);
+    return bytes;
+}
+
+void MemoryGovernor::release(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        in_use -= bytes;
+    }
+    released.notify_all();
+}
+
+void MemoryGovernor::record_stall() {
+    /**
+     * Count a wait for memory that happened outside of the governor, e.g. for a pooled buffer.
+     */
+    std::lock_guard<std::mutex> lock{mutex};
+    ++stalls;
+}
+
+MemoryGovernor &memory_governor() {
+    static MemoryGovernor governor;
+    return governor;
+}
+
+size_t governed_workers(size_t per_worker) {
+    /**
+     * @return hardware_concurrency workers, fewer when the budget can not hold per_worker bytes for each
+     */
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    size_t budget = memory_governor().budget; // set once before any worker starts
+    if (per_worker > 0 && budget != SIZE_MAX) {
+        workers = std::clamp<size_t>(budget / per_worker, 1, workers);
+    }
+    return workers;
+}
+
+MemoryReservation::MemoryReservation(size_t bytes) : bytes{bytes} {
+    memory_governor().reserve(bytes);
+}
+
+MemoryReservation::MemoryReservation(size_t preferred, size_t minimum)
+        : bytes{memory_governor().reserve_up_to(preferred, minimum)} {}
+
+MemoryReservation::MemoryReservation(MemoryReservation &&other) noexcept: bytes{other.bytes} {
+    other.bytes = 0;
+}
+
+MemoryReservation &MemoryReservation::operator=(MemoryReservation &&other) noexcept {
+    if (this != &other) {
+        if (bytes > 0) {
+            memory_governor().release(bytes);
+        }
+        bytes = other.bytes;
+        other.bytes = 0;
+    }
+    return *this;
+}
+
+MemoryReservation::~MemoryReservation() {
+    if (bytes > 0) {
+        memory_governor().release(bytes);
+    }
+}
+
+void MemoryReservation::resize(size_t new_bytes) {
+    /**
+     * Grow or shrink the reservation. Growing does not wait, it throws when the bytes do not fit.
+     */
+    MemoryGovernor &governor = memory_governor();
+    if (new_bytes > bytes) {
+        if (!governor.try_reserve(new_bytes - bytes)) {
+            throw std::runtime_error("Memory budget of " + std::to_string(governor.budget / (1024 * 1024)) +
+                                     " MB exceeded");
+        }
+    } else if (new_bytes < bytes) {
+        governor.release(bytes - new_bytes);
+    }
+    bytes = new_bytes;
+}
+
+void MemoryReservation::merge(MemoryReservation &&other) {
+    /**
+     * Take over the bytes of another reservation, e.g. along with the memory they cover.
+     */
+    bytes += other.bytes;
+    other.bytes = 0;
+}
+
+void print_memory_report(std::ostream &out) {
+    /**
+     * Print peak RSS of the process and the governor statistics.
+     */
+    struct rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    MemoryGovernor &governor = memory_governor();
+    std::lock_guard<std::mutex> lock{governor.mutex};
+    out << "Peak RSS: " << usage.ru_maxrss / 1024 << " MB, peak reserved: " << governor.peak / (1024 * 1024)
+        << " MB of " << governor.budget / (1024 * 1024) << " MB, governor stalls: " << governor.stalls
+        << ", degraded buffers: " << governor.degraded << "\n";
+}
+
+/**
+ * Copy-and-count ingestion.
+ *
+ * Every worker copies whole files with the two halves of a buffer from line_buffer_pool(): while
+ * the write of one half runs on the worker's own writer thread (a one-thread ThreadPool that lives
+ * as long as the worker), the next part of the file is read into the other half and its newlines
+ * are counted, so reading, counting and writing overlap and the data is read once. The destination
+ * is preallocated with posix_fallocate to the size of the source, which avoids fragmentation and
+ * reports a full disk before anything is written, and is truncated to the bytes actually copied in
+ * case the source shrank meanwhile. Files are written under a temporary name, get the permission
+ * bits and times of the source (the mode is set with fchmod, the mode given to open is filtered by
+ * the umask) and are renamed into place, so a reader of the destination never sees a partial file.
+ * io_uring would let one thread keep several reads and writes in flight; it is not used because
+ * liburing is not available to this build, the writer thread gives the same read/write overlap with
+ * plain read(2) and write(2).
+ */
+
+static void write_all(int fd, const char *data, size_t size, const std::filesystem::path &path) {
+    while (size > 0) {
+        ssize_t count = ::write(fd, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            throw std::runtime_error("Cannot write " + path.string());
+        }
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+}
+
+uint64_t copy_and_count_file(const std::filesystem::path &source, const std::filesystem::path &destination,
+                             char *buffers[2], size_t buffer_size, ThreadPool &writer) {
+    /**
+     * Copy a file and count its lines on the way.
+     *
+     * @param source file to copy
+     * @param destination path of the copy, its directory must exist
+     * @param buffers two buffers of buffer_size bytes
+     * @param buffer_size size of each buffer
+     * @param writer one-thread pool running the writes
+     * @return lines of the file, as counted by count_lines_getline
+     */
+    int input = ::open(source.c_str(), O_RDONLY);
+    if (input < 0) {
+        throw std::runtime_error("Cannot open " + source.string());
+    }
+    struct stat source_stat{};
+    if (::fstat(input, &source_stat) != 0) {
+        ::close(input);
+        throw std::runtime_error("Cannot stat " + source.string());
+    }
+    ::posix_fadvise(input, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::filesystem::path temporary_path = destination;
+    temporary_path += ".copy.tmp";
+    int output = ::open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, source_stat.st_mode & 07777);
+    if (output < 0) {
+        ::close(input);
+        throw std::runtime_error("Cannot create " + temporary_path.string());
+    }
+
+    uint64_t lines_count = 0;
+    std::future<void> pending_write;
+    try {
+        if (source_stat.st_size > 0) {
+            int error = ::posix_fallocate(output, 0, source_stat.st_size);
+            if (error != 0 && error != EOPNOTSUPP && error != EINVAL) {
+                throw std::runtime_error("Cannot allocate " + temporary_path.string() + ": " + std::strerror(error));
+            }
+        }
+
+        char last_byte = '\n';
+        off_t copied = 0;
+        for (size_t current = 0;; current ^= 1) {
+            // the buffer being filled was written two rounds ago, that write is waited for below
+            ssize_t count;
+            do {
+                count = ::read(input, buffers[current], buffer_size);
+            } while (count < 0 && errno == EINTR);
+            if (count < 0) {
+                throw std::runtime_error("Cannot read " + source.string());
+            }
+            if (count == 0) {
+                break;
+            }
+            lines_count += count_newlines(buffers[current], static_cast<size_t>(count));
+            last_byte = buffers[current][count - 1];
+            copied += count;
+
+            if (pending_write.valid()) {
+                pending_write.get();
+            }
+            auto write = std::make_shared<std::packaged_task<void()>>(
+                    [output, data = buffers[current], size = static_cast<size_t>(count), &temporary_path] {
+                        write_all(output, data, size, temporary_path);
+                    });
+            pending_write = write->get_future();
+            writer.submit([write] { (*write)(); });
+        }
+        if (pending_write.valid()) {
+            pending_write.get();
+        }
+        if (last_byte != '\n') {
+            ++lines_count; // last line without a terminator
+        }
+        if (copied != source_stat.st_size && ::ftruncate(output, copied) != 0) {
+            throw std::runtime_error("Cannot truncate " + temporary_path.string()); // the source shrank
+        }
+
+        ::fchmod(output, source_stat.st_mode & 07777);
+        const struct timespec times[2]{source_stat.st_atim, source_stat.st_mtim};
+        ::futimens(output, times);
+        if (::close(output) != 0) {
+            output = -1;
+            throw std::runtime_error("Cannot write " + temporary_path.string());
+        }
+        output = -1;
+        std::filesystem::rename(temporary_path, destination);
+    } catch (...) {
+        if (pending_write.valid()) {
+            pending_write.wait();
+        }
+        if (output >= 0) {
+            ::close(output);
+        }
+        ::close(input);
+        std::error_code ignored;
+        std::filesystem::remove(temporary_path, ignored);
+        throw;
+    }
+    ::close(input);
+    return lines_count;
+}
+
+CopyResult copy_and_count_tree(const std::filesystem::path &source, const std::filesystem::path &destination) {
+    /**
+     * Copy a directory tree and count the lines of every regular file.
+     *
+     * @param source directory to copy
+     * @param destination directory receiving the copy, created if needed
+     * @return copied files, bytes and lines
+     */
+    std::vector<std::pair<std::filesystem::path, uint64_t>> files; // relative path and size
+    std::filesystem::create_directories(destination);
+    for (const auto &entry: std::filesystem::recursive_directory_iterator{source}) {
+        std::filesystem::path relative = entry.path().lexically_relative(source);
+        if (entry.is_directory()) {
+            std::filesystem::create_directories(destination / relative);
+        } else if (entry.is_regular_file()) {
+            files.emplace_back(relative, entry.file_size());
+        }
+    }
+
+    BufferPool &pool = line_buffer_pool();
+    std::atomic<size_t> next_file{0};
+    auto copy = [&] {
+        CopyResult result;
+        // both halves of one pooled buffer, two separate acquisitions could deadlock on a tight budget
+        std::unique_ptr<char[]> buffer = pool.acquire();
+        char *buffers[2]{buffer.get(), buffer.get() + pool.buffer_size / 2};
+        try {
+            ThreadPool writer{1};
+            for (size_t file = next_file++; file < files.size(); file = next_file++) {
+                const auto &[relative, size] = files[file];
+                result.lines += copy_and_count_file(source / relative, destination / relative, buffers,
+                                                    pool.buffer_size / 2, writer);
+                result.bytes += size;
+                ++result.files;
+            }
+        } catch (...) {
+            pool.release(std::move(buffer));
+            throw;
+        }
+        pool.release(std::move(buffer));
+        return result;
+    };
+
+    std::vector<std::future<CopyResult>> futures;
+    for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+        futures.push_back(std::async(std::launch::async, copy));
+    }
+    CopyResult total;
+    std::exception_ptr failure;
+    for (auto &future: futures) {
+        try {
+            CopyResult result = future.get();
+            total.files += result.files;
+            total.bytes += result.bytes;
+            total.lines += result.lines;
+        } catch (...) {
+            failure = std::current_exception();
+        }
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    return total;
+}
+
+int run_copy_mode(const std::filesystem::path &source, const std::vector<std::string> &options) {
+    /**
+     * Copy the directory tree to -copy-to=DIR and print the line count of the copied files.
+     *
+     * @param source directory to copy
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::filesystem::path destination = option_value(options, "copy-to");
+    try {
+        std::filesystem::path absolute_source = std::filesystem::weakly_canonical(source);
+        std::filesystem::path absolute_destination = std::filesystem::weakly_canonical(destination);
+        auto relative = absolute_destination.lexically_relative(absolute_source);
+        if (!relative.empty() && *relative.begin() != "..") {
+            std::cout << "Destination is inside the source directory\n";
+            return 1;
+        }
+
+        CopyResult result = copy_and_count_tree(source, destination);
+        std::cout << "Copied files: " << result.files << ", bytes: " << result.bytes << "\n"
+                  << "Total lines: " << result.lines << "\n";
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Fused checksum manifests.
+ *
+ * Every file is mapped once and walked in CHECKSUM_BLOCK_SIZE blocks; each block is counted and fed
+ * to the selected checksums while it is still in the cache, so one pass over the data gives both
+ * the line count and the integrity hashes. CRC32C uses the 8-byte SSE4.2 crc32 instruction, which
+ * is already well above the read bandwidth, and a slicing-by-8 table on CPUs without it. XXH3 is the 64-bit
+ * variant with seed 0 and the default secret, implemented in scalar code as in the reference
+ * streaming API (256-byte internal buffer, stripes of 64 bytes, scrambling after every 16
+ * stripes). SHA-256 uses the SHA extensions (sha256rnds2, sha256msg1/2) when cpuid reports them
+ * and the portable compression function otherwise.
+ *
+ * The manifest has the GNU coreutils layout: "<sha256>  <path>" lines when SHA-256 is the only
+ * algorithm, so sha256sum -c accepts it, and BSD tagged "ALGORITHM (path) = <hex>" lines when
+ * several algorithms are selected. Paths are relative to the counted directory.
+ */
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table() {
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0x82F63B78 & (0u - (crc & 1))); // reflected Castagnoli polynomial
+        }
+        crc32c_table[0][byte] = crc;
+    }
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        for (int slice = 1; slice < 8; ++slice) {
+            uint32_t previous = crc32c_table[slice - 1][byte];
+            crc32c_table[slice][byte] = (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *data, size_t size) {
+    static std::once_flag table_ready;
+    std::call_once(table_ready, crc32c_init_table);
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+              crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF] ^
+              crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF] ^
+              crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data,
+                                                               size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+void Crc32c::update(const char *data, size_t size) {
+    /**
+     * Add bytes to the checksum.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     */
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        value = crc32c_sse42(value, reinterpret_cast<const unsigned char *>(data), size);
+        return;
+    }
+#endif
+    value = crc32c_portable(value, reinterpret_cast<const unsigned char *>(data), size);
+}
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_STRIPE_LEN 64
+#define XXH_SECRET_SIZE 192
+#define XXH_STRIPES_PER_BLOCK ((XXH_SECRET_SIZE - XXH_STRIPE_LEN) / 8)
+
+static const unsigned char xxh3_secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint64_t xxh_read64(const unsigned char *data) {
+    uint64_t value;
+    std::memcpy(&value, data, 8);
+    return value;
+}
+
+static uint32_t xxh_read32(const unsigned char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, 4);
+    return value;
+}
+
+static uint64_t xxh_rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t xxh_mul128_fold64(uint64_t lhs, uint64_t rhs) {
+    __uint128_t product = static_cast<__uint128_t>(lhs) * rhs;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+static uint64_t xxh64_avalanche(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t xxh3_avalanche(uint64_t hash) {
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ULL;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t hash, uint64_t length) {
+    hash ^= xxh_rotl64(hash, 49) ^ xxh_rotl64(hash, 24);
+    hash *= 0x9FB21C651E98DF25ULL;
+    hash ^= (hash >> 35) + length;
+    hash *= 0x9FB21C651E98DF25ULL;
+    return hash ^ (hash >> 28);
+}
+
+static uint64_t xxh3_mix16(const unsigned char *data, const unsigned char *secret) {
+    return xxh_mul128_fold64(xxh_read64(data) ^ xxh_read64(secret), xxh_read64(data + 8) ^ xxh_read64(secret + 8));
+}
+
+static uint64_t xxh3_short(const unsigned char *data, size_t size) {
+    /**
+     * XXH3-64 of inputs up to 240 bytes, which are hashed without the accumulators.
+     */
+    const unsigned char *secret = xxh3_secret;
+    if (size == 0) {
+        return xxh64_avalanche(xxh_read64(secret + 56) ^ xxh_read64(secret + 64));
+    }
+    if (size <= 3) {
+        uint32_t combined = (static_cast<uint32_t>(data[0]) << 16) | (static_cast<uint32_t>(data[size >> 1]) << 24) |
+                            data[size - 1] | (static_cast<uint32_t>(size) << 8);
+        uint64_t flip = xxh_read32(secret) ^ xxh_read32(secret + 4);
+        return xxh64_avalanche(combined ^ flip);
+    }
+    if (size <= 8) {
+        uint64_t flip = xxh_read64(secret + 8) ^ xxh_read64(secret + 16);
+        uint64_t input = xxh_read32(data + size - 4) + (static_cast<uint64_t>(xxh_read32(data)) << 32);
+        return xxh3_rrmxmx(input ^ flip, size);
+    }
+    if (size <= 16) {
+        uint64_t low = xxh_read64(data) ^ (xxh_read64(secret + 24) ^ xxh_read64(secret + 32));
+        uint64_t high = xxh_read64(data + size - 8) ^ (xxh_read64(secret + 40) ^ xxh_read64(secret + 48));
+        return xxh3_avalanche(size + __builtin_bswap64(low) + high + xxh_mul128_fold64(low, high));
+    }
+    uint64_t accumulator = size * XXH_PRIME64_1;
+    if (size <= 128) {
+        if (size > 32) {
+            if (size > 64) {
+                if (size > 96) {
+                    accumulator += xxh3_mix16(data + 48, secret + 96);
+                    accumulator += xxh3_mix16(data + size - 64, secret + 112);
+                }
+                accumulator += xxh3_mix16(data + 32, secret + 64);
+                accumulator += xxh3_mix16(data + size - 48, secret + 80);
+            }
+            accumulator += xxh3_mix16(data + 16, secret + 32);
+            accumulator += xxh3_mix16(data + size - 32, secret + 48);
+        }
+        accumulator += xxh3_mix16(data, secret);
+        accumulator += xxh3_mix16(data + size - 16, secret + 16);
+        return xxh3_avalanche(accumulator);
+    }
+    for (size_t round = 0; round < 8; ++round) {
+        accumulator += xxh3_mix16(data + 16 * round, secret + 16 * round);
+    }
+    accumulator = xxh3_avalanche(accumulator);
+    for (size_t round = 8; round < size / 16; ++round) {
+        accumulator += xxh3_mix16(data + 16 * round, secret + 16 * (round - 8) + 3);
+    }
+    accumulator += xxh3_mix16(data + size - 16, secret + 136 - 17);
+    return xxh3_avalanche(accumulator);
+}
+
+static void xxh3_accumulate_stripe(uint64_t accumulators[8], const unsigned char *stripe, const unsigned char *secret) {
+    for (size_t lane = 0; lane < 8; ++lane) {
+        uint64_t value = xxh_read64(stripe + 8 * lane);
+        uint64_t key = value ^ xxh_read64(secret + 8 * lane);
+        accumulators[lane ^ 1] += value;
+        accumulators[lane] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static void xxh3_scramble(uint64_t accumulators[8]) {
+    const unsigned char *secret = xxh3_secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN;
+    for (size_t lane = 0; lane < 8; ++lane) {
+        uint64_t accumulator = accumulators[lane];
+        accumulator ^= accumulator >> 47;
+        accumulator ^= xxh_read64(secret + 8 * lane);
+        accumulators[lane] = accumulator * XXH_PRIME32_1;
+    }
+}
+
+static void xxh3_consume_stripes(uint64_t accumulators[8], size_t &stripes_so_far, const unsigned char *data,
+                                 size_t stripes) {
+    /**
+     * Accumulate whole stripes, scrambling the accumulators at the end of every block.
+     */
+    for (size_t stripe = 0; stripe < stripes; ++stripe) {
+        xxh3_accumulate_stripe(accumulators, data + stripe * XXH_STRIPE_LEN, xxh3_secret + stripes_so_far * 8);
+        if (++stripes_so_far == XXH_STRIPES_PER_BLOCK) {
+            xxh3_scramble(accumulators);
+            stripes_so_far = 0;
+        }
+    }
+}
+
+Xxh3::Xxh3()
+    : accumulators{XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+                   XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1} {
+}
+
+void Xxh3::update(const char *data, size_t size) {
+    /**
+     * Add bytes to the hash. At least one byte always stays buffered, the last stripe is hashed
+     * with a different secret offset by digest().
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     */
+    auto input = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = input + size;
+    total += size;
+    if (buffered + size <= sizeof(buffer)) {
+        std::memcpy(buffer + buffered, input, size);
+        buffered += size;
+        return;
+    }
+    if (buffered > 0) {
+        size_t fill = sizeof(buffer) - buffered;
+        std::memcpy(buffer + buffered, input, fill);
+        input += fill;
+        xxh3_consume_stripes(accumulators, stripes_so_far, buffer, sizeof(buffer) / XXH_STRIPE_LEN);
+        buffered = 0;
+    }
+    if (static_cast<size_t>(end - input) > sizeof(buffer)) {
+        do {
+            xxh3_consume_stripes(accumulators, stripes_so_far, input, sizeof(buffer) / XXH_STRIPE_LEN);
+            input += sizeof(buffer);
+        } while (static_cast<size_t>(end - input) > sizeof(buffer));
+        // keep the stripe before the remaining bytes, digest() may need it as the last stripe
+        std::memcpy(buffer + sizeof(buffer) - XXH_STRIPE_LEN, input - XXH_STRIPE_LEN, XXH_STRIPE_LEN);
+    }
+    std::memcpy(buffer, input, static_cast<size_t>(end - input));
+    buffered = static_cast<size_t>(end - input);
+}
+
+uint64_t Xxh3::digest() const {
+    /**
+     * @return XXH3-64 of all bytes added so far, the state is not changed
+     */
+    if (total <= 240) {
+        return xxh3_short(buffer, static_cast<size_t>(total));
+    }
+    uint64_t result[8];
+    std::memcpy(result, accumulators, sizeof(result));
+    const unsigned char *last_stripe_secret = xxh3_secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7;
+    if (buffered >= XXH_STRIPE_LEN) {
+        size_t stripes = stripes_so_far;
+        xxh3_consume_stripes(result, stripes, buffer, (buffered - 1) / XXH_STRIPE_LEN);
+        xxh3_accumulate_stripe(result, buffer + buffered - XXH_STRIPE_LEN, last_stripe_secret);
+    } else {
+        unsigned char last_stripe[XXH_STRIPE_LEN];
+        size_t catch_up = XXH_STRIPE_LEN - buffered;
+        std::memcpy(last_stripe, buffer + sizeof(buffer) - catch_up, catch_up);
+        std::memcpy(last_stripe + catch_up, buffer, buffered);
+        xxh3_accumulate_stripe(result, last_stripe, last_stripe_secret);
+    }
+    uint64_t hash = total * XXH_PRIME64_1;
+    for (size_t pair = 0; pair < 4; ++pair) {
+        hash += xxh_mul128_fold64(result[2 * pair] ^ xxh_read64(xxh3_secret + 11 + 16 * pair),
+                                  result[2 * pair + 1] ^ xxh_read64(xxh3_secret + 11 + 16 * pair + 8));
+    }
+    return xxh3_avalanche(hash);
+}
+
+alignas(16) static const uint32_t sha256_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t sha256_rotr(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256_blocks_portable(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    for (; blocks > 0; --blocks, data += 64) {
+        uint32_t words[64];
+        for (size_t i = 0; i < 16; ++i) {
+            words[i] = (static_cast<uint32_t>(data[4 * i]) << 24) | (static_cast<uint32_t>(data[4 * i + 1]) << 16) |
+                       (static_cast<uint32_t>(data[4 * i + 2]) << 8) | data[4 * i + 3];
+        }
+        for (size_t i = 16; i < 64; ++i) {
+            uint32_t s0 = sha256_rotr(words[i - 15], 7) ^ sha256_rotr(words[i - 15], 18) ^ (words[i - 15] >> 3);
+            uint32_t s1 = sha256_rotr(words[i - 2], 17) ^ sha256_rotr(words[i - 2], 19) ^ (words[i - 2] >> 10);
+            words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (size_t i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                          sha256_constants[i] + words[i];
+            uint32_t t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sha,sse4.1"))) static void sha256_blocks_shani(uint32_t state[8], const unsigned char *data,
+                                                                     size_t blocks) {
+    /**
+     * SHA-256 compression with the SHA extensions. The state is kept as the ABEF and CDGH halves
+     * expected by sha256rnds2, each instruction does two rounds.
+     */
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks > 0; --blocks, data += 64) {
+        const __m128i abef_saved = abef;
+        const __m128i cdgh_saved = cdgh;
+        __m128i messages[4];
+        for (size_t group = 0; group < 16; ++group) {
+            __m128i &message = messages[group % 4];
+            if (group < 4) {
+                message = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * group)),
+                                           byte_swap);
+            } else {
+                // W[t-16] + s0(W[t-15]) + W[t-7], then s1(W[t-2]) is added word by word
+                __m128i schedule = _mm_sha256msg1_epu32(message, messages[(group + 1) % 4]);
+                schedule = _mm_add_epi32(schedule, _mm_alignr_epi8(messages[(group + 3) % 4], messages[(group + 2) % 4], 4));
+                message = _mm_sha256msg2_epu32(schedule, messages[(group + 3) % 4]);
+            }
+            __m128i keyed = _mm_add_epi32(message,
+                                          _mm_load_si128(reinterpret_cast<const __m128i *>(sha256_constants + 4 * group)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, keyed);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(keyed, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+static bool cpu_has_sha() {
+    unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) != 0 &&
+           __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static void sha256_blocks(uint32_t state[8], const unsigned char *data, size_t blocks) {
+#if defined(__x86_64__)
+    static const bool has_sha = cpu_has_sha();
+    if (has_sha) {
+        sha256_blocks_shani(state, data, blocks);
+        return;
+    }
+#endif
+    sha256_blocks_portable(state, data, blocks);
+}
+
+Sha256::Sha256()
+    : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {
+}
+
+void Sha256::update(const char *data, size_t size) {
+    /**
+     * Add bytes to the hash. Whole blocks are compressed straight from the input.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     */
+    auto input = reinterpret_cast<const unsigned char *>(data);
+    total += size;
+    if (buffered > 0) {
+        size_t fill = std::min(size, sizeof(buffer) - buffered);
+        std::memcpy(buffer + buffered, input, fill);
+        buffered += fill;
+        input += fill;
+        size -= fill;
+        if (buffered < sizeof(buffer)) {
+            return;
+        }
+        sha256_blocks(state, buffer, 1);
+        buffered = 0;
+    }
+    sha256_blocks(state, input, size / 64);
+    input += size / 64 * 64;
+    buffered = size % 64;
+    std::memcpy(buffer, input, buffered);
+}
+
+std::array<unsigned char, 32> Sha256::digest() {
+    /**
+     * Pad the message and return the hash. Further updates are not allowed.
+     *
+     * @return SHA-256 of all bytes added
+     */
+    uint64_t bits = total * 8;
+    buffer[buffered++] = 0x80;
+    if (buffered > 56) {
+        std::memset(buffer + buffered, 0, sizeof(buffer) - buffered);
+        sha256_blocks(state, buffer, 1);
+        buffered = 0;
+    }
+    std::memset(buffer + buffered, 0, 56 - buffered);
+    for (size_t i = 0; i < 8; ++i) {
+        buffer[63 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    }
+    sha256_blocks(state, buffer, 1);
+
+    std::array<unsigned char, 32> hash{};
+    for (size_t i = 0; i < 32; ++i) {
+        hash[i] = static_cast<unsigned char>(state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+    return hash;
+}
+
+static std::string hex_string(const unsigned char *bytes, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text(size * 2, '0');
+    for (size_t i = 0; i < size; ++i) {
+        text[2 * i] = digits[bytes[i] >> 4];
+        text[2 * i + 1] = digits[bytes[i] & 0x0F];
+    }
+    return text;
+}
+
+static std::string hex_string(uint64_t value, size_t digits) {
+    unsigned char bytes[8];
+    for (size_t i = 0; i < 8; ++i) {
+        bytes[i] = static_cast<unsigned char>(value >> (56 - 8 * i));
+    }
+    return hex_string(bytes + 8 - digits / 2, digits / 2);
+}
+
+FileChecksums checksum_file(const std::filesystem::path &file_path, unsigned algorithms) {
+    /**
+     * Count lines and compute the selected checksums in one pass over the file.
+     *
+     * @param file_path path to the file
+     * @param algorithms ChecksumAlgorithm bits
+     * @return lines, as counted by count_lines_getline, and hex checksums of the selected algorithms
+     */
+    MappedFile map{file_path};
+    if (map.size > 0) {
+        ::madvise(const_cast<char *>(map.data), map.size, MADV_SEQUENTIAL);
+    }
+    Crc32c crc32c;
+    Xxh3 xxh3;
+    Sha256 sha256;
+    FileChecksums result;
+    for (size_t offset = 0; offset < map.size; offset += CHECKSUM_BLOCK_SIZE) {
+        size_t size = std::min<size_t>(CHECKSUM_BLOCK_SIZE, map.size - offset);
+        const char *block = map.data + offset;
+        result.lines += count_newlines(block, size);
+        if (algorithms & checksum_crc32c) {
+            crc32c.update(block, size);
+        }
+        if (algorithms & checksum_xxh3) {
+            xxh3.update(block, size);
+        }
+        if (algorithms & checksum_sha256) {
+            sha256.update(block, size);
+        }
+    }
+    if (map.size > 0 && map.data[map.size - 1] != '\n') {
+        ++result.lines; // last line without a terminator
+    }
+    if (algorithms & checksum_crc32c) {
+        result.crc32c = hex_string(crc32c.digest(), 8);
+    }
+    if (algorithms & checksum_xxh3) {
+        result.xxh3 = hex_string(xxh3.digest(), 16);
+    }
+    if (algorithms & checksum_sha256) {
+        auto hash = sha256.digest();
+        result.sha256 = hex_string(hash.data(), hash.size());
+    }
+    return result;
+}
+
+static const std::array<std::pair<unsigned, const char *>, 3> checksum_names{{
+    {checksum_sha256, "SHA256"},
+    {checksum_xxh3, "XXH3"},
+    {checksum_crc32c, "CRC32C"},
+}};
+
+static const std::string &checksum_of(const FileChecksums &checksums, unsigned algorithm) {
+    return algorithm == checksum_crc32c ? checksums.crc32c : algorithm == checksum_xxh3 ? checksums.xxh3
+                                                                                         : checksums.sha256;
+}
+
+static std::vector<FileChecksums> checksum_files(const std::vector<std::filesystem::path> &paths, unsigned algorithms) {
+    /**
+     * Checksum files on all cores.
+     *
+     * @param paths files to checksum
+     * @param algorithms ChecksumAlgorithm bits
+     * @return checksums in the order of paths
+     */
+    std::vector<FileChecksums> results(paths.size());
+    std::atomic<size_t> next_file{0};
+    auto work = [&]() {
+        for (size_t index = next_file++; index < paths.size(); index = next_file++) {
+            results[index] = checksum_file(paths[index], algorithms);
+        }
+    };
+    std::vector<std::future<void>> futures;
+    for (size_t worker = 0; worker < std::max(1u, std::thread::hardware_concurrency()); ++worker) {
+        futures.push_back(std::async(std::launch::async, work));
+    }
+    std::exception_ptr failure;
+    for (auto &future: futures) {
+        try {
+            future.get();
+        } catch (...) {
+            failure = std::current_exception();
+        }
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    return results;
+}
+
+int run_manifest_mode(const std::vector<std::filesystem::directory_entry> &files,
+                      const std::vector<std::string> &options) {
+    /**
+     * Write the checksum manifest of the files to -manifest=FILE and print the total line count.
+     * -manifest-hash=LIST selects the algorithms, sha256 by default.
+     *
+     * @param files files of the counted directory
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::filesystem::path manifest_path = option_value(options, "manifest");
+    std::string list = option_value(options, "manifest-hash");
+    unsigned algorithms = 0;
+    std::stringstream names{list.empty() ? "sha256" : list};
+    for (std::string name; std::getline(names, name, ',');) {
+        if (name == "sha256") {
+            algorithms |= checksum_sha256;
+        } else if (name == "xxh3") {
+            algorithms |= checksum_xxh3;
+        } else if (name == "crc32c") {
+            algorithms |= checksum_crc32c;
+        } else {
+            std::cout << "Unknown checksum algorithm: " << name << "\n";
+            return 1;
+        }
+    }
+
+    try {
+        std::filesystem::path absolute_manifest = std::filesystem::weakly_canonical(manifest_path);
+        std::vector<std::filesystem::path> paths;
+        for (const auto &file: files) {
+            if (std::filesystem::weakly_canonical(file.path()) != absolute_manifest) {
+                paths.push_back(file.path());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+        std::vector<FileChecksums> results = checksum_files(paths, algorithms);
+
+        std::ofstream manifest{manifest_path, std::ios::binary};
+        if (!manifest) {
+            throw std::runtime_error("Cannot write " + manifest_path.string());
+        }
+        uint64_t total_lines = 0;
+        for (size_t index = 0; index < paths.size(); ++index) {
+            std::string name = paths[index].filename().string();
+            for (const auto &[algorithm, tag]: checksum_names) {
+                if (algorithms == checksum_sha256) {
+                    manifest << results[index].sha256 << "  " << name << "\n";
+                    break;
+                }
+                if (algorithms & algorithm) {
+                    manifest << tag << " (" << name << ") = " << checksum_of(results[index], algorithm) << "\n";
+                }
+            }
+            total_lines += results[index].lines;
+        }
+        if (!manifest.flush()) {
+            throw std::runtime_error("Cannot write " + manifest_path.string());
+        }
+        std::cout << "Manifest: " << manifest_path.string() << ", files: " << paths.size() << "\n"
+                  << "Total lines: " << total_lines << "\n";
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int run_verify_manifest_mode(const std::filesystem::path &directory, const std::vector<std::string> &options) {
+    /**
+     * Check the files listed in -verify-manifest=FILE, paths are relative to the directory.
+     * Both the "<hex>  <path>" and the tagged "ALGORITHM (path) = <hex>" lines are accepted,
+     * untagged lines are SHA-256. Every file is read once for all of its listed checksums.
+     *
+     * @param directory directory the manifest paths are relative to
+     * @param options parsed command line options
+     * @return process exit code, 1 if any file is missing or does not match
+     */
+    std::filesystem::path manifest_path = option_value(options, "verify-manifest");
+    struct Entry {
+        std::string name;
+        std::vector<std::pair<unsigned, std::string>> expected;
+    };
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, size_t> entry_index;
+    unsigned algorithms = 0;
+
+    std::ifstream manifest{manifest_path, std::ios::binary};
+    if (!manifest) {
+        std::cout << "Cannot open " << manifest_path.string() << "\n";
+        return 1;
+    }
+    size_t malformed = 0;
+    for (std::string line; std::getline(manifest, line);) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        unsigned algorithm = 0;
+        std::string name;
+        std::string hex;
+        size_t open = line.find(" (");
+        size_t close = line.rfind(") = ");
+        if (open != std::string::npos && close != std::string::npos && close > open) {
+            std::string tag = line.substr(0, open);
+            for (const auto &[bit, known]: checksum_names) {
+                if (tag == known) {
+                    algorithm = bit;
+                }
+            }
+            name = line.substr(open + 2, close - open - 2);
+            hex = line.substr(close + 4);
+        } else if (line.size() > 66 && line.compare(64, 2, "  ") == 0) {
+            algorithm = checksum_sha256;
+            hex = line.substr(0, 64);
+            name = line.substr(66);
+        }
+        size_t digits = algorithm == checksum_crc32c ? 8 : algorithm == checksum_xxh3 ? 16 : 64;
+        if (algorithm == 0 || hex.size() != digits ||
+            hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+            ++malformed;
+            continue;
+        }
+        std::transform(hex.begin(), hex.end(), hex.begin(), [](unsigned char c) { return std::tolower(c); });
+        auto [position, inserted] = entry_index.try_emplace(name, entries.size());
+        if (inserted) {
+            entries.push_back({name, {}});
+        }
+        entries[position->second].expected.emplace_back(algorithm, hex);
+        algorithms |= algorithm;
+    }
+
+    std::vector<std::filesystem::path> paths;
+    std::vector<size_t> checked;
+    for (size_t index = 0; index < entries.size(); ++index) {
+        std::filesystem::path file_path = directory / entries[index].name;
+        std::error_code error;
+        if (std::filesystem::is_regular_file(file_path, error)) {
+            paths.push_back(file_path);
+            checked.push_back(index);
+        }
+    }
+
+    std::vector<FileChecksums> results;
+    try {
+        results = checksum_files(paths, algorithms);
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+
+    size_t failed = 0;
+    size_t missing = entries.size() - checked.size();
+    uint64_t total_lines = 0;
+    size_t next_checked = 0;
+    for (size_t index = 0; index < entries.size(); ++index) {
+        if (next_checked == checked.size() || checked[next_checked] != index) {
+            std::cout << entries[index].name << ": MISSING\n";
+            continue;
+        }
+        const FileChecksums &result = results[next_checked++];
+        bool ok = true;
+        for (const auto &[algorithm, hex]: entries[index].expected) {
+            ok = ok && checksum_of(result, algorithm) == hex;
+        }
+        failed += ok ? 0 : 1;
+        total_lines += result.lines;
+        std::cout << entries[index].name << ": " << (ok ? "OK" : "FAILED") << "\n";
+    }
+    std::cout << "Verified files: " << checked.size() << ", failed: " << failed << ", missing: " << missing;
+    if (malformed > 0) {
+        std::cout << ", malformed lines: " << malformed;
+    }
+    std::cout << "\nTotal lines: " << total_lines << "\n";
+    return failed == 0 && missing == 0 && malformed == 0 && !entries.empty() ? 0 : 1;
+}
+
+/**
+ * Line counts of tar archive members without extraction.
+ *
+ * The archive is read front to back with NCOUNT_BUFFER_SIZE reads into a pooled buffer, or, when it
+ * starts with the gzip magic, inflated with zlib into one half of the buffer while the other half
+ * holds compressed input. Either way the bytes go through TarCounter, which walks the 512-byte
+ * headers and hands member payloads straight to count_newlines, so one pass gives all counts and
+ * nothing is written to disk. Supported headers: ustar names with prefixes, pax extended headers
+ * (path and size records, global headers are skipped) and GNU long names; base-256 sizes of GNU tar
+ * are decoded. Links, directories and device entries have no lines and are not listed.
+ */
+
+static uint64_t tar_number(const char *field, size_t size) {
+    /**
+     * Parse a numeric header field, octal or GNU base-256 when the high bit of the first byte is set.
+     */
+    auto bytes = reinterpret_cast<const unsigned char *>(field);
+    uint64_t value = 0;
+    if (bytes[0] & 0x80) {
+        value = bytes[0] & 0x3F;
+        for (size_t i = 1; i < size; ++i) {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < size && field[i] == ' ') {
+        ++i;
+    }
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
+    }
+    return value;
+}
+
+static std::string tar_string(const char *field, size_t size) {
+    return {field, strnlen(field, size)};
+}
+
+void TarCounter::feed(const char *data, size_t size) {
+    /**
+     * Consume the next bytes of the archive.
+     *
+     * @param data pointer to the first byte
+     * @param size number of bytes
+     */
+    while (size > 0 && !finished()) {
+        if (payload_left > 0) {
+            size_t piece = static_cast<size_t>(std::min<uint64_t>(payload_left, size));
+            if (payload == Payload::member) {
+                members.back().lines += count_newlines(data, piece);
+                last_byte = data[piece - 1];
+            } else if (payload == Payload::pax || payload == Payload::long_name) {
+                extended.append(data, piece);
+            }
+            data += piece;
+            size -= piece;
+            payload_left -= piece;
+            if (payload_left == 0) {
+                end_payload();
+            }
+        } else if (padding_left > 0) {
+            size_t piece = static_cast<size_t>(std::min<uint64_t>(padding_left, size));
+            data += piece;
+            size -= piece;
+            padding_left -= piece;
+        } else {
+            size_t piece = std::min(size, sizeof(header) - header_fill);
+            std::memcpy(header + header_fill, data, piece);
+            header_fill += piece;
+            data += piece;
+            size -= piece;
+            if (header_fill == sizeof(header)) {
+                header_fill = 0;
+                parse_header();
+            }
+        }
+    }
+}
+
+void TarCounter::parse_header() {
+    if (std::all_of(header, header + sizeof(header), [](char c) { return c == 0; })) {
+        ++zero_blocks;
+        return;
+    }
+    if (zero_blocks > 0) {
+        throw std::runtime_error("Invalid tar archive: data after an empty block");
+    }
+    // the checksum treats its own field as spaces; some old writers summed signed bytes
+    uint64_t unsigned_sum = 0;
+    int64_t signed_sum = 0;
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        char byte = i >= 148 && i < 156 ? ' ' : header[i];
+        unsigned_sum += static_cast<unsigned char>(byte);
+        signed_sum += static_cast<signed char>(byte);
+    }
+    uint64_t checksum = tar_number(header + 148, 8);
+    if (checksum != unsigned_sum && static_cast<int64_t>(checksum) != signed_sum) {
+        throw std::runtime_error("Invalid tar header checksum");
+    }
+
+    std::string name = tar_string(header, 100);
+    if (std::memcmp(header + 257, "ustar", 5) == 0 && header[345] != 0 && std::memcmp(header + 257, "ustar  ", 8) != 0) {
+        name = tar_string(header + 345, 155) + "/" + name; // POSIX prefix, absent from the old GNU layout
+    }
+    uint64_t size = tar_number(header + 124, 12);
+    char type = header[156];
+    if (type == 'x' || type == 'L') {
+        if (size > TAR_EXTENDED_HEADER_LIMIT) {
+            throw std::runtime_error("Tar extended header is too large");
+        }
+        payload = type == 'x' ? Payload::pax : Payload::long_name;
+        extended.clear();
+    } else {
+        if (!next_name.empty()) {
+            name = next_name;
+        }
+        if (has_next_size) {
+            size = next_size;
+        }
+        next_name.clear();
+        has_next_size = false;
+        if (type == '0' || type == '\0' || type == '7') {
+            members.push_back({name, size, 0});
+            payload = Payload::member;
+            last_byte = '\n';
+        } else {
+            payload = Payload::skip; // links, directories, devices, global pax headers, GNU sparse maps
+        }
+    }
+    payload_left = size;
+    padding_left = (512 - size % 512) % 512;
+    if (size == 0) {
+        end_payload();
+    }
+}
+
+void TarCounter::end_payload() {
+    if (payload == Payload::member) {
+        if (last_byte != '\n') {
+            ++members.back().lines; // last line without a terminator
+        }
+    } else if (payload == Payload::long_name) {
+        next_name = extended.substr(0, extended.find('\0'));
+    } else if (payload == Payload::pax) {
+        // records are "<length> <key>=<value>\n", the length counts the whole record
+        size_t position = 0;
+        while (position < extended.size()) {
+            uint64_t length = 0;
+            const char *record_start = extended.data() + position;
+            const char *extended_end = extended.data() + extended.size();
+            auto [end, error] = std::from_chars(record_start, extended_end, length);
+            // the length must cover its own "<digits> " prefix and the closing newline
+            if (error != std::errc{} || end == extended_end || *end != ' ' ||
+                length < static_cast<uint64_t>(end - record_start) + 2 || length > extended.size() - position ||
+                record_start[length - 1] != '\n') {
+                throw std::runtime_error("Invalid pax extended header");
+            }
+            std::string_view record{end + 1, static_cast<size_t>(record_start + length - 1 - (end + 1))};
+            size_t equals = record.find('=');
+            if (equals != std::string_view::npos) {
+                std::string_view key = record.substr(0, equals);
+                std::string_view value = record.substr(equals + 1);
+                if (key == "path") {
+                    next_name = value;
+                } else if (key == "size") {
+                    auto [size_end, size_error] = std::from_chars(value.data(), value.data() + value.size(), next_size);
+                    if (size_error != std::errc{} || size_end != value.data() + value.size()) {
+                        throw std::runtime_error("Invalid pax size record");
+                    }
+                    has_next_size = true;
+                }
+            }
+            position += length;
+        }
+    }
+    payload = Payload::skip;
+}
+
+void TarCounter::finish() const {
+    /**
+     * Check that the archive did not end inside a header or a payload.
+     */
+    if (header_fill > 0 || payload_left > 0 || padding_left > 0) {
+        throw std::runtime_error("Truncated tar archive");
+    }
+}
+
+std::vector<TarMember> count_tar_members(const std::filesystem::path &archive_path) {
+    /**
+     * Count lines of every regular member of a tar or gzip compressed tar archive.
+     *
+     * @param archive_path path to the archive
+     * @return members in archive order
+     */
+    int fd = ::open(archive_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + archive_path.string());
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    BufferPool &pool = line_buffer_pool();
+    std::unique_ptr<char[]> buffer = pool.acquire();
+    TarCounter counter;
+
+    auto read_some = [&](char *target, size_t size) {
+        ssize_t count;
+        do {
+            count = ::read(fd, target, size);
+        } while (count < 0 && errno == EINTR);
+        if (count < 0) {
+            throw std::runtime_error("Cannot read " + archive_path.string());
+        }
+        return static_cast<size_t>(count);
+    };
+
+    try {
+        size_t half = pool.buffer_size / 2;
+        size_t count = read_some(buffer.get(), half);
+        bool gzip = count >= 2 && static_cast<unsigned char>(buffer[0]) == 0x1F &&
+                    static_cast<unsigned char>(buffer[1]) == 0x8B;
+        if (!gzip) {
+            while (count > 0 && !counter.finished()) {
+                counter.feed(buffer.get(), count);
+                count = read_some(buffer.get(), pool.buffer_size);
+            }
+        } else {
+#if defined(AXXONSOFT_HAVE_ZLIB)
+            char *input = buffer.get();
+            char *output = buffer.get() + half;
+            z_stream stream{};
+            if (::inflateInit2(&stream, 15 + 16) != Z_OK) { // gzip wrapper only
+                throw std::runtime_error("Cannot initialize zlib");
+            }
+            std::unique_ptr<z_stream, int (*)(z_stream *)> stream_guard{&stream, ::inflateEnd};
+            stream.next_in = reinterpret_cast<Bytef *>(input);
+            stream.avail_in = static_cast<uInt>(count);
+            while (!counter.finished()) {
+                if (stream.avail_in == 0) {
+                    count = read_some(input, half);
+                    if (count == 0) {
+                        break;
+                    }
+                    stream.next_in = reinterpret_cast<Bytef *>(input);
+                    stream.avail_in = static_cast<uInt>(count);
+                }
+                stream.next_out = reinterpret_cast<Bytef *>(output);
+                stream.avail_out = static_cast<uInt>(half);
+                int status = ::inflate(&stream, Z_NO_FLUSH);
+                if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                    throw std::runtime_error("Corrupt gzip stream in " + archive_path.string());
+                }
+                counter.feed(output, half - stream.avail_out);
+                if (status == Z_STREAM_END) {
+                    ::inflateReset(&stream); // concatenated gzip members
+                }
+            }
+#else
+            throw std::runtime_error("Compressed archives need a build with zlib");
+#endif
+        }
+        counter.finish();
+    } catch (...) {
+        pool.release(std::move(buffer));
+        ::close(fd);
+        throw;
+    }
+    pool.release(std::move(buffer));
+    ::close(fd);
+    return std::move(counter.members);
+}
+
+int run_tar_mode(const std::vector<std::string> &options) {
+    /**
+     * Print the line count of every member of the archive -tar=FILE and the total.
+     *
+     * @param options parsed command line options
+     * @return process exit code
+     */
+    std::filesystem::path archive_path = option_value(options, "tar");
+    try {
+        std::vector<TarMember> members = count_tar_members(archive_path);
+        uint64_t total_lines = 0;
+        for (const auto &member: members) {
+            std::cout << member.name << "\t" << member.lines << " lines\n";
+            total_lines += member.lines;
+        }
+        std::cout << "Members: " << members.size() << "\n"
+                  << "Total lines: " << total_lines << "\n";
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Line counts of zip archive members.
+ *
+ * The archive is mapped and its central directory, found through the end of central directory
+ * record (and the zip64 locator for archives over 4 GB or 65535 members), lists every member with
+ * its sizes and the offset of its local header. Members are independent, so each one is a task of
+ * a ThreadPool with a thread per core, and the pool threads take them in directory order. The
+ * mapping and the member list outlive the pool, whose destructor waits for the last task. Stored
+ * members are counted in place in the mapping; deflated members are inflated with zlib in
+ * streaming mode into a buffer from line_buffer_pool() and counted chunk by chunk, so no member is
+ * ever held in memory whole.
+ * Members that cannot be counted (encrypted, other compression methods, corrupt data) are
+ * reported individually and do not stop the others.
+ */
+
+static uint16_t zip_read16(const char *data) {
+    auto bytes = reinterpret_cast<const unsigned char *>(data);
+    return static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t zip_read32(const char *data) {
+    return zip_read16(data) | (static_cast<uint32_t>(zip_read16(data + 2)) << 16);
+}
+
+static uint64_t zip_read64(const char *data) {
+    return zip_read32(data) | (static_cast<uint64_t>(zip_read32(data + 4)) << 32);
+}
+
+std::vector<ZipMember> read_zip_directory(const char *data, size_t size) {
+    /**
+     * Parse the central directory of a zip archive.
+     *
+     * @param data pointer to the mapped archive
+     * @param size size of the archive
+     * @return file members in central directory order, directories are skipped
+     */
+    // the end of central directory record is 22 bytes plus a comment of up to 65535 bytes
+    size_t end_record = std::string::npos;
+    for (size_t position = size >= 22 ? size - 22 : 0; size >= 22; --position) {
+        if (zip_read32(data + position) == 0x06054b50) {
+            end_record = position;
+            break;
+        }
+        if (position == 0 || size - position > 22 + 0xFFFF) {
+            break;
+        }
+    }
+    if (end_record == std::string::npos) {
+        throw std::runtime_error("Not a zip archive: end of central directory not found");
+    }
+    uint64_t entries = zip_read16(data + end_record + 10);
+    uint64_t directory_size = zip_read32(data + end_record + 12);
+    uint64_t directory_offset = zip_read32(data + end_record + 16);
+    if (end_record >= 20 && zip_read32(data + end_record - 20) == 0x07064b50) {
+        uint64_t zip64_record = zip_read64(data + end_record - 20 + 8);
+        if (size < 56 || zip64_record > size - 56 || zip_read32(data + zip64_record) != 0x06064b50) {
+            throw std::runtime_error("Invalid zip64 end of central directory");
+        }
+        entries = zip_read64(data + zip64_record + 32);
+        directory_size = zip_read64(data + zip64_record + 40);
+        directory_offset = zip_read64(data + zip64_record + 48);
+    }
+    if (directory_offset > size || directory_size > size - directory_offset) {
+        throw std::runtime_error("Invalid zip central directory");
+    }
+
+    std::vector<ZipMember> members;
+    const char *position = data + directory_offset;
+    const char *end = position + directory_size;
+    for (uint64_t entry = 0; entry < entries; ++entry) {
+        if (end - position < 46 || zip_read32(position) != 0x02014b50) {
+            throw std::runtime_error("Invalid zip central directory entry");
+        }
+        ZipMember member;
+        member.flags = zip_read16(position + 8);
+        member.method = zip_read16(position + 10);
+        member.compressed_size = zip_read32(position + 20);
+        member.size = zip_read32(position + 24);
+        size_t name_length = zip_read16(position + 28);
+        size_t extra_length = zip_read16(position + 30);
+        size_t comment_length = zip_read16(position + 32);
+        member.header_offset = zip_read32(position + 42);
+        if (static_cast<size_t>(end - position) < 46 + name_length + extra_length + comment_length) {
+            throw std::runtime_error("Invalid zip central directory entry");
+        }
+        member.name.assign(position + 46, name_length);
+
+        // zip64 extended information holds the fields saturated at 0xFFFFFFFF, in this order
+        const char *extra = position + 46 + name_length;
+        const char *extra_end = extra + extra_length;
+        while (extra_end - extra >= 4) {
+            uint16_t id = zip_read16(extra);
+            uint16_t length = zip_read16(extra + 2);
+            const char *field = extra + 4;
+            const char *field_end = std::min(field + length, extra_end);
+            if (id == 0x0001) {
+                for (uint64_t *value: {&member.size, &member.compressed_size, &member.header_offset}) {
+                    if (*value == 0xFFFFFFFF && field_end - field >= 8) {
+                        *value = zip_read64(field);
+                        field += 8;
+                    }
+                }
+            }
+            extra += 4 + length;
+        }
+        position += 46 + name_length + extra_length + comment_length;
+
+        if (member.name.empty() || member.name.back() != '/') {
+            members.push_back(std::move(member));
+        }
+    }
+    return members;
+}
+
+void count_zip_member(const char *data, size_t size, ZipMember &member, char *buffer, size_t buffer_size) {
+    /**
+     * Count lines of one member, setting member.lines or member.error.
+     *
+     * @param data pointer to the mapped archive
+     * @param size size of the archive
+     * @param member member from read_zip_directory
+     * @param buffer inflate output buffer
+     * @param buffer_size size of the buffer
+     */
+    if (member.header_offset > size - std::min<size_t>(size, 30) ||
+        zip_read32(data + member.header_offset) != 0x04034b50) {
+        member.error = "invalid local header";
+        return;
+    }
+    // the local header has its own name and extra field lengths
+    uint64_t payload_offset = member.header_offset + 30 + zip_read16(data + member.header_offset + 26) +
+                              zip_read16(data + member.header_offset + 28);
+    if (payload_offset > size || member.compressed_size > size - payload_offset) {
+        member.error = "member data outside of the archive";
+        return;
+    }
+    if (member.flags & 1) {
+        member.error = "encrypted";
+        return;
+    }
+    const char *payload = data + payload_offset;
+    size_t payload_size = static_cast<size_t>(member.compressed_size);
+    if (payload_size > 0) {
+        // the mapping is sequential for the whole archive, members are read in any order
+        size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        size_t aligned = static_cast<size_t>(payload_offset) / page * page;
+        ::madvise(const_cast<char *>(data + aligned), payload_offset + payload_size - aligned, MADV_WILLNEED);
+    }
+
+    uint64_t lines = 0;
+    uint64_t produced = 0;
+    char last_byte = '\n';
+    if (member.method == 0) {
+        lines = count_newlines(payload, payload_size); // zero-copy, straight from the mapping
+        produced = payload_size;
+        if (payload_size > 0) {
+            last_byte = payload[payload_size - 1];
+        }
+    } else if (member.method == 8) {
+#if defined(AXXONSOFT_HAVE_ZLIB)
+        z_stream stream{};
+        if (::inflateInit2(&stream, -15) != Z_OK) { // raw deflate, zip has no zlib wrapper
+            member.error = "cannot initialize zlib";
+            return;
+        }
+        std::unique_ptr<z_stream, int (*)(z_stream *)> stream_guard{&stream, ::inflateEnd};
+        const char *input = payload;
+        size_t input_left = payload_size;
+        int status = Z_OK;
+        while (status != Z_STREAM_END) {
+            if (stream.avail_in == 0) {
+                stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input));
+                stream.avail_in = static_cast<uInt>(std::min<size_t>(input_left, std::numeric_limits<uInt>::max()));
+                input += stream.avail_in;
+                input_left -= stream.avail_in;
+            }
+            stream.next_out = reinterpret_cast<Bytef *>(buffer);
+            stream.avail_out = static_cast<uInt>(buffer_size);
+            status = ::inflate(&stream, Z_NO_FLUSH);
+            size_t count = buffer_size - stream.avail_out;
+            if (count > 0) {
+                lines += count_newlines(buffer, count);
+                last_byte = buffer[count - 1];
+                produced += count;
+            }
+            if ((status != Z_OK && status != Z_STREAM_END) ||
+                (status == Z_OK && count == 0 && stream.avail_in == 0 && input_left == 0)) {
+                member.error = "corrupt deflate data";
+                return;
+            }
+        }
+#else
+        member.error = "deflated members need a build with zlib";
+        return;
+#endif
+    } else {
+        member.error = "unsupported compression method " + std::to_string(member.method);
+        return;
+    }
+    if (produced != member.size) {
+        member.error = "size mismatch";
+        return;
+    }
+    if (last_byte != '\n') {
+        ++lines; // last line without a terminator
+    }
+    member.lines = lines;
+}
+
+int run_zip_mode(const std::vector<std::string> &options) {
+    /**
+     * Print the line count of every member of the archive -zip=FILE and the total, counting
+     * members in parallel.
+     *
+     * @param options parsed command line options
+     * @return process exit code, 1 if any member could not be counted
+     */
+    std::filesystem::path archive_path = option_value(options, "zip");
+    std::vector<ZipMember> members;
+    try {
+        MappedFile map{archive_path};
+        members = read_zip_directory(map.data, map.size);
+
+        // one task per member on a ThreadPool, whose destructor runs all tasks before it returns
+        ThreadPool threads{std::max(1u, std::thread::hardware_concurrency())};
+        for (auto &member: members) {
+            threads.submit([&map, &member] {
+                BufferPool &pool = line_buffer_pool();
+                std::unique_ptr<char[]> buffer = pool.acquire();
+                try {
+                    count_zip_member(map.data, map.size, member, buffer.get(), pool.buffer_size);
+                } catch (const std::exception &error) {
+                    member.error = error.what();
+                }
+                pool.release(std::move(buffer));
+            });
+        }
+    } catch (const std::exception &error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+
+    uint64_t total_lines = 0;
+    size_t failed = 0;
+    for (const auto &member: members) {
+        if (!member.error.empty()) {
+            std::cout << member.name << "\t" << member.error << "\n";
+            ++failed;
+            continue;
+        }
+        std::cout << member.name << "\t" << member.lines << " lines\n";
+        total_lines += member.lines;
+    }
+    std::cout << "Members: " << members.size();
+    if (failed > 0) {
+        std::cout << ", not counted: " << failed;
+    }
+    std::cout << "\nTotal lines: " << total_lines << "\n";
+    return failed == 0 ? 0 : 1;
+}
+
+/**
+ * Function to parse command line options implemented from scratch due there is no any ready to
+ * using implementation of command line options parser in the STL.
+ *
+ * This solution has a few limitations. It assumes that there is at most one directory argument
+ * and that it is the last non-option argument. If more than one directory is provided, only the
+ * last one is recorded. Similarly, if a directory is followed by an option, the option will be
+ * treated as part of the directory's value. More advanced parsing strategies or dedicated libraries
+ * can handle these situations more robustly.
+ *
+ * Parse command line options.
+ * @param argc
+ * @param argv
+ * @return
+ */
+
+std::vector<std::string> parse_cli_options(int argc, char *argv[], std::string &directory) {
+    std::vector<std::string> options;
+
+    for (int i = 1; i < argc; ++i) { // Start at 1 to skip the program name
+        std::string arg = argv[i];
+
+        if (arg[0] == '-') { // If it starts with '-', it's an option, both "-opt" and "--opt" are accepted
+            size_t name_start = arg.find_first_not_of('-');
+            options.push_back(name_start == std::string::npos ? std::string{} : arg.substr(name_start));
+        } else {
+            directory = arg; // If it does not start with '-', treat it as a directory
+        }
+    }
+    return options;
+}
+
+std::string option_value(const std::vector<std::string> &options, const std::string &name) {
+    /**
+     * Get the value of an option given as "-name=value".
+     *
+     * @param options options returned by parse_cli_options
+     * @param name option name without leading dashes
+     * @return option value, empty string if the option is not present
+     */
+    for (const auto &option: options) {
+        if (option.size() > name.size() && option.compare(0, name.size(), name) == 0 && option[name.size()] == '=') {
+            return option.substr(name.size() + 1);
+        }
+    }
+    return {};
 }
 
 void print_help() {
@@ -289,8 +8106,59 @@ void print_help() {
               << "  -g   use getline method. Used by default. \n"
               << "  -n   use \\n counting \n"
               << "  -m   use buffered \\n counting \n"
-              << "  -b   benchmark two methods \n"
+              << "  -v   use zero-copy line views \n"
+              << "  -max-memory=MB     hard limit of buffers, tables, queues and caches (not file mappings), prints peak RSS and governor stalls \n"
+              << "  -verify=RATE       re-count a random share of files (0 to 1) with the getline method, exit code 1 on a mismatch \n"
+              << "  -b   benchmark the getline, \\n counting, buffered \\n counting and line view methods \n"
+              << "  -formats           detect the format of every file and count its records \n"
+              << "  -distinct          count distinct lines exactly \n"
+              << "  -distinct-out=FILE write every distinct line once \n"
+              << "  -distinct-memory=MB  memory for buffered lines and deduplication, half of it before spilling to disk, 512 by default \n"
+              << "  -distinct-spill=DIR  directory for spill files, system temp directory by default \n"
+              << "  -hll               estimate distinct lines per file and in total \n"
+              << "  -hll-tokens        estimate distinct whitespace separated tokens too \n"
+              << "  -hll-out=FILE      save the sketches of every file and the aggregate \n"
+              << "  -hll-merge=LIST    merge aggregates saved by earlier runs, comma separated \n"
+              << "  -heavy             list the most frequent lines with count bounds \n"
+              << "  -top=N             number of lines or tokens listed, 10 by default \n"
+              << "  -near-duplicates   list pairs of near-duplicate files \n"
+              << "  -similarity=S      minimal estimated Jaccard similarity of listed pairs, in (0, 1], 0.8 by default \n"
+              << "  -cdc               count lines incrementally, recounting only changed chunks \n"
+              << "  -cdc-cache=FILE    chunk cache, .axxonsoft_cdc_cache by default \n"
+              << "  -tokens            list the most frequent tokens, -top=N of them \n"
+              << "  -tokens-prefix=P   tokenize only lines starting with P, e.g. \"DE   \" \n"
+              << "  -tokens-out=FILE   write all tokens with their counts \n"
+              << "  -csv               count CSV records, newlines inside quoted fields do not end records \n"
+              << "  -csv-delimiter=C   CSV field delimiter, ',' by default, \\t for tab \n"
+              << "  -normalize         rewrite line endings of files that need it \n"
+              << "  -normalize-to=E    target line ending, lf (default) or crlf \n"
+              << "  -normalize-in-place convert to lf inside the files instead of through a temporary file, not with crlf \n"
+              << "  -utf8              count lines and report invalid UTF-8 \n"
+              << "  -map               print lines of all files in order, processed in parallel \n"
+              << "  -map-grep=TEXT     keep lines containing TEXT \n"
+              << "  -map-field=N       keep the N-th whitespace separated field \n"
+              << "  -map-out=FILE      write to FILE instead of the standard output \n"
+              << "  -manifest=FILE     count lines and write a checksum manifest of the files \n"
+              << "  -manifest-hash=LIST  sha256 (default), xxh3, crc32c, comma separated \n"
+              << "  -verify-manifest=FILE  check the files of the directory against a manifest \n"
+              << "  -copy-to=DIR       copy the directory tree to DIR and count lines while copying \n"
+              << "  -plugin=PATH       run the counters of a plugin shared object, see axxonsoft_plugin.h \n"
+              << "  -plugin-args=TEXT  arguments passed to the plugin \n"
               << "  -h   print this help message \n"
+              << "  -matrix=FILE       read a ragged lower-triangular matrix (text or binary) \n"
+              << "  -matrix-out=FILE   export the matrix read by -matrix to the binary format \n"
+              << "  -kv=FILE           extract fields from blank line separated \"Key: value\" records \n"
+              << "  -kv-fields=LIST    comma separated keys to extract \n"
+              << "  -kv-format=FORMAT  tsv (default, tab, newline, carriage return and backslash in values escaped as \\t, \\n, \\r, \\\\) or binary \n"
+              << "  -kv-out=FILE       write extracted records to the file instead of stdout \n"
+              << "  -fw=FILE           extract fields from a fixed-width report \n"
+              << "  -fw-layout=FILE    layout of the report, e.g. layouts/FAME.layout \n"
+              << "  -fw-out=FILE       write extracted rows to the file instead of stdout \n"
+              << "  -aln=FILE          read a position prefixed alignment and print its summary \n"
+              << "  -aln-out=FILE      write reconstructed sequences as FASTA \n"
+              << "  -aln-stats=FILE    write per column gap fraction and conservation as TSV \n"
+              << "  -tar=FILE          count lines of every member of a tar or tar.gz archive \n"
+              << "  -zip=FILE          count lines of every member of a zip archive in parallel \n"
               << "directory: The path to the directory to process. \n"
                  "           This argument must not be prefixed with '-'.\n";
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+//
+// Example plugin: counts lines containing a marker, given with -plugin-args ("ID" by default).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../axxonsoft_plugin.h"
+
+typedef struct marker_state {
+    char *marker;
+    size_t marker_size;
+    uint64_t lines;
+    uint64_t marked_lines;
+    uint64_t marked_files;
+    int file_marked; /* the current file had a marked line */
+} marker_state;
+
+int axxonsoft_plugin_abi_version(void) {
+    return AXXONSOFT_PLUGIN_ABI_VERSION;
+}
+
+void *axxonsoft_plugin_init(const char *arguments) {
+    marker_state *state = calloc(1, sizeof(marker_state));
+    if (state == NULL) {
+        return NULL;
+    }
+    state->marker = strdup(arguments[0] != '\0' ? arguments : "ID");
+    if (state->marker == NULL) {
+        free(state);
+        return NULL;
+    }
+    state->marker_size = strlen(state->marker);
+    return state;
+}
+
+int axxonsoft_plugin_process(void *state_pointer, const axxonsoft_buffer *buffer) {
+    marker_state *state = state_pointer;
+    const char *cursor = buffer->data;
+    const char *end = buffer->data + buffer->size;
+    while (cursor < end) {
+        const char *newline = memchr(cursor, '\n', (size_t) (end - cursor));
+        const char *line_end = newline == NULL ? end : newline;
+        if ((size_t) (line_end - cursor) >= state->marker_size &&
+            memmem(cursor, (size_t) (line_end - cursor), state->marker, state->marker_size) != NULL) {
+            ++state->marked_lines;
+            state->file_marked = 1;
+        }
+        ++state->lines;
+        cursor = line_end + 1;
+    }
+    if (buffer->last) {
+        state->marked_files += state->file_marked;
+        state->file_marked = 0;
+    }
+    return 0;
+}
+
+int axxonsoft_plugin_merge(void *state_pointer, void *other_pointer) {
+    marker_state *state = state_pointer;
+    marker_state *other = other_pointer;
+    state->lines += other->lines;
+    state->marked_lines += other->marked_lines;
+    state->marked_files += other->marked_files;
+    free(other->marker);
+    free(other);
+    return 0;
+}
+
+int axxonsoft_plugin_finalize(void *state_pointer, axxonsoft_emit_function emit, void *context) {
+    marker_state *state = state_pointer;
+    /* the marker is emitted on its own, it has any length; the formatted parts always fit the buffer */
+    char report[128];
+    int size = snprintf(report, sizeof(report), "Lines: %llu\nLines with \"", (unsigned long long) state->lines);
+    if (size > 0) {
+        emit(context, report, (size_t) size);
+    }
+    emit(context, state->marker, state->marker_size);
+    size = snprintf(report, sizeof(report), "\": %llu in %llu files\n", (unsigned long long) state->marked_lines,
+                    (unsigned long long) state->marked_files);
+    if (size > 0) {
+        emit(context, report, (size_t) size);
+    }
+    free(state->marker);
+    free(state);
+    return 0;
+}
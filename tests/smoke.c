@@ -0,0 +1,101 @@
+//
+// Smoke test of the C interface of libaxxonsoft, run by ctest against a directory of text files.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "axxonsoft.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                          \
+    do {                                                                          \
+        if (!(condition)) {                                                       \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                           \
+        }                                                                         \
+    } while (0)
+
+/* Lines as std::getline counts them: a last line without a newline counts. */
+static uint64_t count_lines(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return AXXONSOFT_LINES_ERROR;
+    }
+    uint64_t lines = 0;
+    int last = '\n';
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '\n') {
+            ++lines;
+        }
+        last = c;
+    }
+    fclose(file);
+    return last == '\n' ? lines : lines + 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: %s directory file\n", argv[0]);
+        return 2;
+    }
+    const char *directory = argv[1];
+    const char *file = argv[2];
+
+    axxonsoft_context *context = axxonsoft_create(2);
+    CHECK(context != NULL);
+    if (context == NULL) {
+        return 1;
+    }
+
+    /* counts, and a missing file reported in place without losing the others */
+    const char *paths[] = {file, "axxonsoft_smoke_missing_file", file};
+    uint64_t lines[3] = {0, 0, 0};
+    CHECK(axxonsoft_count_files(context, paths, 3, lines) == AXXONSOFT_ERROR_IO);
+    CHECK(lines[0] == count_lines(file));
+    CHECK(lines[0] != AXXONSOFT_LINES_ERROR);
+    CHECK(lines[1] == AXXONSOFT_LINES_ERROR);
+    CHECK(lines[2] == lines[0]);
+    CHECK(axxonsoft_count_files(context, paths, 1, lines) == AXXONSOFT_OK);
+    CHECK(axxonsoft_count_files(context, NULL, 1, lines) == AXXONSOFT_ERROR_ARGUMENT);
+
+    uint64_t total_lines = 0;
+    uint64_t files = 0;
+    CHECK(axxonsoft_count_directory(context, directory, &total_lines, &files) == AXXONSOFT_OK);
+    CHECK(files > 0);
+    CHECK(total_lines >= lines[0]);
+    CHECK(axxonsoft_count_directory(context, "axxonsoft_smoke_missing_directory", &total_lines, NULL)
+          == AXXONSOFT_ERROR_IO);
+
+    /* job submit, wait and stats */
+    axxonsoft_job *job = NULL;
+    CHECK(axxonsoft_submit_job(context, directory, "smoke", 1, 0, &job) == AXXONSOFT_OK);
+    CHECK(job != NULL);
+    if (job != NULL) {
+        uint64_t job_lines = 0;
+        CHECK(axxonsoft_job_wait(job, &job_lines) == AXXONSOFT_OK);
+        CHECK(job_lines == total_lines);
+        axxonsoft_job_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        CHECK(axxonsoft_job_get_stats(job, &stats) == AXXONSOFT_OK);
+        CHECK(stats.state == AXXONSOFT_JOB_DONE);
+        CHECK(stats.files == files);
+        CHECK(stats.failed_files == 0);
+        CHECK(stats.lines == total_lines);
+        CHECK(stats.bytes_done == stats.bytes);
+        CHECK(stats.tasks_done == stats.tasks);
+        axxonsoft_job_release(job);
+    }
+
+    CHECK(strlen(axxonsoft_status_string(AXXONSOFT_ERROR_IO)) > 0);
+    axxonsoft_destroy(context);
+
+    if (failures != 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}